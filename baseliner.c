@@ -3,6 +3,7 @@
  * was taken from:
  * https://banu.com/blog/2/how-to-use-epoll-a-complete-example-in-c/epoll-example.c
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,35 +18,399 @@
 #include <stdbool.h>
 #include <sys/resource.h>
 #include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "baseliner_config.h"
 #include "ceph_handler.h"
+#include "bucket_index.h"
+#include "http_parser.h"
+#include "trace.h"
+#include "proxy.h"
+#include "compress.h"
+#include "perf_counters.h"
+#include "tls.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+#include "histogram.h"
 
 #define KiB 1024
 #define MiB 1024*KiB
 
 #define MAXEVENTS 64
-#define MAX_CONTENT_SIZE 1*MiB
-#define READ_BUFFER_SIZE 512 //B
+#define DEFAULT_BUCKET "baseliner"
+
+// Busy-poll mode (-b)
+#define BUSY_POLL_USECS 50                  // the kernel may busy-poll a socket's device queue for on reads
+#define BUSY_SPIN_MIN_NS 10*1000ULL         // the event loop spins this long at least before sleeping,
+#define BUSY_SPIN_MAX_NS 200*1000ULL        // and this long at most
+
+// Timeouts (-o), like nginx's client_header_timeout, client_body_timeout and keepalive_timeout
+#define TIMER_TICK_MS 100                   // resolution of the timeouts, the event loop wakes up this often for them
+#define DEFAULT_HEADER_TIMEOUT 60           // s
+#define DEFAULT_BODY_TIMEOUT 60
+#define DEFAULT_IDLE_TIMEOUT 75
+
+static volatile sig_atomic_t running = 1;
+
+/* Threads serving connections, shutdown waits for them before tearing down what they use */
+static void *(*serve_connection)(void*);
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+static unsigned long n_workers = 0;
+
+/* Open connections, so the interval reports can go through their counters */
+static struct EventData *connections = NULL;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long closed_bytes = 0;          // read on connections closed since the last report
+static unsigned long closed_bytes_total = 0;
+static unsigned long n_connections = 0;         // accepted since the start
+static unsigned long n_open = 0;
+static unsigned long max_open = 0;
+
+/* Finished requests are recorded here with -t */
+static int trace_fd = -1;
+
+/* Object buffers of requests in progress */
+static struct BufferPool content_pool = BUFFER_POOL_INITIALIZER(MAX_CONTENT_SIZE);
+static struct BufferPool compressed_pool = BUFFER_POOL_INITIALIZER(0);     // sized with -z
 
 struct FDstruct
 {
     int efd;    // event fd
     int sfd;    // socket fd
     struct Connection *conn;
+    struct BucketIndex *index;
+    struct Proxy *proxy;
+    struct Compression *compression;
+    struct PerfStats *perf;
+    struct TlsStats *tls;
+    struct Timeouts *timeouts;
     bool enable_ceph;
     bool enable_http;
+    bool keep_objects;
     short int verbose;
     struct EventData *edata;
 };
 
+/* Busy-poll mode (-b): how the event loop spent its polls */
+struct BusyPoll
+{
+    unsigned long long spin_ns;     // spinning budget, adapted to how long the server goes without events
+    unsigned long long idle_since;  // start of the current run of empty polls, 0 if the last one had events
+    unsigned long polls;
+    unsigned long empty_polls;
+    unsigned long sleeps;           // times the budget ran out and the loop blocked in epoll_pwait
+};
+
+/* What a connection waiting for its next event is timed out for */
+enum Timeout
+{
+    TIMEOUT_IDLE,       // the next request, since the last one or the accept
+    TIMEOUT_HEADER,     // the rest of the request head (or TLS handshake), since its first bytes (or the accept)
+    TIMEOUT_BODY,       // more of the request body, since the last read
+    N_TIMEOUTS
+};
+
+static const char *timeout_names[N_TIMEOUTS] = {"idle", "header", "body"};
+
+/* Timeouts of connections (-o), on a timer wheel shared by the event loop and the threads serving connections */
+struct Timeouts
+{
+    pthread_mutex_t lock;
+    struct TimerWheel wheel;            // of the connections waiting for their next event
+    unsigned long long start_ns;        // of tick 0
+    unsigned long ticks[N_TIMEOUTS];    // 0 if off
+    unsigned long expired[N_TIMEOUTS];  // connections closed, only written by the event loop
+};
+
+/* A request in progress, allocated when its first bytes come in and freed once it's answered */
+struct Request
+{
+    struct RequestLine line;
+    double ts;                      // wall-clock time the request line came in
+    unsigned long long start_ns;
+    char head[MAX_HEAD_SIZE];       // start of the request, up to the end of the headers
+    size_t head_len;
+    char *content;                  // the body with -c, from content_pool
+    char *compressed;               // with -z, from compressed_pool
+};
+
+/* A connection, kept small as most of them are idle most of the time */
 struct EventData
 {
     int fd;
     bool headers_received;
+    bool request_parsed;            // a request is in progress, req is set
     unsigned long total_bytes; // total bytes received
     unsigned long n_bytes; // number of bytes in body
-    char *content;
+    struct Request *req;
+    struct PerfTally *tally;        // with -e, of the request being served
+    SSL *ssl;                       // with -T, NULL on plaintext connections
+    struct Timer timer;             // with timeouts, pending while no thread serves the connection
+    unsigned long header_deadline;  // tick by which the request head must be in
+    unsigned long rx_bytes;         // all bytes read from the connection
+    unsigned long reported_bytes;   // rx_bytes at the last interval report
+    struct EventData *prev;         // in the list of open connections
+    struct EventData *next;
 };
 
+static void handle_signal(int sig)
+{
+    running = 0;
+}
+
+static void register_connection(struct EventData *edata)
+{
+    edata->rx_bytes = 0;
+    edata->reported_bytes = 0;
+    edata->prev = NULL;
+    pthread_mutex_lock(&connections_lock);
+    edata->next = connections;
+    if (connections != NULL)
+        connections->prev = edata;
+    connections = edata;
+    n_connections++;
+    if (++n_open > max_open)
+        max_open = n_open;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/* Must be called before the socket is closed, as the reporter may be looking at it */
+static void unregister_connection(struct EventData *edata)
+{
+    pthread_mutex_lock(&connections_lock);
+    if (edata->prev != NULL)
+        edata->prev->next = edata->next;
+    else
+        connections = edata->next;
+    if (edata->next != NULL)
+        edata->next->prev = edata->prev;
+    closed_bytes += edata->rx_bytes - edata->reported_bytes;
+    closed_bytes_total += edata->rx_bytes;
+    n_open--;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+static unsigned long current_tick(const struct Timeouts *timeouts)
+{
+    return (now_ns() - timeouts->start_ns)/(TIMER_TICK_MS*1000000ULL);
+}
+
+/* Sets up for a request whose first bytes just came in, or that is left over from a read */
+static struct Request *start_request(struct EventData *edata, const struct Timeouts *timeouts)
+{
+    if (edata->req == NULL)
+    {
+        edata->req = malloc(sizeof(struct Request));
+        edata->req->head_len = 0;
+        edata->req->head[0] = '\0';
+        edata->req->content = NULL;
+        edata->req->compressed = NULL;
+    }
+    edata->request_parsed = true;
+    if (timeouts != NULL)
+        edata->header_deadline = current_tick(timeouts) + timeouts->ticks[TIMEOUT_HEADER];
+    return edata->req;
+}
+
+/* Frees the state of a request once it's answered, an idle connection only keeps its EventData */
+static void end_request(struct EventData *edata)
+{
+    if (edata->req != NULL)
+    {
+        buffer_pool_put(&content_pool, edata->req->content);
+        buffer_pool_put(&compressed_pool, edata->req->compressed);
+        free(edata->req);
+        edata->req = NULL;
+    }
+    edata->request_parsed = false;
+}
+
+/* Closes a connection no thread is serving */
+static void close_connection(struct EventData *edata, struct PerfStats *perf)
+{
+    // Before the socket is closed, the reporter may be looking at it
+    unregister_connection(edata);
+    // Phases of a request the client gave up on
+    if (perf != NULL)
+        perf_flush(perf, edata->tally, false);
+    close(edata->fd);
+    end_request(edata);
+    free(edata->tally);
+    SSL_free(edata->ssl);
+    free(edata);
+}
+
+static enum Timeout pending_timeout(const struct EventData *edata)
+{
+    if (edata->headers_received)
+        return TIMEOUT_BODY;
+    if (edata->request_parsed || (edata->ssl != NULL && !SSL_is_init_finished(edata->ssl)))
+        return TIMEOUT_HEADER;
+    return TIMEOUT_IDLE;
+}
+
+/* Starts the timeout of a connection waiting for its next event, under the lock */
+static void arm_timeout(struct Timeouts *timeouts, struct EventData *edata)
+{
+    enum Timeout timeout = pending_timeout(edata);
+    if (timeouts->ticks[timeout] > 0)
+        timer_wheel_add(&timeouts->wheel, &edata->timer, timeout == TIMEOUT_HEADER ? edata->header_deadline
+                        : current_tick(timeouts) + timeouts->ticks[timeout]);
+}
+
+/*
+ * Hands a connection back to the event loop: starts its timeout and re-arms the
+ * socket, both under the lock, so the event loop can neither expire it before the
+ * socket is re-armed nor take its next event before the timer is set.
+ */
+static void rearm_connection(int eventfd, struct EventData *edata, struct Timeouts *timeouts)
+{
+    struct epoll_event event;
+
+    if (timeouts != NULL)
+    {
+        pthread_mutex_lock(&timeouts->lock);
+        arm_timeout(timeouts, edata);
+    }
+    event.data.ptr = edata;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    if (epoll_ctl(eventfd, EPOLL_CTL_MOD, edata->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        abort();
+    }
+    if (timeouts != NULL)
+        pthread_mutex_unlock(&timeouts->lock);
+}
+
+/* Stops the timeout of a connection, on the event loop before a thread serves its event */
+static void disarm_connection(struct EventData *edata, struct Timeouts *timeouts)
+{
+    pthread_mutex_lock(&timeouts->lock);
+    timer_wheel_remove(&timeouts->wheel, &edata->timer);
+    pthread_mutex_unlock(&timeouts->lock);
+}
+
+/*
+ * Closes the connections whose timeout passed, on the event loop between two polls.
+ * Connections on the wheel are waiting for an event, so no thread is serving them,
+ * and closing the socket drops any event epoll has for them.
+ */
+static void expire_connections(struct Timeouts *timeouts, struct PerfStats *perf)
+{
+    // Only the event loop moves the wheel on, so it can look without the lock
+    unsigned long tick = current_tick(timeouts);
+    if (tick < timeouts->wheel.now)
+        return;
+    pthread_mutex_lock(&timeouts->lock);
+    struct Timer *timer = timer_wheel_advance(&timeouts->wheel, tick);
+    pthread_mutex_unlock(&timeouts->lock);
+    while (timer != NULL)
+    {
+        struct EventData *edata = timer->data;
+        enum Timeout timeout = pending_timeout(edata);
+        timer = timer->next;
+        timeouts->expired[timeout]++;
+        printf("Closed connection on descriptor %d (%s timeout)\n", edata->fd, timeout_names[timeout]);
+        close_connection(edata, perf);
+    }
+}
+
+/* Appends a finished request to the trace, in a single write so records of different threads don't interleave */
+static void record_request(const struct Request *req, const unsigned long size)
+{
+    struct TraceRecord record;
+    char line[TRACE_LINE_SIZE];
+
+    // Requests on buckets can't be replayed
+    if (trace_fd == -1 || req->line.key[0] == '\0' || trace_op(req->line.method, &record.op) == -1)
+        return;
+    record.timestamp = req->ts;
+    http_uri_decode(req->line.bucket, record.bucket, sizeof(record.bucket));
+    http_uri_decode(req->line.key, record.key, sizeof(record.key));
+    record.size = size;
+    record.latency_us = (now_ns() - req->start_ns)/1000;
+    int len = trace_format(&record, line, sizeof(line));
+    if (len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (write(trace_fd, line, len) == -1)
+        perror("ERROR writing trace");
+}
+
+static void print_interval(const char *id, const double from, const double to, const unsigned long bytes)
+{
+    double mib = bytes/(1024.0*1024.0);
+    printf("[%5s] %7.2f-%-7.2f sec %10.2f MBytes %8.2f Gbits/sec", id, from, to, mib, bytes*8/(to - from)/1e9);
+}
+
+/*
+ * Prints, every interval, the throughput of every connection that received data
+ * and the total, like iperf, along with TCP_INFO of each connection.
+ */
+static void *report_intervals(void *arg)
+{
+    const double interval = *(const double*)arg;
+    unsigned long long start = now_ns();
+    unsigned long long last = start;
+
+    printf("[%5s] %-19s %17s %18s %10s %10s %8s\n", "fd", "Interval", "Transfer", "Bitrate",
+           "rtt [us]", "rcv_space", "retrans");
+    while (running)
+    {
+        unsigned long long now = now_ns();
+        if (now < last + interval*1e9)
+        {
+            // Wake up regularly to notice shutdown
+            unsigned long long wait = last + interval*1e9 - now;
+            struct timespec ts = {0, wait < 100000000ULL ? wait : 100000000ULL};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        unsigned long total = 0;
+        int n_active = 0;
+        pthread_mutex_lock(&connections_lock);
+        struct EventData *edata;
+        for (edata = connections; edata != NULL; edata = edata->next)
+        {
+            unsigned long rx_bytes = __atomic_load_n(&edata->rx_bytes, __ATOMIC_RELAXED);
+            unsigned long bytes = rx_bytes - edata->reported_bytes;
+            edata->reported_bytes = rx_bytes;
+            total += bytes;
+            if (bytes == 0)
+                continue;
+            n_active++;
+
+            char id[16];
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            snprintf(id, sizeof(id), "%d", edata->fd);
+            print_interval(id, (last - start)/1e9, (now - start)/1e9, bytes);
+            if (getsockopt(edata->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+                printf(" %10u %10u %8u", info.tcpi_rtt, info.tcpi_rcv_space, info.tcpi_total_retrans);
+            printf("\n");
+        }
+        total += closed_bytes;
+        closed_bytes = 0;
+        pthread_mutex_unlock(&connections_lock);
+
+        print_interval("SUM", (last - start)/1e9, (now - start)/1e9, total);
+        printf(" %d active connection(s)\n", n_active);
+        fflush(stdout);
+        last = now;
+    }
+
+    return NULL;
+}
+
 static int make_socket_non_blocking(int sfd)
 {
     int flags, s;
@@ -68,6 +433,71 @@ static int make_socket_non_blocking(int sfd)
     return 0;
 }
 
+/*
+ * Lets the kernel poll the device queue of the socket on reads instead of waiting for
+ * an interrupt, and keeps interrupts off while the application polls. Raising the busy
+ * poll time above net.core.busy_read needs CAP_NET_ADMIN, so failures only warn once.
+ */
+static void set_busy_poll(int sfd)
+{
+    static bool warned = false;
+    int usecs = BUSY_POLL_USECS;
+    int s = setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    if (s == 0)
+        s = setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    if (s == -1 && !warned)
+    {
+        fprintf(stderr, "WARNING: Couldn't enable busy polling on sockets (%s), only the event loop spins\n",
+                strerror(errno));
+        warned = true;
+    }
+}
+
+/*
+ * Polls without sleeping until nothing came in for the spinning budget, then blocks
+ * until the next event. If that event came within BUSY_SPIN_MAX_NS of the last one,
+ * spinning longer would have caught it and the budget doubles, otherwise the server
+ * was idle and it halves. So under steady load the loop stops sleeping, and an idle
+ * server doesn't burn a core.
+ */
+static int busy_poll_wait(int efd, struct epoll_event *events, const int timeout, const sigset_t *sigmask,
+                          struct BusyPoll *bp)
+{
+    int n = epoll_pwait(efd, events, MAXEVENTS, 0, sigmask);
+    bp->polls++;
+    if (n != 0)
+    {
+        bp->idle_since = 0;
+        return n;
+    }
+
+    bp->empty_polls++;
+    unsigned long long now = now_ns();
+    if (bp->idle_since == 0)
+        bp->idle_since = now;
+    if (now - bp->idle_since < bp->spin_ns)
+    {
+        // Nearly free when the core is ours, and lets a client sharing it send the next request
+        sched_yield();
+        return 0;
+    }
+
+    bp->sleeps++;
+    n = epoll_pwait(efd, events, MAXEVENTS, timeout, sigmask);
+    if (now_ns() - bp->idle_since < BUSY_SPIN_MAX_NS)
+    {
+        if (bp->spin_ns < BUSY_SPIN_MAX_NS)
+            bp->spin_ns *= 2;
+    }
+    else if (bp->spin_ns > BUSY_SPIN_MIN_NS)
+        bp->spin_ns /= 2;
+    bp->idle_since = 0;
+    return n;
+}
+
 static int create_and_bind(const char *port)
 {
     struct addrinfo hints;
@@ -113,24 +543,171 @@ static int create_and_bind(const char *port)
     return sfd;
 }
 
-void *read_in_thread(void *fds)
+/* Sends the whole buffer on a non-blocking socket, through TLS if ssl isn't NULL, waiting for it to drain when needed */
+static int send_all(int socketfd, SSL *ssl, const char *buf, size_t len, int flags)
 {
-    int s;
+    while (len > 0)
+    {
+        ssize_t n = ssl != NULL ? tls_write(ssl, buf, len) : send(socketfd, buf, len, MSG_NOSIGNAL | flags);
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {socketfd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* RADOS object holding a kept S3 object, named like RGW names head objects ("<bucket>_<key>") */
+static void kept_object_name(const struct Request *req, char *obj_name, size_t size)
+{
+    snprintf(obj_name, size, "%s_%s", req->line.bucket[0] ? req->line.bucket : DEFAULT_BUCKET, req->line.key);
+}
+
+/*
+ * Answers a GET (optionally with a "Range: bytes=<first>-[<last>]" or "bytes=-<n>"
+ * header) or a DELETE from the objects kept in Ceph. Without kept objects there is nothing to read or delete.
+ * Returns the size of the response body.
+ */
+static size_t serve_bodyless_request(int socketfd, struct EventData *edata, struct Connection *conn,
+                                   const bool keep_objects, const short verbose)
+{
+    struct Request *req = edata->req;
+    char resp[512];
+    char obj_name[sizeof(req->line.bucket) + sizeof(req->line.key) + 1];
+    uint64_t obj_size = 0;
+    const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    const char *no_content = "HTTP/1.1 204 No Content\r\n\r\n";
+    const char *server_error = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+
+    kept_object_name(req, obj_name, sizeof(obj_name));
+    bool exists = keep_objects && ceph_stat_object(conn, obj_name, &obj_size) == 0;
+    if (verbose && !exists)
+        printf("[sfd %d] INFO: %s of missing object \"%s\"\n", socketfd, req->line.method, obj_name);
+
+    // Like S3, deleting a missing object succeeds
+    if (!strcmp(req->line.method, "DELETE"))
+    {
+        if (exists)
+            ceph_remove_object(conn, obj_name, verbose);
+        send_all(socketfd, edata->ssl, no_content, strlen(no_content), 0);
+        return 0;
+    }
+    if (!exists)
+    {
+        send_all(socketfd, edata->ssl, not_found, strlen(not_found), 0);
+        return 0;
+    }
+
+    uint64_t first, last;
+    int range = http_range(req->head, obj_size, &first, &last);
+    if (range == -1)
+    {
+        int len = snprintf(resp, sizeof(resp), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                           "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n\r\n", (unsigned long)obj_size);
+        send_all(socketfd, edata->ssl, resp, len, 0);
+        return 0;
+    }
+    bool partial = range == 1;
+    if (!partial)
+    {
+        first = 0;
+        last = obj_size ? obj_size - 1 : 0;
+    }
+
+    // Like uploads, reads go through an object buffer, no object kept here is larger
+    size_t len = obj_size ? last - first + 1 : 0;
+    if (len > MAX_CONTENT_SIZE)
+    {
+        fprintf(stderr, "[sfd %d] ERROR: Object of %lu B is larger than the maximum of %d B\n",
+                socketfd, len, MAX_CONTENT_SIZE);
+        send_all(socketfd, edata->ssl, server_error, strlen(server_error), 0);
+        return 0;
+    }
+    char *body = buffer_pool_get(&content_pool);
+    if (body == NULL)
+    {
+        fprintf(stderr, "[sfd %d] ERROR: Cannot allocate a buffer to read object \"%s\"\n", socketfd, obj_name);
+        send_all(socketfd, edata->ssl, server_error, strlen(server_error), 0);
+        return 0;
+    }
+    if (ceph_read_object(conn, obj_name, body, len, first, verbose) != (long)len)
+    {
+        buffer_pool_put(&content_pool, body);
+        send_all(socketfd, edata->ssl, not_found, strlen(not_found), 0);
+        return 0;
+    }
+    int head_len;
+    if (partial)
+        head_len = snprintf(resp, sizeof(resp), "HTTP/1.1 206 Partial Content\r\n"
+                            "Content-Range: bytes %lu-%lu/%lu\r\nContent-Length: %lu\r\n\r\n",
+                            (unsigned long)first, (unsigned long)last, (unsigned long)obj_size, len);
+    else
+        head_len = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n", len);
+    // MSG_MORE keeps the head from going out in a segment of its own
+    if (send_all(socketfd, edata->ssl, resp, head_len, MSG_MORE) == 0)
+        send_all(socketfd, edata->ssl, body, len, 0);
+    if (verbose)
+        printf("[sfd %d] INFO: Sent %lu bytes of object \"%s\"\n", socketfd, len, obj_name);
+    buffer_pool_put(&content_pool, body);
+
+    return len;
+}
+
+/* Compresses an object before writing it (-z), recording the codec and original size in an xattr */
+static void write_compressed(struct Connection *conn, struct Compression *compression, struct Request *req,
+                             const char *obj_name, const char *content, const unsigned long size, const short verbose)
+{
+    req->compressed = buffer_pool_get(&compressed_pool);
+    long n = compress_object(compression, content, size, req->compressed, compressed_pool.size);
+    if (n == -1 || (unsigned long)n >= size)
+    {
+        // Not worth reading it back through a decompressor
+        ceph_write_object(conn, obj_name, content, size, verbose);
+        return;
+    }
+    char xattr[COMPRESSION_XATTR_SIZE];
+    int len = compression_xattr(compression, size, xattr, sizeof(xattr));
+    ceph_write_object_xattr(conn, obj_name, req->compressed, n, COMPRESSION_XATTR, xattr, len, verbose);
+}
+
+/*
+ * Reads what a connection has to offer, serving the requests that complete. Always
+ * inlined into the variants below, which pass constant flags, so the checks of the
+ * ones that are off compile away. With perf (-e) perf counters are read around
+ * every phase of a request.
+ */
+static inline __attribute__((always_inline))
+void *read_in_thread(void *fds, const bool enable_http, const bool enable_ceph, const short verbose, const bool perf)
+{
+    struct PerfSample sample;
 
     struct FDstruct *my_fds = (struct FDstruct*)fds;
     int socketfd = my_fds->sfd;
     int eventfd = my_fds->efd;
-    short int verbose = my_fds->verbose;
     if (verbose)
         printf("fds pointer (thread): %p; sfd=%d, efd=%d\n", fds, my_fds->sfd, my_fds->efd );
     struct Connection *conn = my_fds->conn;
-    bool enable_ceph = my_fds->enable_ceph;
-    bool enable_http = my_fds->enable_http;
+    struct BucketIndex *index = my_fds->index;
+    struct Compression *compression = my_fds->compression;
+    struct PerfStats *perf_stats = my_fds->perf;
+    struct TlsStats *tls_stats = my_fds->tls;
+    struct Timeouts *timeouts = my_fds->timeouts;
+    bool keep_objects = my_fds->keep_objects;
     struct EventData *edata = (struct EventData*)my_fds->edata;
     bool headers_received = edata->headers_received;
     unsigned long total_bytes = edata->total_bytes;
     unsigned long n_bytes = edata->n_bytes;
-    char *content = edata->content;
 
     // This pointer was dynamically allocated in the main thread, so free it here
     free(fds);
@@ -142,13 +719,71 @@ void *read_in_thread(void *fds)
     while (1)
     {
         ssize_t count;
-        char buf[READ_BUFFER_SIZE];
+        char buf[enable_http ? READ_BUFFER_SIZE : RAW_READ_BUFFER_SIZE];
 
-        count = read(socketfd, buf, sizeof(buf));
+        if (edata->ssl != NULL && !SSL_is_init_finished(edata->ssl))
+        {
+            // The handshake comes first, the server's flights are small enough to wait for the socket to drain
+            int r;
+            while ((r = tls_handshake(edata->ssl, tls_stats)) == 0 && SSL_want_write(edata->ssl))
+            {
+                struct pollfd pfd = {socketfd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+            }
+            if (r == -1)
+            {
+                done = 1;
+                break;
+            }
+            if (r == 0)
+            {
+                // Re-arm the socket for the rest of the handshake
+                rearm_connection(eventfd, edata, timeouts);
+                return NULL;
+            }
+            if (verbose)
+                printf("[sfd %d] INFO: TLS handshake done (%s, %s%s)\n", socketfd, SSL_get_version(edata->ssl),
+                       SSL_get_cipher_name(edata->ssl), SSL_session_reused(edata->ssl) ? ", resumed" : "");
+        }
+        if (perf)
+            perf_sample(&sample);
+        count = edata->ssl != NULL ? tls_read(edata->ssl, buf, sizeof(buf)) : read(socketfd, buf, sizeof(buf));
+        if (perf)
+            perf_tally(edata->tally, PHASE_READ, &sample);
         if (verbose)
             printf("[sfd %d] read %ldB, ", socketfd, count);
-        if (enable_http && count != -1)
+        // Only this thread writes the counter, the reporter reads it
+        if (count > 0)
+            __atomic_store_n(&edata->rx_bytes, edata->rx_bytes + count, __ATOMIC_RELAXED);
+        if (enable_http && count > 0)
         {
+            bool parsing = !headers_received;
+            if (perf && parsing)
+                perf_sample(&sample);
+            if (!headers_received && !edata->request_parsed)
+            {
+                struct Request *req = start_request(edata, timeouts);
+                http_parse_request_line(buf, count, &req->line);
+                if (trace_fd != -1)
+                {
+                    struct timespec ts;
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    req->ts = ts.tv_sec + ts.tv_nsec/1e9;
+                    req->start_ns = now_ns();
+                }
+            }
+            if (!headers_received)
+            {
+                // Keep the headers, they may come in more than one read
+                struct Request *req = edata->req;
+                size_t room = sizeof(req->head) - 1 - req->head_len;
+                size_t n = (size_t)count < room ? (size_t)count : room;
+                memcpy(req->head + req->head_len, buf, n);
+                req->head_len += n;
+                req->head[req->head_len] = '\0';
+            }
+            if (perf && parsing)
+                perf_tally(edata->tally, PHASE_PARSE, &sample);
             total_bytes += count;
             if (verbose)
                 printf("total bytes: %lu\n", total_bytes);
@@ -168,23 +803,37 @@ void *read_in_thread(void *fds)
 
             if (enable_http)
             {
-                if (!headers_received)
+                bool bodyless = edata->request_parsed && (!strcmp(edata->req->line.method, "GET") ||
+                                                          !strcmp(edata->req->line.method, "DELETE"));
+                if (!headers_received && bodyless)
                 {
-                    // Look for the Content-Length field
-                    char *saveptr;
-                    char *pch = strtok_r(buf, " :\r\n", &saveptr);
-                    while (pch != NULL)
+                    // Requests without a body are answered once all of their headers are in
+                    if (strstr(edata->req->head, "\r\n\r\n") != NULL)
                     {
-                        if ( pch != NULL && !strcmp(pch, "Content-Length") )
-                            break;
-                        if (verbose)
-                            printf("[sfd %d] %s\n", socketfd, pch);
-                        pch = strtok_r(NULL, " :\r\n", &saveptr);
+                        if (perf)
+                            perf_sample(&sample);
+                        size_t sent = serve_bodyless_request(socketfd, edata, conn, enable_ceph && keep_objects, verbose);
+                        if (perf)
+                        {
+                            perf_tally(edata->tally, PHASE_RESPOND, &sample);
+                            perf_flush(perf_stats, edata->tally, true);
+                        }
+                        record_request(edata->req, sent);
+                        end_request(edata);
+                        total_bytes = 0;
                     }
-                    pch = strtok_r(NULL, " :\r\n", &saveptr);
-                    if (pch != NULL)
+                }
+                else if (!headers_received && edata->request_parsed && strstr(edata->req->head, "\r\n\r\n") != NULL)
+                {
+                    // Look for the Content-Length field once all headers are in, the header timeout covers the wait
+                    if (perf)
+                        perf_sample(&sample);
+                    long content_length = http_content_length(edata->req->head);
+                    if (perf)
+                        perf_tally(edata->tally, PHASE_PARSE, &sample);
+                    if (content_length != -1)
                     {
-                        n_bytes = strtol(pch, NULL, 10);
+                        n_bytes = content_length;
                         if (verbose)
                             printf("[sfd %d] content length (from headers): %lu\n", socketfd, n_bytes);
                     }
@@ -195,6 +844,18 @@ void *read_in_thread(void *fds)
                         fprintf(stderr, "[sfd %d] ERROR: Couldn't get the value of Content-Length!\n", socketfd);
                         exit(1);
                     }
+                    if (enable_ceph)
+                    {
+                        // The body is only buffered to be written to storage
+                        if (n_bytes > MAX_CONTENT_SIZE)
+                        {
+                            fprintf(stderr, "[sfd %d] ERROR: Object of %lu B is larger than the maximum of %d B\n",
+                                    socketfd, n_bytes, MAX_CONTENT_SIZE);
+                            done = 1;
+                            break;
+                        }
+                        edata->req->content = buffer_pool_get(&content_pool);
+                    }
                     // Reset current count of bytes received as we only care about body size
                     total_bytes = 0;
 
@@ -202,8 +863,11 @@ void *read_in_thread(void *fds)
                     const char* resp = "HTTP/1.1 100 Continue\r\n\r\n";
                     if (verbose)
                         printf("\n[sfd %d] INFO: Sending '%s'\n", socketfd, resp);
-                    if (send(socketfd, resp, strlen(resp), 0) == -1)
-                        perror("send");
+                    if (perf)
+                        perf_sample(&sample);
+                    send_all(socketfd, edata->ssl, resp, strlen(resp), 0);
+                    if (perf)
+                        perf_tally(edata->tally, PHASE_RESPOND, &sample);
                     headers_received = true;
 
                     // TODO: Handle case where data comes without headers
@@ -218,27 +882,53 @@ void *read_in_thread(void *fds)
                         const char *resp = "HTTP/1.1 200 OK\r\nETag: blahblahblahblahblahblahblahblah\r\nContent-Length: 0\r\n\r\n";
                         if (verbose)
                             printf("\n[sfd %d] INFO: Sending '%s'\n", socketfd, resp);
-                        if (send(socketfd, resp, strlen(resp), 0) == -1)
-                            perror("send");
+                        if (perf)
+                            perf_sample(&sample);
+                        send_all(socketfd, edata->ssl, resp, strlen(resp), 0);
+                        if (perf)
+                        {
+                            perf_tally(edata->tally, PHASE_RESPOND, &sample);
+                            perf_sample(&sample);
+                        }
 
                         // We now have the whole object, so send it
-                        char obj_name[256] = "";
+                        struct Request *req = edata->req;
+                        char obj_name[sizeof(req->line.bucket) + sizeof(req->line.key) + 1] = "";
                         if (enable_ceph)
                         {
-                            // Use this thread ID for object name
-                            sprintf(obj_name, "%lu", pthread_self());
+                            // Kept objects are named after their key so they can be read back,
+                            // otherwise use this thread ID for object name
+                            if (keep_objects)
+                                kept_object_name(req, obj_name, sizeof(obj_name));
+                            else
+                                sprintf(obj_name, "%lu", pthread_self());
                             // Write object content to Ceph
-                            ceph_write_object(conn, obj_name, content, total_bytes, verbose);
+                            if (compression != NULL)
+                                write_compressed(conn, compression, req, obj_name, req->content, total_bytes, verbose);
+                            else
+                                ceph_write_object(conn, obj_name, req->content, total_bytes, verbose);
+                            // Update the bucket index like RGW does after writing the head object
+                            if (index != NULL)
+                                bucket_index_add(index, req->line.bucket[0] ? req->line.bucket : DEFAULT_BUCKET,
+                                                 req->line.key[0] ? req->line.key : obj_name, total_bytes, verbose);
                         }
-                        if (enable_ceph)
+                        if (enable_ceph && !keep_objects)
                         {
                             ceph_remove_object(conn, obj_name, verbose);
                             //TODO: ceph_remove_object is not thread-safe
                         }
+                        if (perf)
+                        {
+                            perf_tally(edata->tally, PHASE_STORE, &sample);
+                            perf_flush(perf_stats, edata->tally, true);
+                        }
+
+                        record_request(req, n_bytes);
 
                         // Reset values for threads working on the same fd
                         headers_received = false;
                         total_bytes = 0;
+                        end_request(edata);
                     }
                 }
                 if (verbose)
@@ -246,22 +936,14 @@ void *read_in_thread(void *fds)
             }
 
             // Re-arm the socket, so we get notifications again
-            struct epoll_event event;
             edata->fd = socketfd;
             edata->headers_received = headers_received;
             edata->total_bytes = total_bytes;
             if (headers_received)
                 edata->n_bytes = n_bytes;
-            event.data.ptr = edata;
-            event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-            s = epoll_ctl(eventfd, EPOLL_CTL_MOD, socketfd, &event);
-            if (s == -1)
-            {
-                perror("epoll_ctl");
-                abort();
-            }
-            // Exit to the main loop
-            pthread_exit(0);
+            rearm_connection(eventfd, edata, timeouts);
+            // Exit to the main loop (a return, so serve_in_thread counts the thread out and -b can run this)
+            return NULL;
         }
         else if (count == 0)
         {
@@ -275,12 +957,16 @@ void *read_in_thread(void *fds)
         {
             if (headers_received)
             {
-                memcpy( content+content_index, buf, count );
+                if (perf)
+                    perf_sample(&sample);
+                // Anything after the body isn't part of the object
+                if (content_index < n_bytes)
+                    memcpy(edata->req->content + content_index, buf,
+                           (size_t)count < n_bytes - content_index ? (size_t)count : n_bytes - content_index);
+                if (perf)
+                    perf_tally(edata->tally, PHASE_COPY, &sample);
                 if (verbose)
-                {
                     printf("[sfd %d] content index: %lu\n", socketfd, content_index);
-                    printf("[sfd %d] content size: %lu\n", socketfd, strlen(content));
-                }
                 content_index = total_bytes;
             }
         }
@@ -289,32 +975,174 @@ void *read_in_thread(void *fds)
 
     if (done)
     {
-        free(edata);
-        free(content);
-
-        // Restore original value for a thread using the same fd
-        if (enable_http)
-        {
-            headers_received = false;
-            total_bytes = 0;
-        }
-
         printf("Closed connection on descriptor %d\n", socketfd);
 
         /*
          * Closing the descriptor will make epoll remove it
          * from the set of descriptors which are monitored.
          */
-        close(socketfd);
+        close_connection(edata, perf ? perf_stats : NULL);
+    }
+
+    return NULL;
+}
+
+/* A thread entry point per combination of -w, -c, -v and -e */
+#define READ_IN_THREAD_VARIANT(http, ceph, verbose, perf) \
+    static void *read_in_thread_##http##ceph##verbose##perf(void *fds) \
+    { \
+        return read_in_thread(fds, http, ceph, verbose, perf); \
+    }
+#define READ_IN_THREAD_VARIANTS(http, ceph) \
+    READ_IN_THREAD_VARIANT(http, ceph, 0, 0) READ_IN_THREAD_VARIANT(http, ceph, 0, 1) \
+    READ_IN_THREAD_VARIANT(http, ceph, 1, 0) READ_IN_THREAD_VARIANT(http, ceph, 1, 1)
+READ_IN_THREAD_VARIANTS(0, 0)
+READ_IN_THREAD_VARIANTS(0, 1)
+READ_IN_THREAD_VARIANTS(1, 0)
+READ_IN_THREAD_VARIANTS(1, 1)
+
+/* Indexed by [enable_http][enable_ceph][verbose][perf] */
+#define READ_IN_THREAD_ROW(http, ceph) \
+    {{read_in_thread_##http##ceph##00, read_in_thread_##http##ceph##01}, \
+     {read_in_thread_##http##ceph##10, read_in_thread_##http##ceph##11}}
+static void *(*const read_in_thread_variants[2][2][2][2])(void*) = {
+    {READ_IN_THREAD_ROW(0, 0), READ_IN_THREAD_ROW(0, 1)},
+    {READ_IN_THREAD_ROW(1, 0), READ_IN_THREAD_ROW(1, 1)},
+};
+
+/*
+ * Passthrough mode (-p): relays the requests of a connection to the upstream. Heads
+ * are read into the request's head, along with whatever part of the body came with them, and
+ * the rest of the exchange is spliced through (see proxy.c).
+ */
+void *proxy_in_thread(void *fds)
+{
+    struct FDstruct *my_fds = (struct FDstruct*)fds;
+    int socketfd = my_fds->sfd;
+    int eventfd = my_fds->efd;
+    short int verbose = my_fds->verbose;
+    struct Proxy *proxy = my_fds->proxy;
+    struct Timeouts *timeouts = my_fds->timeouts;
+    struct EventData *edata = (struct EventData*)my_fds->edata;
+    free(fds);
+
+    while (1)
+    {
+        struct Request *req = edata->req;
+        char *end = req != NULL && req->head_len > 0 ? strstr(req->head, "\r\n\r\n") : NULL;
+        if (end == NULL)
+        {
+            if (req == NULL)
+                req = start_request(edata, timeouts);
+            if (req->head_len == sizeof(req->head) - 1)
+            {
+                fprintf(stderr, "[sfd %d] ERROR: Request head too long\n", socketfd);
+                break;
+            }
+            ssize_t count = read(socketfd, req->head + req->head_len, sizeof(req->head) - 1 - req->head_len);
+            if (count == -1 && errno == EAGAIN)
+            {
+                // Idle until the next request starts coming in
+                if (req->head_len == 0)
+                    end_request(edata);
+                // Re-arm the socket, so we get notifications again
+                rearm_connection(eventfd, edata, timeouts);
+                return NULL;
+            }
+            if (count == -1)
+                perror("read");
+            if (count <= 0)
+                break;
+            __atomic_store_n(&edata->rx_bytes, edata->rx_bytes + count, __ATOMIC_RELAXED);
+            req->head_len += count;
+            req->head[req->head_len] = '\0';
+            continue;
+        }
+
+        size_t head_len = end + 4 - req->head;
+        char head[MAX_HEAD_SIZE];
+        memcpy(head, req->head, head_len);
+        head[head_len] = '\0';
+        http_parse_request_line(head, head_len, &req->line);
+        if (trace_fd != -1)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            req->ts = ts.tv_sec + ts.tv_nsec/1e9;
+            req->start_ns = now_ns();
+        }
+        long content_length = http_content_length(head);
+        if (content_length == -1)
+            content_length = 0;
+        // Anything after the body is the start of the next request
+        size_t len = head_len + content_length < req->head_len ? head_len + content_length : req->head_len;
+
+        struct ProxyExchange exchange;
+        int r = proxy_forward(proxy, socketfd, req->head, len, head_len, content_length, &exchange);
+        __atomic_store_n(&edata->rx_bytes, edata->rx_bytes + exchange.request_bytes - (len - head_len), __ATOMIC_RELAXED);
+        if (verbose)
+            printf("[sfd %d] INFO: %s /%s/%s: %d, %lu B in, %lu B out in %.1f us (%.1f us upstream)\n", socketfd,
+                   req->line.method, req->line.bucket, req->line.key, exchange.status,
+                   exchange.request_bytes, exchange.response_bytes, exchange.total_ns/1e3, exchange.upstream_ns/1e3);
+        record_request(req, exchange.request_bytes > 0 ? exchange.request_bytes : exchange.response_bytes);
+        if (r == -1)
+            break;
+        req->head_len -= len;
+        memmove(req->head, req->head + len, req->head_len);
+        req->head[req->head_len] = '\0';
+        // The next request may have come with this one
+        if (req->head_len > 0)
+            start_request(edata, timeouts);
+        else
+            end_request(edata);
     }
 
+    printf("Closed connection on descriptor %d\n", socketfd);
+    close_connection(edata, NULL);
+
+    return NULL;
+}
+
+/* Runs the read loop of the mode in a thread of its own and counts the thread out when it's done */
+static void *serve_in_thread(void *fds)
+{
+    serve_connection(fds);
+    pthread_mutex_lock(&workers_lock);
+    if (--n_workers == 0)
+        pthread_cond_signal(&workers_done);
+    pthread_mutex_unlock(&workers_lock);
+    return NULL;
 }
 
 void print_usage(const char **argv)
 {
-        fprintf(stderr, "Usage: %s [-c] [-w] [-v] [-h] port\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-c [-k]] [-w [-t trace] [-p upstream] [-T cert [-K key]]] [-s shards[:batch]] [-z codec[:level]] [-o header[:body[:idle]]] [-i interval] [-b] [-e] [-v] [-h] port\n", argv[0]);
         fprintf(stderr, "\t-c: enables integration with Ceph\n");
+        fprintf(stderr, "\t-k: keeps uploaded objects (named <bucket>_<key>) and serves GET and DELETE\n"
+                        "\t    requests for them (requires -c and -w)\n");
+        fprintf(stderr, "\t-s: emulates a sharded bucket index with omap updates (requires -c),\n"
+                        "\t    optionally batching up to <batch> entries per shard in one op\n");
+        fprintf(stderr, "\t-z: compresses objects with zstd or lz4 before writing them, recording the\n"
+                        "\t    original size in an xattr (requires -c and -w, not with -k)\n");
         fprintf(stderr, "\t-w: enables HTTP web server\n");
+        fprintf(stderr, "\t-t: records every request to <trace> (see trace.h), to be replayed with\n"
+                        "\t    client_s3 -T (requires -w)\n");
+        fprintf(stderr, "\t-p: relays requests to <upstream> (host:port), splicing bodies through,\n"
+                        "\t    and reports the latency added (requires -w, not with -c)\n");
+        fprintf(stderr, "\t-T: terminates TLS with the certificate (chain) in PEM file <cert>, handing\n"
+                        "\t    encryption to the kernel (kTLS) once a handshake is done if it can\n"
+                        "\t    (requires -w, not with -p)\n");
+        fprintf(stderr, "\t-K: the private key of the certificate, if it isn't in <cert>\n");
+        fprintf(stderr, "\t-o: closes connections that take longer than <header> seconds to send a request\n"
+                        "\t    head (or finish the TLS handshake), <body> seconds between two reads of\n"
+                        "\t    a body, or <idle> seconds to start a request, 0 turns one off (default:\n"
+                        "\t    %d:%d:%d)\n", DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT, DEFAULT_IDLE_TIMEOUT);
+        fprintf(stderr, "\t-i: prints the throughput and TCP_INFO of every connection and the total\n"
+                        "\t    every <interval> seconds\n");
+        fprintf(stderr, "\t-b: low-latency mode, spins on epoll and reads on the event loop instead of\n"
+                        "\t    handing connections to threads (one request at a time, burns a core)\n");
+        fprintf(stderr, "\t-e: counts cycles, instructions, cache misses, context switches and page\n"
+                        "\t    faults per request phase with perf events (requires -w, not with -p)\n");
         fprintf(stderr, "\t-v: turns on verbosity\n");
         fprintf(stderr, "\t-h: prints this help\n");
 }
@@ -326,10 +1154,24 @@ void print_stack_size(void)
     fprintf(stderr, "INFO: Stack size limit: %lu [KB]. Run `ulimit -s new-value` to change.\n", rl.rlim_cur/KiB);
 }
 
+/* Every connection takes a descriptor, so the soft limit is raised as far as it goes */
+void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    fprintf(stderr, "INFO: Open files limit: %lu, connections included. Run `ulimit -Hn new-value` to change.\n",
+            (unsigned long)rl.rlim_cur);
+}
+
 void print_datastructure_sizes(void)
 {
     fprintf(stderr, "INFO: Maximum object size is: %d [B].\n", MAX_CONTENT_SIZE);
-    fprintf(stderr, "INFO: Read buffer size is: %d [B].\n", READ_BUFFER_SIZE);
+    fprintf(stderr, "INFO: Read buffer size is: %d [B] (%d [B] without -w).\n", READ_BUFFER_SIZE, RAW_READ_BUFFER_SIZE);
+    fprintf(stderr, "INFO: Connection state is: %zu [B] while idle, plus %zu [B] (and the body with -c) while serving a request.\n",
+            sizeof(struct EventData), sizeof(struct Request));
 }
 
 int main(int argc, const char *argv[])
@@ -342,6 +1184,18 @@ int main(int argc, const char *argv[])
 
     bool enable_ceph = false;
     bool enable_http = false;
+    bool keep_objects = false;
+    unsigned int index_shards = 0;
+    unsigned int index_batch = 1;
+    double report_interval = 0;
+    const char *trace_file = NULL;
+    const char *upstream = NULL;
+    bool busy_poll = false;
+    const char *compression_spec = NULL;
+    bool count_events = false;
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
+    double timeout_secs[N_TIMEOUTS] = {DEFAULT_IDLE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT};
     short verbose = 0;
     const char *port = "-1";
     size_t i;
@@ -362,6 +1216,109 @@ int main(int argc, const char *argv[])
                     fprintf(stderr, "INFO: HTTP web server enabled\n");
                     enable_http = true;
                     break;
+                case 'k':
+                    fprintf(stderr, "INFO: Keeping uploaded objects\n");
+                    keep_objects = true;
+                    break;
+                case 's':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    if (sscanf(argv[i], "%u:%u", &index_shards, &index_batch) < 1)
+                    {
+                        fprintf(stderr, "invalid number of shards: %s\n", argv[i]);
+                        exit(EXIT_FAILURE);
+                    }
+                    fprintf(stderr, "INFO: Bucket index emulation enabled (%u shards, batch size %u)\n",
+                            index_shards, index_batch);
+                    break;
+                case 'i':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    report_interval = atof(argv[i]);
+                    if (report_interval <= 0)
+                    {
+                        fprintf(stderr, "invalid report interval: %s\n", argv[i]);
+                        exit(EXIT_FAILURE);
+                    }
+                    fprintf(stderr, "INFO: Reporting throughput every %.1f s\n", report_interval);
+                    break;
+                case 't':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    trace_file = argv[i];
+                    fprintf(stderr, "INFO: Recording requests to %s\n", trace_file);
+                    break;
+                case 'p':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    upstream = argv[i];
+                    fprintf(stderr, "INFO: Relaying requests to %s\n", upstream);
+                    break;
+                case 'z':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    compression_spec = argv[i];
+                    break;
+                case 'e':
+                    count_events = true;
+                    break;
+                case 'T':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    tls_cert = argv[i];
+                    break;
+                case 'K':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    tls_key = argv[i];
+                    break;
+                case 'o':
+                    if (i+1 >= argc)
+                    {
+                        fprintf(stderr, "flag %s requires a value\n", option);
+                        exit(EXIT_FAILURE);
+                    }
+                    i++;
+                    if (sscanf(argv[i], "%lf:%lf:%lf", &timeout_secs[TIMEOUT_HEADER], &timeout_secs[TIMEOUT_BODY],
+                               &timeout_secs[TIMEOUT_IDLE]) < 1 || timeout_secs[TIMEOUT_HEADER] < 0 ||
+                        timeout_secs[TIMEOUT_BODY] < 0 || timeout_secs[TIMEOUT_IDLE] < 0)
+                    {
+                        fprintf(stderr, "invalid timeouts: %s\n", argv[i]);
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'b':
+                    fprintf(stderr, "INFO: Busy polling enabled\n");
+                    busy_poll = true;
+                    break;
                 case 'v':
                     fprintf(stderr, "INFO: Verbose output turned on\n");
                     verbose = 1;
@@ -389,6 +1346,7 @@ int main(int argc, const char *argv[])
     }
 
     print_stack_size();
+    raise_fd_limit();
     print_datastructure_sizes();
 
     // Initialise Ceph
@@ -396,6 +1354,137 @@ int main(int argc, const char *argv[])
     if (enable_ceph)
         ceph_connect(&conn, argc, argv, verbose);
 
+    if (keep_objects && (!enable_ceph || !enable_http))
+    {
+        fprintf(stderr, "ERROR: Keeping objects requires the -c and -w flags\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (trace_file != NULL)
+    {
+        if (!enable_http)
+        {
+            fprintf(stderr, "ERROR: Recording requests requires the -w flag\n");
+            exit(EXIT_FAILURE);
+        }
+        trace_fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (trace_fd == -1 || write(trace_fd, TRACE_HEADER, strlen(TRACE_HEADER)) == -1)
+        {
+            perror(trace_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct Proxy proxy;
+    struct Proxy *proxy_ptr = NULL;
+    if (upstream != NULL)
+    {
+        if (!enable_http || enable_ceph)
+        {
+            fprintf(stderr, "ERROR: Relaying requests requires the -w flag and doesn't work with -c\n");
+            exit(EXIT_FAILURE);
+        }
+        if (proxy_init(&proxy, upstream) == -1)
+            exit(EXIT_FAILURE);
+        proxy_ptr = &proxy;
+    }
+
+    struct Compression compression;
+    struct Compression *compression_ptr = NULL;
+    if (compression_spec != NULL)
+    {
+        if (!enable_ceph || !enable_http || keep_objects)
+        {
+            // Kept objects are served as they are stored, there is no decompression on the read path
+            fprintf(stderr, "ERROR: Compression requires the -c and -w flags and doesn't work with -k\n");
+            exit(EXIT_FAILURE);
+        }
+        if (compression_init(&compression, compression_spec) == -1)
+            exit(EXIT_FAILURE);
+        fprintf(stderr, "INFO: Compressing objects with %s in chunks of %d [B]\n", compression.name, COMPRESS_CHUNK_SIZE);
+        compressed_pool.size = compression_bound(&compression, MAX_CONTENT_SIZE);
+        compression_ptr = &compression;
+    }
+
+    struct PerfStats perf;
+    struct PerfStats *perf_ptr = NULL;
+    if (count_events)
+    {
+        if (!enable_http || proxy_ptr != NULL)
+        {
+            fprintf(stderr, "ERROR: Counting request phases requires the -w flag and doesn't work with -p\n");
+            exit(EXIT_FAILURE);
+        }
+        if (perf_init(&perf) == -1)
+            exit(EXIT_FAILURE);
+        perf_ptr = &perf;
+    }
+
+    SSL_CTX *tls_ctx = NULL;
+    struct TlsStats tls_stats;
+    memset(&tls_stats, 0, sizeof(tls_stats));
+    if (tls_cert != NULL || tls_key != NULL)
+    {
+        if (tls_cert == NULL || !enable_http || proxy_ptr != NULL)
+        {
+            fprintf(stderr, "ERROR: TLS requires the -T and -w flags and doesn't work with -p\n");
+            exit(EXIT_FAILURE);
+        }
+        tls_ctx = tls_server_context(tls_cert, tls_key);
+        if (tls_ctx == NULL)
+            exit(EXIT_FAILURE);
+        // OpenSSL writes to the socket without MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+        fprintf(stderr, "INFO: Terminating TLS with the certificate in %s\n", tls_cert);
+    }
+
+    struct Timeouts timeouts;
+    struct Timeouts *timeouts_ptr = NULL;
+    if (timeout_secs[TIMEOUT_HEADER] > 0 || timeout_secs[TIMEOUT_BODY] > 0 || timeout_secs[TIMEOUT_IDLE] > 0)
+    {
+        memset(&timeouts, 0, sizeof(timeouts));
+        pthread_mutex_init(&timeouts.lock, NULL);
+        timeouts.start_ns = now_ns();
+        timer_wheel_init(&timeouts.wheel, 0);
+        for (i = 0; i < N_TIMEOUTS; i++)
+            timeouts.ticks[i] = (unsigned long)(timeout_secs[i]*1000/TIMER_TICK_MS + 0.999);
+        fprintf(stderr, "INFO: Timeouts: %.1f s for a request head, %.1f s between reads of a body, %.1f s idle"
+                " (0 is none), checked every %d ms\n", timeout_secs[TIMEOUT_HEADER], timeout_secs[TIMEOUT_BODY],
+                timeout_secs[TIMEOUT_IDLE], TIMER_TICK_MS);
+        timeouts_ptr = &timeouts;
+    }
+    else
+        fprintf(stderr, "INFO: Connections never time out\n");
+
+    struct BucketIndex index;
+    struct BucketIndex *index_ptr = NULL;
+    if (index_shards > 0)
+    {
+        if (!enable_ceph)
+        {
+            fprintf(stderr, "ERROR: Bucket index emulation requires the -c flag\n");
+            exit(EXIT_FAILURE);
+        }
+        if (bucket_index_init(&index, &conn, index_shards, index_batch) == -1)
+            exit(EXIT_FAILURE);
+        index_ptr = &index;
+    }
+
+    /*
+     * Only the event loop should be interrupted by SIGINT/SIGTERM, so block
+     * them here (threads inherit the mask) and unblock them in epoll_pwait.
+     */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t blocked, origmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &origmask);
+
     sfd = create_and_bind(port);
     if (sfd == -1)
         abort();
@@ -423,8 +1512,11 @@ int main(int argc, const char *argv[])
     edata->headers_received = false;
     edata->total_bytes = 0;
     edata->n_bytes = ULONG_MAX;
-    char *content = calloc(MAX_CONTENT_SIZE, sizeof(char));
-    edata->content = content;
+    edata->request_parsed = false;
+    edata->req = NULL;
+    edata->tally = NULL;
+    edata->ssl = NULL;
+    edata->timer.pprev = NULL;
     event.data.ptr = edata;
     event.events = EPOLLIN | EPOLLET;
     s = epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event);
@@ -437,31 +1529,56 @@ int main(int argc, const char *argv[])
     // Buffer where events are returned
     events = calloc(MAXEVENTS, sizeof(event));
 
+    pthread_t reporter;
+    unsigned long long start = now_ns();
+    if (report_interval > 0 && pthread_create(&reporter, NULL, report_intervals, &report_interval))
+    {
+        fprintf(stderr, "Error creating thread\n");
+        return 1;
+    }
+
+    // Picked once, so connections are served by a read loop specialised for the mode
+    serve_connection = proxy_ptr != NULL ? proxy_in_thread
+                       : read_in_thread_variants[enable_http][enable_ceph][verbose != 0][perf_ptr != NULL];
+
+    struct BusyPoll bp = {BUSY_SPIN_MIN_NS, 0, 0, 0, 0};
+    struct rusage usage_start;
+    getrusage(RUSAGE_SELF, &usage_start);
+
     // The event loop
-    while (1)
+    while (running)
     {
         int n, i;
 
-        n = epoll_wait(efd, events, MAXEVENTS, -1);
+        // With timeouts, the loop wakes up every tick to expire connections
+        int timeout = timeouts_ptr != NULL ? TIMER_TICK_MS : -1;
+        if (busy_poll)
+            n = busy_poll_wait(efd, events, timeout, &origmask, &bp);
+        else
+            n = epoll_pwait(efd, events, MAXEVENTS, timeout, &origmask);
         for (i = 0; i < n; i++)
         {
             if ((events[i].events & EPOLLERR) ||
                 (events[i].events & EPOLLHUP) ||
                 (!(events[i].events & EPOLLIN)))
             {
-                free(edata);
-                free(content);
                 /*
                  * An error has occured on this fd, or the socket is not
                  * ready for reading (why were we notified then?)
                  */
                 fprintf(stderr, "epoll error\n");
-                close(((struct EventData*) events[i].data.ptr)->fd);
                 /*
                  * With HTTP server enabled this can happen if server sent a 200 OK
                  * and didn't manage to pull all data before client has closed the socket.
+                 * The socket is one-shot, so no thread is using the connection now.
                  */
-                ((struct EventData*) events[i].data.ptr)->headers_received = false;
+                struct EventData *failed = events[i].data.ptr;
+                if (failed->fd != sfd)
+                {
+                    if (timeouts_ptr != NULL)
+                        disarm_connection(failed, timeouts_ptr);
+                    close_connection(failed, perf_ptr);
+                }
                 continue;
             }
 
@@ -477,7 +1594,10 @@ int main(int argc, const char *argv[])
                     socklen_t in_len;
                     int infd;
                     char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+                    struct PerfSample accept_sample;
 
+                    if (perf_ptr != NULL)
+                        perf_sample(&accept_sample);
                     in_len = sizeof(in_addr);
                     infd = accept(sfd, &in_addr, &in_len);
                     if (infd == -1)
@@ -511,14 +1631,43 @@ int main(int argc, const char *argv[])
                     s = make_socket_non_blocking(infd);
                     if (s == -1)
                         abort();
+                    if (busy_poll)
+                        set_busy_poll(infd);
 
                     struct EventData *edata = malloc( sizeof(struct EventData) );
                     edata->fd = infd;
                     edata->headers_received = false;
                     edata->total_bytes = 0;
                     edata->n_bytes = ULONG_MAX;
-                    char *content = calloc(MAX_CONTENT_SIZE, sizeof(char));
-                    edata->content = content;
+                    edata->request_parsed = false;
+                    // Buffers come with the first bytes of a request
+                    edata->req = NULL;
+                    edata->tally = perf_ptr != NULL ? calloc(1, sizeof(struct PerfTally)) : NULL;
+                    edata->ssl = NULL;
+                    edata->timer.pprev = NULL;
+                    edata->timer.data = edata;
+                    if (tls_ctx != NULL)
+                    {
+                        // Records are written one by one, Nagle's algorithm would hold them back for delayed ACKs
+                        int one = 1;
+                        setsockopt(infd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        // The handshake is done by whichever thread serves the first event
+                        edata->ssl = SSL_new(tls_ctx);
+                        SSL_set_fd(edata->ssl, infd);
+                        SSL_set_accept_state(edata->ssl);
+                    }
+                    register_connection(edata);
+                    // Before the socket is added, a thread may be using edata right after
+                    if (perf_ptr != NULL)
+                        perf_tally(edata->tally, PHASE_ACCEPT, &accept_sample);
+                    if (timeouts_ptr != NULL)
+                    {
+                        // Until the first request (or the TLS handshake) is in
+                        edata->header_deadline = current_tick(timeouts_ptr) + timeouts_ptr->ticks[TIMEOUT_HEADER];
+                        pthread_mutex_lock(&timeouts_ptr->lock);
+                        arm_timeout(timeouts_ptr, edata);
+                        pthread_mutex_unlock(&timeouts_ptr->lock);
+                    }
                     event.data.ptr = edata;
                     // Make the socket a one shot so only one thread picks it up
                     event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
@@ -546,16 +1695,35 @@ int main(int argc, const char *argv[])
                 fds->efd = efd;
                 fds->sfd = ((struct EventData*) events[i].data.ptr)->fd;
                 fds->conn = &conn;
+                fds->index = index_ptr;
+                fds->proxy = proxy_ptr;
+                fds->compression = compression_ptr;
+                fds->perf = perf_ptr;
+                fds->tls = &tls_stats;
+                fds->timeouts = timeouts_ptr;
                 fds->enable_ceph = enable_ceph;
                 fds->enable_http = enable_http;
+                fds->keep_objects = keep_objects;
                 fds->verbose = verbose;
                 fds->edata = events[i].data.ptr;
                 if (verbose)
                     printf("[sfd %d] headers received? %d\n", fds->sfd, ((struct EventData*) events[i].data.ptr)->headers_received);
+                // The thread serving the event owns the connection until it re-arms it
+                if (timeouts_ptr != NULL)
+                    disarm_connection(fds->edata, timeouts_ptr);
+                if (busy_poll)
+                {
+                    // No thread handoff, the connection is served before the next poll
+                    serve_connection(fds);
+                    continue;
+                }
                 pthread_t read_thread;
                 if (verbose)
                     printf("(sfd,efd): (%d,%d)\n", fds->sfd, fds->efd);
-                if(pthread_create(&read_thread, NULL, read_in_thread, (void *) fds))
+                pthread_mutex_lock(&workers_lock);
+                n_workers++;
+                pthread_mutex_unlock(&workers_lock);
+                if(pthread_create(&read_thread, NULL, serve_in_thread, (void *) fds))
                 {
                     fprintf(stderr, "Error creating thread\n");
                     return 1;
@@ -567,14 +1735,84 @@ int main(int argc, const char *argv[])
                 }
             }
         }
+        // After the events, so none of them is for a connection closed here
+        if (timeouts_ptr != NULL)
+            expire_connections(timeouts_ptr, perf_ptr);
     }
 
     free(events);
 
     close(sfd);
 
+    fprintf(stderr, "INFO: Shutting down\n");
+    if (report_interval > 0)
+        pthread_join(reporter, NULL);
+    // Requests in progress still write objects and update the index, let them finish first
+    pthread_mutex_lock(&workers_lock);
+    if (n_workers > 0)
+        fprintf(stderr, "INFO: Waiting for %lu connection(s) being served\n", n_workers);
+    while (n_workers > 0)
+        pthread_cond_wait(&workers_done, &workers_lock);
+    pthread_mutex_unlock(&workers_lock);
+
+    unsigned long received = 0;
+    pthread_mutex_lock(&connections_lock);
+    struct EventData *open_conn;
+    for (open_conn = connections; open_conn != NULL; open_conn = open_conn->next)
+        received += __atomic_load_n(&open_conn->rx_bytes, __ATOMIC_RELAXED);
+    received += closed_bytes_total;
+    pthread_mutex_unlock(&connections_lock);
+    double elapsed = (now_ns() - start)/1e9;
+    fprintf(stderr, "INFO: Received %lu B on %lu connection(s) in %.1f s (%.2f Gbits/sec)\n",
+            received, n_connections, elapsed, received*8/elapsed/1e9);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user = (usage.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) + (usage.ru_utime.tv_usec - usage_start.ru_utime.tv_usec)/1e6;
+    double sys = (usage.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) + (usage.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)/1e6;
+    fprintf(stderr, "INFO: CPU time %.2f s user, %.2f s system (%.0f%% of a core, %.2f s per GiB received)\n",
+            user, sys, (user + sys)*100/elapsed, received > 0 ? (user + sys)/(received/(1024.0*MiB)) : 0);
+    fprintf(stderr, "INFO: Peak RSS %.1f MiB, with up to %lu connection(s) open at once\n",
+            usage.ru_maxrss/1024.0, max_open);
+    if (timeouts_ptr != NULL)
+    {
+        fprintf(stderr, "INFO: Timed out %lu idle connection(s), %lu waiting for a request head and %lu for a body\n",
+                timeouts.expired[TIMEOUT_IDLE], timeouts.expired[TIMEOUT_HEADER], timeouts.expired[TIMEOUT_BODY]);
+        pthread_mutex_destroy(&timeouts.lock);
+    }
+    if (tls_ctx != NULL)
+    {
+        tls_print_stats(stderr, &tls_stats, elapsed);
+        SSL_CTX_free(tls_ctx);
+    }
+    if (busy_poll)
+        fprintf(stderr, "INFO: Busy polling: %lu poll(s), %.1f%% empty, slept %lu time(s), spinning budget %.0f us\n",
+                bp.polls, bp.polls > 0 ? bp.empty_polls*100.0/bp.polls : 0, bp.sleeps, bp.spin_ns/1e3);
+    if (proxy_ptr != NULL)
+    {
+        proxy_print_stats(proxy_ptr);
+        proxy_destroy(proxy_ptr);
+    }
+    if (perf_ptr != NULL)
+    {
+        perf_print_stats(perf_ptr);
+        perf_destroy(perf_ptr);
+    }
+    if (compression_ptr != NULL)
+    {
+        compression_print_stats(compression_ptr);
+        compression_destroy(compression_ptr);
+    }
+    if (index_ptr != NULL)
+    {
+        bucket_index_flush(index_ptr, verbose);
+        bucket_index_print_stats(index_ptr);
+        bucket_index_destroy(index_ptr);
+    }
+
     if (enable_ceph)
         ceph_close(&conn);
+    buffer_pool_destroy(&content_pool);
+    buffer_pool_destroy(&compressed_pool);
 
     return EXIT_SUCCESS;
 }
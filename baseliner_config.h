@@ -0,0 +1,8 @@
+#ifndef BASELINER_CONFIG_H
+#define BASELINER_CONFIG_H
+
+// Buffers of baseliner, microbench measures the same sizes
+#define MAX_CONTENT_SIZE (1024*1024) //B, largest object that is stored
+#define READ_BUFFER_SIZE 512 //B
+#define RAW_READ_BUFFER_SIZE (64*1024) //B, without -w nothing is parsed, so reads can be larger
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "bucket_index.h"
+#include "histogram.h"
+
+/* Same hash Ceph uses for object names (ceph_str_hash_linux) */
+static unsigned int str_hash_linux(const char *str, size_t length)
+{
+    unsigned long hash = 0;
+    unsigned char c;
+
+    while (length--)
+    {
+        c = *str++;
+        hash = (hash + (c << 4) + (c >> 4)) * 11;
+    }
+    return (unsigned int)hash;
+}
+
+int bucket_index_init(struct BucketIndex *index, struct Connection *conn, const unsigned int n_shards, const unsigned int batch_size)
+{
+    unsigned int i;
+
+    if (n_shards == 0 || batch_size == 0 || batch_size > INDEX_MAX_BATCH)
+    {
+        fprintf(stderr, "ERROR: Invalid bucket index settings (shards: %u, batch: %u, max batch: %d)\n",
+                n_shards, batch_size, INDEX_MAX_BATCH);
+        return -1;
+    }
+
+    index->conn = conn;
+    index->n_shards = n_shards;
+    index->batch_size = batch_size;
+    index->shards = calloc(n_shards, sizeof(struct IndexShard));
+    for (i = 0; i < n_shards; i++)
+    {
+        struct IndexShard *shard = &index->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->keys = calloc(batch_size, sizeof(char*));
+        shard->vals = calloc(batch_size, sizeof(char*));
+        shard->val_lens = calloc(batch_size, sizeof(size_t));
+    }
+
+    return 0;
+}
+
+/* Picks a shard for the object key the same way RGW does (rgw_bucket_shard_index) */
+unsigned int bucket_index_shard(const struct BucketIndex *index, const char *key)
+{
+    unsigned int sid = str_hash_linux(key, strlen(key));
+    unsigned int sid2 = sid ^ ((sid & 0xFF) << 24);
+    return sid2 % index->n_shards;
+}
+
+/* Writes all pending entries of a shard as one omap op. Caller must hold the shard lock. */
+static void flush_shard(struct BucketIndex *index, const unsigned int shard_id, const short verbose)
+{
+    struct IndexShard *shard = &index->shards[shard_id];
+    unsigned int i;
+    char obj_name[128];
+
+    if (shard->n_pending == 0)
+        return;
+
+    // RGW names index objects ".dir.<bucket marker>.<shard id>"
+    snprintf(obj_name, sizeof(obj_name), ".dir.%s.%u", shard->bucket, shard_id);
+
+    unsigned long long start = now_ns();
+    ceph_omap_set(index->conn, obj_name, (const char**)shard->keys, (const char**)shard->vals,
+                  shard->val_lens, shard->n_pending, verbose);
+    unsigned long long elapsed = now_ns() - start;
+
+    shard->ops++;
+    shard->entries += shard->n_pending;
+    shard->total_ns += elapsed;
+    if (elapsed > shard->max_ns)
+        shard->max_ns = elapsed;
+
+    for (i = 0; i < shard->n_pending; i++)
+    {
+        free(shard->keys[i]);
+        free(shard->vals[i]);
+    }
+    shard->n_pending = 0;
+}
+
+int bucket_index_add(struct BucketIndex *index, const char *bucket, const char *key, const unsigned long obj_size, const short verbose)
+{
+    unsigned int shard_id = bucket_index_shard(index, key);
+    struct IndexShard *shard = &index->shards[shard_id];
+
+    // Count how often writers collide on the same shard
+    int err = pthread_mutex_trylock(&shard->lock);
+    if (err == EBUSY)
+    {
+        __atomic_fetch_add(&shard->conflicts, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&shard->lock);
+    }
+
+    // A batch can only target a single index object
+    if (shard->n_pending > 0 && strcmp(shard->bucket, bucket))
+        flush_shard(index, shard_id, verbose);
+    snprintf(shard->bucket, sizeof(shard->bucket), "%s", bucket);
+
+    char *val = malloc(INDEX_ENTRY_SIZE);
+    int val_len = snprintf(val, INDEX_ENTRY_SIZE, "{\"size\":%lu,\"mtime\":%ld}", obj_size, (long)time(NULL));
+    shard->keys[shard->n_pending] = strdup(key);
+    shard->vals[shard->n_pending] = val;
+    shard->val_lens[shard->n_pending] = val_len;
+    shard->n_pending++;
+    if (verbose)
+        printf("[index] key \"%s\" -> shard %u (%u pending)\n", key, shard_id, shard->n_pending);
+
+    if (shard->n_pending >= index->batch_size)
+        flush_shard(index, shard_id, verbose);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+/* Writes out whatever is left in partially filled batches */
+int bucket_index_flush(struct BucketIndex *index, const short verbose)
+{
+    unsigned int i;
+    for (i = 0; i < index->n_shards; i++)
+    {
+        pthread_mutex_lock(&index->shards[i].lock);
+        flush_shard(index, i, verbose);
+        pthread_mutex_unlock(&index->shards[i].lock);
+    }
+
+    return 0;
+}
+
+void bucket_index_print_stats(const struct BucketIndex *index)
+{
+    unsigned int i;
+    unsigned long ops = 0, entries = 0, conflicts = 0;
+    unsigned long long total_ns = 0, max_ns = 0;
+
+    fprintf(stderr, "INFO: Bucket index stats (%u shards, batch size %u):\n", index->n_shards, index->batch_size);
+    fprintf(stderr, "%8s %10s %10s %10s %12s %12s\n", "shard", "ops", "entries", "conflicts", "avg [us]", "max [us]");
+    for (i = 0; i < index->n_shards; i++)
+    {
+        const struct IndexShard *shard = &index->shards[i];
+        fprintf(stderr, "%8u %10lu %10lu %10lu %12.1f %12.1f\n", i, shard->ops, shard->entries, shard->conflicts,
+                shard->ops ? shard->total_ns/1000.0/shard->ops : 0.0, shard->max_ns/1000.0);
+        ops += shard->ops;
+        entries += shard->entries;
+        conflicts += shard->conflicts;
+        total_ns += shard->total_ns;
+        if (shard->max_ns > max_ns)
+            max_ns = shard->max_ns;
+    }
+    fprintf(stderr, "%8s %10lu %10lu %10lu %12.1f %12.1f\n", "total", ops, entries, conflicts,
+            ops ? total_ns/1000.0/ops : 0.0, max_ns/1000.0);
+}
+
+void bucket_index_destroy(struct BucketIndex *index)
+{
+    unsigned int i;
+    for (i = 0; i < index->n_shards; i++)
+    {
+        pthread_mutex_destroy(&index->shards[i].lock);
+        free(index->shards[i].keys);
+        free(index->shards[i].vals);
+        free(index->shards[i].val_lens);
+    }
+    free(index->shards);
+}
@@ -0,0 +1,40 @@
+#ifndef BUCKET_INDEX_H
+#define BUCKET_INDEX_H
+#include <pthread.h>
+#include "ceph_handler.h"
+
+#define INDEX_MAX_BATCH 1024
+#define INDEX_ENTRY_SIZE 128 //B
+
+/* A single bucket index shard, i.e. one omap object in RADOS */
+struct IndexShard {
+    pthread_mutex_t lock;
+    // Entries waiting to be written in a single batched omap op
+    char bucket[64];
+    char **keys;
+    char **vals;
+    size_t *val_lens;
+    unsigned int n_pending;
+    // Statistics
+    unsigned long ops;          // omap ops sent to RADOS
+    unsigned long entries;      // index entries written
+    unsigned long conflicts;    // times a thread found the shard locked by another thread
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+};
+
+/* Emulates RGW's sharded bucket index (one omap object per shard) */
+struct BucketIndex {
+    struct Connection *conn;
+    unsigned int n_shards;
+    unsigned int batch_size;
+    struct IndexShard *shards;
+};
+
+int bucket_index_init(struct BucketIndex*, struct Connection*, const unsigned int, const unsigned int);
+unsigned int bucket_index_shard(const struct BucketIndex*, const char*);
+int bucket_index_add(struct BucketIndex*, const char*, const char*, const unsigned long, const short);
+int bucket_index_flush(struct BucketIndex*, const short);
+void bucket_index_print_stats(const struct BucketIndex*);
+void bucket_index_destroy(struct BucketIndex*);
+#endif
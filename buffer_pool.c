@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include "buffer_pool.h"
+
+/* A free buffer if there is one, a new one otherwise (NULL if it can't be allocated) */
+char *buffer_pool_get(struct BufferPool *pool)
+{
+    char *buf = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free > 0)
+        buf = pool->free[--pool->n_free];
+    pthread_mutex_unlock(&pool->lock);
+    return buf != NULL ? buf : malloc(pool->size);
+}
+
+/* Takes a buffer back, NULL is ignored */
+void buffer_pool_put(struct BufferPool *pool, char *buf)
+{
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free < BUFFER_POOL_SIZE)
+    {
+        pool->free[pool->n_free++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buf);
+}
+
+/* Frees the buffers in the pool, those still out are the callers' to free */
+void buffer_pool_destroy(struct BufferPool *pool)
+{
+    while (pool->n_free > 0)
+        free(pool->free[--pool->n_free]);
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,27 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+#include <stddef.h>
+#include <pthread.h>
+
+#define BUFFER_POOL_SIZE 64         // free buffers kept for the next requests, more are freed
+
+/*
+ * Buffers of one size, handed out to requests in progress and taken back when
+ * they end. Allocating them per request would fault their pages in again every
+ * time, and keeping one per connection makes idle connections expensive, so
+ * with a pool memory follows the requests in flight. Thread-safe.
+ */
+struct BufferPool
+{
+    pthread_mutex_t lock;
+    size_t size;                    // of every buffer, may be set until the first one is taken
+    int n_free;
+    char *free[BUFFER_POOL_SIZE];
+};
+
+#define BUFFER_POOL_INITIALIZER(size) {PTHREAD_MUTEX_INITIALIZER, (size), 0, {NULL}}
+
+char *buffer_pool_get(struct BufferPool*);
+void buffer_pool_put(struct BufferPool*, char*);
+void buffer_pool_destroy(struct BufferPool*);
+#endif
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "ceph_handler.h"
 
 int ceph_connect(struct Connection *conn, const int argc, const char **argv, const short verbose)
@@ -96,8 +98,8 @@ int ceph_write_object(struct Connection *conn, const char *obj_name, const char
     rados_ioctx_t io = conn->io;
     int err;
 
-    /* Write data to the cluster synchronously. */
-    err = rados_write(io, obj_name, obj_content, obj_size, 0);
+    /* Write data to the cluster synchronously, replacing any previous content. */
+    err = rados_write_full(io, obj_name, obj_content, obj_size);
     if (err < 0)
     {
         fprintf(stderr, "ERROR: Cannot write object \"%s\": %s\n", obj_name, strerror(-err));
@@ -114,6 +116,35 @@ int ceph_write_object(struct Connection *conn, const char *obj_name, const char
     return 0;
 }
 
+/* Writes an object and sets an xattr on it in a single op, like RGW does with its attributes */
+int ceph_write_object_xattr(struct Connection *conn, const char *obj_name, const char *obj_content, unsigned long obj_size,
+                            const char *xattr_name, const char *xattr_value, const size_t xattr_len, const short verbose)
+{
+    rados_t cluster = conn->cluster;
+    rados_ioctx_t io = conn->io;
+    int err;
+
+    rados_write_op_t op = rados_create_write_op();
+    rados_write_op_write_full(op, obj_content, obj_size);
+    rados_write_op_setxattr(op, xattr_name, xattr_value, xattr_len);
+    err = rados_write_op_operate(op, io, obj_name, NULL, LIBRADOS_OPERATION_NOFLAG);
+    rados_release_write_op(op);
+    if (err < 0)
+    {
+        fprintf(stderr, "ERROR: Cannot write object \"%s\": %s\n", obj_name, strerror(-err));
+        rados_ioctx_destroy(io);
+        rados_shutdown(cluster);
+        exit(1);
+    }
+    else
+    {
+        if (verbose)
+            printf("\nWrote %lu bytes to object \"%s\" with xattr %s.\n", obj_size, obj_name, xattr_name);
+    }
+
+    return 0;
+}
+
 int ceph_remove_object(struct Connection *conn, const char *obj_name, const short verbose)
 {
     rados_t cluster = conn->cluster;
@@ -121,6 +152,9 @@ int ceph_remove_object(struct Connection *conn, const char *obj_name, const shor
     int err;
 
     err = rados_remove(io, obj_name);
+    /* Someone else may have removed it first */
+    if (err == -ENOENT)
+        return err;
     if (err < 0)
     {
         fprintf(stderr, "ERROR: Cannot remove object. %s\n", strerror(-err));
@@ -137,6 +171,68 @@ int ceph_remove_object(struct Connection *conn, const char *obj_name, const shor
     return 0;
 }
 
+/* Returns 0 and the size of the object, or a negative error code if it can't be found */
+int ceph_stat_object(struct Connection *conn, const char *obj_name, uint64_t *obj_size)
+{
+    int err = rados_stat(conn->io, obj_name, obj_size, NULL);
+    if (err < 0 && err != -ENOENT)
+        fprintf(stderr, "ERROR: Cannot stat object \"%s\": %s\n", obj_name, strerror(-err));
+
+    return err;
+}
+
+/* Reads len bytes of an object starting at offset. Returns the number of bytes read or -1 on error. */
+long ceph_read_object(struct Connection *conn, const char *obj_name, char *buf, const size_t len, const uint64_t offset, const short verbose)
+{
+    size_t done = 0;
+
+    /* A single read returns an int, so big ranges are read in pieces. */
+    while (done < len)
+    {
+        size_t chunk = len - done < CEPH_MAX_READ ? len - done : CEPH_MAX_READ;
+        int n = rados_read(conn->io, obj_name, buf + done, chunk, offset + done);
+        if (n < 0)
+        {
+            fprintf(stderr, "ERROR: Cannot read object \"%s\": %s\n", obj_name, strerror(-n));
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    if (verbose)
+        printf("\nRead %lu bytes at offset %lu of object \"%s\".\n", done, (unsigned long)offset, obj_name);
+
+    return done;
+}
+
+int ceph_omap_set(struct Connection *conn, const char *obj_name, const char **keys, const char **vals, const size_t *val_lens, const size_t n_entries, const short verbose)
+{
+    rados_t cluster = conn->cluster;
+    rados_ioctx_t io = conn->io;
+    int err;
+
+    /* Set all entries in a single write op, so they hit the OSD as one transaction. */
+    rados_write_op_t op = rados_create_write_op();
+    rados_write_op_omap_set(op, keys, vals, val_lens, n_entries);
+    err = rados_write_op_operate(op, io, obj_name, NULL, 0);
+    rados_release_write_op(op);
+    if (err < 0)
+    {
+        fprintf(stderr, "ERROR: Cannot set omap entries on object \"%s\": %s\n", obj_name, strerror(-err));
+        rados_ioctx_destroy(io);
+        rados_shutdown(cluster);
+        exit(1);
+    }
+    else
+    {
+        if (verbose)
+            printf("\nSet %lu omap entries on object \"%s\".\n", n_entries, obj_name);
+    }
+
+    return 0;
+}
+
 int ceph_close(struct Connection *conn)
 {
     rados_ioctx_destroy(conn->io);
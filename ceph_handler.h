@@ -1,5 +1,16 @@
 #ifndef CEPH_HANDLER_H
 #define CEPH_HANDLER_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define CEPH_MAX_READ 64*1024*1024 // bytes per rados_read call
+
+#ifdef LOCAL_STORAGE
+/* Objects are files in a local directory instead (see local_handler.c) */
+struct Connection {
+    int dir_fd;
+};
+#else
 #include <rados/librados.h>
 
 /* A structure holding rados objects required for connection to librados */
@@ -7,9 +18,14 @@ struct Connection {
     rados_t cluster;
     rados_ioctx_t io;
 };
+#endif
 
 int ceph_connect(struct Connection*, const int, const char**, const short);
 int ceph_write_object(struct Connection*, const char*, const char*, unsigned long, const short);
+int ceph_write_object_xattr(struct Connection*, const char*, const char*, unsigned long, const char*, const char*, const size_t, const short);
 int ceph_remove_object(struct Connection*, const char*, const short);
+int ceph_stat_object(struct Connection*, const char*, uint64_t*);
+long ceph_read_object(struct Connection*, const char*, char*, const size_t, const uint64_t, const short);
+int ceph_omap_set(struct Connection*, const char*, const char**, const char**, const size_t*, const size_t, const short);
 int ceph_close(struct Connection*);
 #endif
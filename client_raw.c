@@ -0,0 +1,603 @@
+/*
+ * Raw TCP load generator for baseliner's plain TCP mode (no -w): pushes bytes
+ * over many parallel connections as fast as the stack allows and reports the
+ * throughput per interval, like iperf. Connections either stream for the
+ * whole run or send a single object each and reconnect.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "payload.h"
+#include "histogram.h"
+
+#define KiB 1024
+#define MiB 1024*KiB
+
+#define MAX_THREADS 256
+#define MAX_CONNECTIONS 65536
+#define MAXEVENTS 64
+#define DEFAULT_BLOCK_SIZE 128*KiB
+
+/* What a connection does */
+enum RawMode
+{
+    MODE_STREAM,        // stays open and sends blocks back to back until the end of the run
+    MODE_OBJECT         // sends one object, closes and reconnects for the next one
+};
+
+/* How data is handed to the kernel */
+enum SendMode
+{
+    SEND_COPY,          // send() from the mapped payload
+    SEND_SENDFILE,      // sendfile() from the payload file
+    SEND_ZEROCOPY       // send() with MSG_ZEROCOPY, pages are pinned instead of copied
+};
+
+/* Settings shared (read-only) by all worker threads */
+struct RunConfig
+{
+    struct sockaddr_storage addr;   // server address, resolved once
+    socklen_t addrlen;
+    const struct Payload *payload;
+    enum RawMode mode;
+    enum SendMode send_mode;
+    size_t length;                  // block size (stream) or object size (object)
+    unsigned long n_objects;        // 0 for no limit
+    int sndbuf;                     // SO_SNDBUF, 0 for the system default
+    bool nodelay;
+    short verbose;
+};
+
+struct RawConn
+{
+    int fd;
+    bool connecting;
+    unsigned long object_id;        // picks the payload variant
+    size_t offset;                  // bytes of the current block/object sent
+};
+
+/* Per-thread state; the counters are read by the main thread for interval reports */
+struct Worker
+{
+    pthread_t thread;
+    int id;
+    int efd;
+    const struct RunConfig *config;
+    struct RawConn *conns;
+    int n_conns;
+    int n_open;
+    unsigned long bytes;
+    unsigned long objects;
+    unsigned long connects;
+    unsigned long errors;
+    unsigned long retransmits;      // from TCP_INFO of closed connections
+} __attribute__((aligned(64)));
+
+static volatile sig_atomic_t stopping = 0;
+static unsigned long next_object = 0;
+static int workers_done = 0;
+
+static void handle_signal(int sig)
+{
+    stopping = 1;
+}
+
+/* Starts a non-blocking connect and registers the socket with the worker's epoll */
+static int open_connection(struct Worker *w, struct RawConn *c)
+{
+    const struct RunConfig *config = w->config;
+    int one = 1;
+
+    c->fd = socket(config->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1)
+    {
+        perror("ERROR opening socket");
+        return -1;
+    }
+    if (config->sndbuf > 0 && setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &config->sndbuf, sizeof(config->sndbuf)) == -1)
+        perror("ERROR setting SO_SNDBUF");
+    if (config->nodelay && setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+        perror("ERROR setting TCP_NODELAY");
+    if (config->send_mode == SEND_ZEROCOPY && setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    {
+        perror("ERROR enabling SO_ZEROCOPY");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    if (connect(c->fd, (const struct sockaddr*)&config->addr, config->addrlen) == -1 && errno != EINPROGRESS)
+    {
+        perror("ERROR connecting");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(w->efd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        abort();
+    }
+    c->connecting = true;
+    c->offset = 0;
+    w->connects++;
+    w->n_open++;
+
+    return 0;
+}
+
+/* Does nothing if the connection is already closed, e.g. after a failed reconnect */
+static void close_connection(struct Worker *w, struct RawConn *c)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (c->fd == -1)
+        return;
+    if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        w->retransmits += info.tcpi_total_retrans;
+    close(c->fd);
+    c->fd = -1;
+    w->n_open--;
+}
+
+/* Claims the next object to send, false when all of them have been claimed */
+static bool claim_object(const struct RunConfig *config, unsigned long *object_id)
+{
+    *object_id = __atomic_fetch_add(&next_object, 1, __ATOMIC_RELAXED);
+    return config->n_objects == 0 || *object_id < config->n_objects;
+}
+
+/*
+ * Sends the rest of the current block or object. Returns 1 when it's all sent,
+ * 0 when the socket buffer is full and -1 on error.
+ */
+static int send_block(struct Worker *w, struct RawConn *c)
+{
+    const struct RunConfig *config = w->config;
+    const struct Payload *payload = config->payload;
+
+    while (c->offset < config->length)
+    {
+        ssize_t n;
+        if (config->send_mode == SEND_SENDFILE)
+        {
+            off_t off = payload_offset(payload, c->object_id) + c->offset;
+            n = sendfile(c->fd, payload->fd, &off, config->length - c->offset);
+        }
+        else
+            n = send(c->fd, payload_data(payload, c->object_id) + c->offset, config->length - c->offset,
+                     MSG_NOSIGNAL | (config->send_mode == SEND_ZEROCOPY ? MSG_ZEROCOPY : 0));
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            // Too many zerocopy sends in flight, wait for their completions (EPOLLERR)
+            if (errno == ENOBUFS && config->send_mode == SEND_ZEROCOPY)
+            {
+                drain_zerocopy_completions(c->fd);
+                return 0;
+            }
+            return -1;
+        }
+        c->offset += n;
+        __atomic_store_n(&w->bytes, w->bytes + n, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/* Keeps a connection busy until its socket buffer is full. Returns -1 if it had to be closed on error. */
+static int drive_connection(struct Worker *w, struct RawConn *c, uint32_t events)
+{
+    const struct RunConfig *config = w->config;
+
+    if ((events & EPOLLERR) && config->send_mode == SEND_ZEROCOPY)
+        drain_zerocopy_completions(c->fd);
+    if (c->connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == EINPROGRESS || (err == 0 && !(events & EPOLLOUT)))
+            return 0;
+        if (err != 0)
+        {
+            fprintf(stderr, "ERROR connecting: %s\n", strerror(err));
+            return -1;
+        }
+        c->connecting = false;
+    }
+
+    while (!stopping)
+    {
+        int r = send_block(w, c);
+        if (r == 0)
+            return 0;
+        if (r == -1)
+        {
+            perror("ERROR sending");
+            return -1;
+        }
+
+        if (config->mode == MODE_STREAM)
+        {
+            // Next block, from the next variant so the data keeps changing
+            c->object_id++;
+            c->offset = 0;
+            continue;
+        }
+
+        // The object is in the kernel's hands, close() still delivers it
+        __atomic_store_n(&w->objects, w->objects + 1, __ATOMIC_RELAXED);
+        if (config->verbose)
+            printf("INFO: Object %lu sent.\n", c->object_id + 1);
+        close_connection(w, c);
+        if (!claim_object(config, &c->object_id))
+            return 0;
+        if (open_connection(w, c) == -1)
+            return -1;
+        return 0;
+    }
+    return 0;
+}
+
+static void *run_worker(void *arg)
+{
+    struct Worker *w = arg;
+    const struct RunConfig *config = w->config;
+    struct epoll_event events[MAXEVENTS];
+    int i;
+
+    w->efd = epoll_create1(0);
+    if (w->efd == -1)
+    {
+        perror("epoll_create");
+        abort();
+    }
+    for (i = 0; i < w->n_conns; i++)
+    {
+        struct RawConn *c = &w->conns[i];
+        c->fd = -1;
+        if (config->mode == MODE_OBJECT && !claim_object(config, &c->object_id))
+            continue;
+        if (config->mode == MODE_STREAM)
+            c->object_id = w->id + i;
+        if (open_connection(w, c) == -1)
+            w->errors++;
+    }
+
+    while (!stopping && w->n_open > 0)
+    {
+        int n = epoll_wait(w->efd, events, MAXEVENTS, 100);
+        for (i = 0; i < n; i++)
+        {
+            struct RawConn *c = events[i].data.ptr;
+            if (c->fd == -1)
+                continue;
+            if (drive_connection(w, c, events[i].events) == -1)
+            {
+                w->errors++;
+                close_connection(w, c);
+                // A lost stream is gone for good, objects carry on with a new connection
+                if (config->mode == MODE_OBJECT && !stopping && claim_object(config, &c->object_id)
+                    && open_connection(w, c) == -1)
+                    w->errors++;
+            }
+        }
+    }
+
+    for (i = 0; i < w->n_conns; i++)
+        if (w->conns[i].fd != -1)
+            close_connection(w, &w->conns[i]);
+    close(w->efd);
+    __atomic_fetch_add(&workers_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void format_bytes(const double bytes, char *buf, const size_t size)
+{
+    if (bytes >= 1024.0*MiB)
+        snprintf(buf, size, "%.2f GBytes", bytes/(1024.0*MiB));
+    else if (bytes >= MiB)
+        snprintf(buf, size, "%.2f MBytes", bytes/(MiB));
+    else
+        snprintf(buf, size, "%.2f KBytes", bytes/KiB);
+}
+
+static void print_interval(const char *id, const double from, const double to, const unsigned long bytes,
+                           const unsigned long objects, const enum RawMode mode)
+{
+    char transfer[32];
+    format_bytes(bytes, transfer, sizeof(transfer));
+    printf("[%5s] %7.2f-%-7.2f sec %14s %8.2f Gbits/sec", id, from, to, transfer, bytes*8/(to - from)/1e9);
+    if (mode == MODE_OBJECT)
+        printf(" %10.1f objects/sec", objects/(to - from));
+    printf("\n");
+}
+
+void print_usage(char *argv[])
+{
+    fprintf(stderr,"usage %s [-t threads] [-c connections] [-m mode] [-l length] [-n num-objects] [-s send-mode] [-p payload] [-S sndbuf] [-N] [-d duration] [-i interval] [-v] hostname port\n", argv[0]);
+    fprintf(stderr,"\t-t <threads> - number of threads, each running its own event loop (default: 1)\n");
+    fprintf(stderr,"\t-c <connections> - total number of parallel connections (default: 1)\n");
+    fprintf(stderr,"\t-m <mode> - stream (long-lived connections) or object (a new connection per object) (default: stream)\n");
+    fprintf(stderr,"\t-l <length> - size in B of the blocks streamed, or of the objects, K/M/G suffixes allowed (default: %d KiB)\n", DEFAULT_BLOCK_SIZE/KiB);
+    fprintf(stderr,"\t-n <num-objects> - stop after this many objects in object mode (default: no limit)\n");
+    fprintf(stderr,"\t-s <send-mode> - how data is sent: copy, sendfile or zerocopy (MSG_ZEROCOPY) (default: copy)\n");
+    fprintf(stderr,"\t-p <payload> - data sent: constant ('*' repeated), random[:variants] or file:<path> (default: random)\n");
+    fprintf(stderr,"\t-S <sndbuf> - socket send buffer size (SO_SNDBUF) in bytes (default: system default)\n");
+    fprintf(stderr,"\t-N - disable Nagle's algorithm (TCP_NODELAY)\n");
+    fprintf(stderr,"\t-d <duration> - length of the run in seconds, 0 for no limit (default: 10)\n");
+    fprintf(stderr,"\t-i <interval> - seconds between throughput reports, 0 to only report at the end (default: 1)\n");
+    fprintf(stderr,"\t-v - print a report line per thread and a line for every object sent\n");
+}
+
+static size_t parse_length(const char *str)
+{
+    char *end;
+    size_t length = strtoul(str, &end, 10);
+    switch (*end)
+    {
+        case 'K': case 'k': length *= KiB; break;
+        case 'M': case 'm': length *= MiB; break;
+        case 'G': case 'g': length *= 1024UL*MiB; break;
+    }
+    return length;
+}
+
+int main(int argc, char *argv[])
+{
+    int n_threads = 1;
+    int n_conns = 1;
+    double duration = 10;
+    double interval = 1;
+    short verbose = 0;
+    const char *payload_spec = "random";
+    int opt, i;
+
+    struct RunConfig config;
+    memset(&config, 0, sizeof(config));
+    config.mode = MODE_STREAM;
+    config.send_mode = SEND_COPY;
+    config.length = DEFAULT_BLOCK_SIZE;
+
+    while ((opt = getopt(argc, argv, "t:c:m:l:n:s:p:S:Nd:i:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            case 'c':
+                n_conns = atoi(optarg);
+                break;
+            case 'm':
+                if (!strcmp(optarg, "stream"))
+                    config.mode = MODE_STREAM;
+                else if (!strcmp(optarg, "object"))
+                    config.mode = MODE_OBJECT;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                config.length = parse_length(optarg);
+                break;
+            case 'n':
+                config.n_objects = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                if (!strcmp(optarg, "copy"))
+                    config.send_mode = SEND_COPY;
+                else if (!strcmp(optarg, "sendfile"))
+                    config.send_mode = SEND_SENDFILE;
+                else if (!strcmp(optarg, "zerocopy"))
+                    config.send_mode = SEND_ZEROCOPY;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown send mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                payload_spec = optarg;
+                break;
+            case 'S':
+                config.sndbuf = atoi(optarg);
+                break;
+            case 'N':
+                config.nodelay = true;
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+            default:
+                print_usage(argv);
+                exit(0);
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        print_usage(argv);
+        exit(0);
+    }
+    if (n_threads < 1 || n_threads > MAX_THREADS || n_conns < 1 || n_conns > MAX_CONNECTIONS)
+    {
+        fprintf(stderr, "ERROR: Number of threads must be between 1 and %d and connections between 1 and %d\n",
+                MAX_THREADS, MAX_CONNECTIONS);
+        exit(1);
+    }
+    if (config.length == 0)
+    {
+        fprintf(stderr, "ERROR: Length must be at least 1 B\n");
+        exit(1);
+    }
+    if (duration <= 0 && (config.mode == MODE_STREAM || config.n_objects == 0))
+    {
+        fprintf(stderr, "ERROR: Without a duration the run needs an object limit (-m object -n ...)\n");
+        exit(1);
+    }
+    if (n_threads > n_conns)
+        n_threads = n_conns;
+    config.verbose = verbose;
+
+    // Resolve the server address once for all connections
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int s = getaddrinfo(argv[optind], argv[optind+1], &hints, &result);
+    if (s != 0)
+    {
+        fprintf(stderr, "ERROR, no such host: %s\n", gai_strerror(s));
+        exit(1);
+    }
+    memcpy(&config.addr, result->ai_addr, result->ai_addrlen);
+    config.addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    struct Payload payload;
+    if (payload_init(&payload, payload_spec, config.length) == -1)
+        exit(1);
+    config.payload = &payload;
+
+    fprintf(stderr, "INFO: %s mode, %d connection(s) over %d thread(s), %lu B %s, %s sends%s%s\n",
+            config.mode == MODE_STREAM ? "Stream" : "Object", n_conns, n_threads, (unsigned long)config.length,
+            config.mode == MODE_STREAM ? "blocks" : "objects",
+            config.send_mode == SEND_COPY ? "copy" : config.send_mode == SEND_SENDFILE ? "sendfile" : "zerocopy",
+            config.nodelay ? ", TCP_NODELAY" : "", config.sndbuf > 0 ? ", SO_SNDBUF set" : "");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Connections are spread evenly over the threads
+    struct Worker *workers = calloc(n_threads, sizeof(struct Worker));
+    struct RawConn *conns = calloc(n_conns, sizeof(struct RawConn));
+    unsigned long *prev_bytes = calloc(n_threads, sizeof(unsigned long));
+    unsigned long *prev_objects = calloc(n_threads, sizeof(unsigned long));
+    int first = 0;
+    unsigned long long start = now_ns();
+    for (i = 0; i < n_threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].config = &config;
+        workers[i].conns = conns + first;
+        workers[i].n_conns = n_conns/n_threads + (i < n_conns % n_threads);
+        first += workers[i].n_conns;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]))
+        {
+            fprintf(stderr, "Error creating thread\n");
+            exit(1);
+        }
+    }
+
+    // Report until the time is up or the workers are done
+    int running = n_threads;
+    unsigned long long end = duration > 0 ? start + duration*1e9 : 0;
+    unsigned long long last = start;
+    if (interval > 0)
+        printf("[%5s] %15s     %14s %19s\n", "ID", "Interval", "Transfer", "Bitrate");
+    while (!stopping && running > 0)
+    {
+        unsigned long long now = now_ns();
+        unsigned long long next = interval > 0 ? last + interval*1e9 : now + 100000000ULL;
+        if (end && end < next)
+            next = end;
+        if (next > now)
+        {
+            struct timespec ts = {(next - now)/1000000000ULL, (next - now)%1000000000ULL};
+            // Check for finished workers at least every 100 ms
+            if (next - now > 100000000ULL)
+                ts.tv_sec = 0, ts.tv_nsec = 100000000L;
+            nanosleep(&ts, NULL);
+            now = now_ns();
+        }
+        running = n_threads - __atomic_load_n(&workers_done, __ATOMIC_ACQUIRE);
+        if (end && now >= end)
+            stopping = 1;
+
+        if (interval > 0 && (now >= last + interval*1e9 || stopping || running == 0) && now > last)
+        {
+            unsigned long bytes = 0, objects = 0;
+            for (i = 0; i < n_threads; i++)
+            {
+                unsigned long b = __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+                unsigned long o = __atomic_load_n(&workers[i].objects, __ATOMIC_RELAXED);
+                if (verbose)
+                {
+                    char id[8];
+                    snprintf(id, sizeof(id), "%d", i);
+                    print_interval(id, (last - start)/1e9, (now - start)/1e9, b - prev_bytes[i], o - prev_objects[i],
+                                   config.mode);
+                }
+                bytes += b - prev_bytes[i];
+                objects += o - prev_objects[i];
+                prev_bytes[i] = b;
+                prev_objects[i] = o;
+            }
+            print_interval("SUM", (last - start)/1e9, (now - start)/1e9, bytes, objects, config.mode);
+            fflush(stdout);
+            last = now;
+        }
+    }
+    stopping = 1;
+    for (i = 0; i < n_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (now_ns() - start)/1e9;
+
+    unsigned long bytes = 0, objects = 0, connects = 0, errors = 0, retransmits = 0;
+    for (i = 0; i < n_threads; i++)
+    {
+        bytes += workers[i].bytes;
+        objects += workers[i].objects;
+        connects += workers[i].connects;
+        errors += workers[i].errors;
+        retransmits += workers[i].retransmits;
+    }
+    printf("INFO: Sent %lu B in %.3f s: %.2f Gbit/s, %.2f MiB/s\n", bytes, elapsed, bytes*8/elapsed/1e9,
+           bytes/elapsed/(MiB));
+    if (config.mode == MODE_OBJECT)
+        printf("INFO: %lu object(s), %.1f objects/s\n", objects, objects/elapsed);
+    printf("INFO: %lu connection(s) opened, %lu error(s), %lu retransmit(s)\n", connects, errors, retransmits);
+
+    payload_destroy(&payload);
+    free(workers);
+    free(conns);
+    free(prev_bytes);
+    free(prev_objects);
+
+    return errors ? 1 : 0;
+}
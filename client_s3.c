@@ -1,59 +1,2037 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <openssl/evp.h>
-#include <openssl/hmac.h>
 #include <time.h>
-#include <openssl/sha.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <poll.h>
+#include <math.h>
+#include "payload.h"
+#include "s3_auth.h"
+#include "histogram.h"
+#include "workload.h"
+#include "trace.h"
+#include "tls.h"
 
-unsigned char* hmac_sha256(const void *key, int keylen,
-                           const unsigned char *data, int datalen,
-                           unsigned char *result, unsigned int* resultlen)
+#define KiB 1024
+#define MiB 1024*KiB
+
+#define MAX_THREADS 256
+#define MAX_PROCESSES 256
+#define MAXEVENTS 64
+#define RESPONSE_BUFFER_SIZE 1024
+#define RECV_BUFFER_SIZE 1*MiB
+#define PIPE_SIZE 1*MiB
+#define VERIFY_PREFIX_SIZE 64
+#define MAX_HEADERS_SIZE 4096
+#define HASH_CACHE_SIZE 1024
+#define LOG_BUFFER_SIZE 64*KiB
+#define LOG_RECORD_SIZE 512
+#define HOLD_BATCH 1024             // idle connections (-H) being opened at a time
+#define HOLD_PER_SOURCE 16384       // idle connections per source address to a loopback server
+#define HOLD_CONNECT_TIMEOUT 10000  // ms
+
+// Not defined by older C libraries
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+enum ConnState
+{
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,         // TLS handshake (-S)
+    CONN_SEND_HEADERS,
+    CONN_WAIT_CONTINUE,
+    CONN_SEND_BODY,
+    CONN_WAIT_RESPONSE
+};
+
+/* Phases of a request, each ends when the next one starts */
+enum Phase
+{
+    PHASE_CONNECT,          // TCP (and TLS) handshake, nothing on a kept-alive connection
+    PHASE_SEND_HEADERS,
+    PHASE_WAIT_CONTINUE,    // until "100 Continue"
+    PHASE_SEND_BODY,
+    PHASE_WAIT_RESPONSE,    // until the final status line and headers
+    PHASE_READ_BODY,
+    N_PHASES
+};
+
+static const char *phase_names[N_PHASES] = {"connect", "send_headers", "wait_continue", "send_body",
+                                            "wait_response", "read_body"};
+
+/* Format of the per-request records (-o) */
+enum LogFormat
+{
+    LOG_CSV,
+    LOG_JSON                // one JSON object per line
+};
+
+/* How object keys are named */
+enum KeyMode
+{
+    KEY_FIXED,          // every request uses <object-name>
+    KEY_SEQUENTIAL,     // <object-name>-<counter>
+    KEY_RANDOM,         // <object-name>-<random suffix>
+    KEY_WORKLOAD,       // <object-name>-<key index drawn from the workload>
+    KEY_TRACE           // bucket and key of the replayed trace record
+};
+
+/* How the object body is handed to the kernel */
+enum SendMode
+{
+    SEND_COPY,          // send() from the mapped payload
+    SEND_SENDFILE,      // sendfile() from the payload file
+    SEND_ZEROCOPY       // send() with MSG_ZEROCOPY, pages are pinned instead of copied
+};
+
+/* How response bodies are read */
+enum RecvMode
+{
+    RECV_COPY,          // recv() into a large buffer
+    RECV_SPLICE         // splice() to /dev/null through a pipe, never copied to user space
+};
+
+/* How requests are scheduled */
+enum ArrivalMode
+{
+    ARRIVAL_CLOSED,     // a new request as soon as one finishes
+    ARRIVAL_CONSTANT,   // open loop, evenly spaced requests
+    ARRIVAL_POISSON,    // open loop, exponentially distributed gaps
+    ARRIVAL_TRACE       // open loop, at the (scaled) times of a replayed trace
+};
+
+/* Settings shared (read-only) by all worker threads */
+struct RunConfig
+{
+    struct sockaddr_storage addr;   // server address, resolved once
+    socklen_t addrlen;
+    bool reuse;                     // keep connections alive between objects
+    SSL_CTX *tls;                   // with -S, NULL for plaintext
+    bool tls_resume;                // resume the TLS session of an earlier connection
+    const struct Payload *payload;  // object content, shared by all requests
+    enum SendMode send_mode;
+    enum RecvMode recv_mode;
+    int rcvbuf;                     // SO_RCVBUF of connections, 0 for the system default
+    enum OpType op;                 // of every request when there is no workload
+    bool verify;                    // compare the SHA-256 of GET bodies with the uploaded content
+    unsigned long range_start;
+    unsigned long range_len;        // GET byte ranges of this length, 0 for whole objects
+    bool range_random;              // ranges start at random offsets within object_size
+    unsigned long object_size;
+    unsigned long n_objects;
+    short sendonly;
+    short verbose;
+    const char *key_id;
+    const char *secret;
+    char host_header[NI_MAXHOST + NI_MAXSERV + 1];
+    const char *bucket;
+    const char *object_name;    // key prefix
+    enum KeyMode key_mode;
+    int n_threads;
+    enum ArrivalMode arrival;
+    double rate;                    // target requests/s per thread in open-loop modes
+    unsigned long long deadline_ns; // no new requests after this time, 0 if unlimited
+    const struct Workload *workload;    // mix of operations, sizes and keys, NULL for fixed-size PUTs
+    const struct Trace *trace;      // requests to replay instead, object IDs index its records
+    double trace_speed;             // replay this many times faster than recorded
+    unsigned long long trace_start_ns;  // when the first record of the trace is due
+    int log_fd;                     // per-request records, -1 if not written
+    enum LogFormat log_format;
+    long long realtime_offset_ns;   // CLOCK_REALTIME - CLOCK_MONOTONIC, to match server logs
+};
+
+/* State of a single in-flight request */
+struct ClientConn
+{
+    int fd;
+    SSL *ssl;               // with -S
+    enum ConnState state;
+    unsigned long object_id;
+    enum OpType op;
+    unsigned long size;     // of the object sent
+    unsigned long key;      // index of the key in workload mode
+    unsigned long long intended_ns; // when the request should have been sent
+    unsigned long long start_ns;    // when it actually was
+    unsigned long long phase_end_ns[N_PHASES];  // 0 for phases the request skipped
+    char headers[MAX_HEADERS_SIZE];
+    size_t headers_len;
+    bool reused;            // the connection already served a request
+    bool keep_alive;        // the server didn't ask to close the connection
+    size_t offset;          // bytes of the buffer being sent that were already written
+    char inbuf[RESPONSE_BUFFER_SIZE];
+    size_t in_len;
+    int status;             // HTTP status of the last response head
+    long content_length;    // of the response body
+    long body_left;         // response body bytes still to be read
+    unsigned long range_start;
+    unsigned long range_len;        // of a range GET, 0 for the whole object
+    bool verifying;         // the body is being hashed
+    EVP_MD_CTX *md;         // streaming SHA-256 of the body
+    int variant;            // payload variant the body seems to be, -1 if not known yet
+    unsigned long body_start;   // offset of the body in the object
+};
+
+/* Requests that are due in open-loop mode, but have no free connection yet */
+struct Backlog
+{
+    unsigned long *object_ids;
+    unsigned long long *intended_ns;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+/* Results of one operation in one size class */
+struct OpStats
+{
+    struct Histogram latency;
+    unsigned long ops;
+    unsigned long bytes;
+    unsigned long errors;
+};
+
+/* SHA-256 of part of a payload variant, for objects smaller than the payload and byte ranges */
+struct HashCacheEntry
+{
+    bool valid;
+    unsigned int variant;
+    unsigned long offset;
+    unsigned long size;
+    char hash[SHA256_HEX_LENGTH];
+};
+
+/* A thread running its own event loop over a set of connections */
+struct Worker
+{
+    pthread_t thread;
+    int id;
+    int efd;
+    int tfd;                        // timer for open-loop arrivals
+    const struct RunConfig *config;
+    int n_conns;
+    struct ClientConn *conns;
+    struct ClientConn **free_conns; // idle connections in open-loop mode
+    int n_free;
+    int active;
+    struct Backlog backlog;
+    unsigned long long next_arrival_ns;
+    unsigned long next_record;      // of the trace, timed replays split records between threads
+    bool arrivals_done;
+    struct Histogram latency;       // from intended send time, corrects coordinated omission
+    struct Histogram service;       // from actual send time
+    struct SigV4Signer signer;
+    uint64_t rng;
+    unsigned long long sign_ns;     // time spent naming and signing requests
+    unsigned long long hash_ns;     // time spent hashing partial payloads
+    struct HashCacheEntry *hash_cache;
+    struct OpStats stats[N_OPS][N_SIZE_CLASSES];
+    struct Histogram phases[N_PHASES];
+    unsigned long long rtt_us_sum;
+    unsigned long rtt_samples;
+    unsigned long retransmits;
+    char *log_buf;                  // per-request records not yet written
+    size_t log_len;
+    char *recv_buf;
+    int pipe_fds[2];                // for splicing response bodies
+    int devnull;
+    unsigned long verified;
+    unsigned long verify_errors;
+    unsigned long ops;
+    unsigned long bytes;
+    unsigned long errors;
+    unsigned long connects;
+    struct TlsStats tls;
+    SSL_SESSION *session;           // of the last connection closed, resumed by the next ones
+};
+
+/* Run state shared by all workers, in memory shared with the worker processes in multi-process mode */
+struct SharedState
+{
+    unsigned long next_object;      // index of the next object to send
+    int workers_done;
+};
+
+static struct SharedState *shared;
+
+static int make_socket_non_blocking(int sfd)
+{
+    int flags = fcntl(sfd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+    if (fcntl(sfd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts a non-blocking connect to the server. Returns the socket or -1 on error. */
+static int open_connection(const struct RunConfig *config)
+{
+    int sfd = socket(config->addr.ss_family, SOCK_STREAM, 0);
+    if (sfd == -1)
+    {
+        perror("ERROR opening socket");
+        return -1;
+    }
+    if (make_socket_non_blocking(sfd) == -1)
+    {
+        close(sfd);
+        return -1;
+    }
+    int one = 1;
+    if (config->rcvbuf > 0 && setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf, sizeof(config->rcvbuf)) == -1)
+        perror("ERROR setting SO_RCVBUF");
+    // TLS records are written one by one, Nagle's algorithm would hold them back for delayed ACKs
+    if (config->tls != NULL && setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+        perror("ERROR setting TCP_NODELAY");
+    if (config->send_mode == SEND_ZEROCOPY && setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    {
+        perror("ERROR enabling SO_ZEROCOPY");
+        close(sfd);
+        return -1;
+    }
+    if (connect(sfd, (const struct sockaddr*)&config->addr, config->addrlen) == -1 && errno != EINPROGRESS)
+    {
+        perror("ERROR connecting");
+        close(sfd);
+        return -1;
+    }
+
+    return sfd;
+}
+
+/*
+ * Starts connecting a batch of idle connections (-H) and waits for them. A source
+ * address only has so many ports, so to a loopback server each HOLD_PER_SOURCE of
+ * them come from the next address from 127.0.0.2 on, with the port picked on
+ * connect. Returns how many connected, their sockets are in fds.
+ */
+static int hold_batch(const struct RunConfig *config, const int first, const int n, int *fds)
+{
+    const struct sockaddr_in *server = (const struct sockaddr_in*)&config->addr;
+    bool loopback = config->addr.ss_family == AF_INET && (ntohl(server->sin_addr.s_addr) >> 24) == 127;
+    int i, started = 0, connected = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        int sfd = socket(config->addr.ss_family, SOCK_STREAM, 0);
+        if (sfd == -1)
+        {
+            perror("ERROR opening socket");
+            break;
+        }
+        if (loopback)
+        {
+            struct sockaddr_in source;
+            int one = 1;
+            memset(&source, 0, sizeof(source));
+            source.sin_family = AF_INET;
+            source.sin_addr.s_addr = htonl((127U << 24) + 2 + (first + i)/HOLD_PER_SOURCE);
+            setsockopt(sfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+            if (bind(sfd, (const struct sockaddr*)&source, sizeof(source)) == -1)
+            {
+                perror("ERROR binding to a source address");
+                close(sfd);
+                break;
+            }
+        }
+        if (make_socket_non_blocking(sfd) == -1 ||
+            (connect(sfd, (const struct sockaddr*)&config->addr, config->addrlen) == -1 && errno != EINPROGRESS))
+        {
+            perror("ERROR connecting");
+            close(sfd);
+            break;
+        }
+        fds[started++] = sfd;
+    }
+    for (i = 0; i < started; i++)
+    {
+        struct pollfd pfd = {fds[i], POLLOUT, 0};
+        int error = ETIMEDOUT;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, HOLD_CONNECT_TIMEOUT) == 1)
+            getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0)
+        {
+            // Only the first failure, the rest likely fail the same way
+            if (connected == i)
+                fprintf(stderr, "ERROR: Holding connection %d: %s\n", first + i, strerror(error));
+            close(fds[i]);
+            continue;
+        }
+        fds[connected++] = fds[i];
+    }
+
+    return connected;
+}
+
+/* Opens n idle connections (-H), which are held for the whole run and never send anything. Returns how many opened. */
+static int hold_connections(const struct RunConfig *config, const int n, int *fds)
+{
+    int opened = 0;
+    while (opened < n)
+    {
+        int batch = n - opened < HOLD_BATCH ? n - opened : HOLD_BATCH;
+        int connected = hold_batch(config, opened, batch, fds + opened);
+        opened += connected;
+        if (connected < batch)
+            break;
+    }
+    return opened;
+}
+
+/* Counts the held connections the server closed, after an idle timeout for instance */
+static int count_closed(const int *fds, const int n)
+{
+    int i, closed = 0;
+    for (i = 0; i < n; i++)
+    {
+        struct pollfd pfd = {fds[i], POLLIN | POLLRDHUP, 0};
+        if (poll(&pfd, 1, 0) == 1)
+            closed++;
+    }
+    return closed;
+}
+
+static void set_events(struct Worker *w, struct ClientConn *c, uint32_t events)
+{
+    struct epoll_event event;
+    event.data.ptr = c;
+    event.events = events;
+    if (epoll_ctl(w->efd, EPOLL_CTL_MOD, c->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        abort();
+    }
+}
+
+/*
+ * Writes as much of buf as the socket accepts, continuing from *offset, through TLS
+ * if ssl isn't NULL. Returns 1 when the whole buffer was written, 0 on a short write
+ * and -1 on error.
+ */
+static int write_pending(int fd, SSL *ssl, const char *buf, size_t len, size_t *offset, int flags)
+{
+    while (*offset < len)
+    {
+        ssize_t n = ssl != NULL ? tls_write(ssl, buf + *offset, len - *offset)
+                                : send(fd, buf + *offset, len - *offset, MSG_NOSIGNAL | flags);
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        *offset += n;
+    }
+    return 1;
+}
+
+/* Sends the object body the configured way. Same return values as write_pending(). */
+static int write_body(struct ClientConn *c, const struct RunConfig *config)
+{
+    const struct Payload *payload = config->payload;
+
+    // Over TLS, files can only be sent as they are if the kernel encrypts them
+    if (config->send_mode == SEND_SENDFILE && (c->ssl == NULL || tls_ktls_send(c->ssl)))
+    {
+        while (c->offset < c->size)
+        {
+            off_t off = payload_offset(payload, c->object_id) + c->offset;
+            ssize_t n = c->ssl != NULL ? tls_sendfile(c->ssl, payload->fd, off, c->size - c->offset)
+                                       : sendfile(c->fd, payload->fd, &off, c->size - c->offset);
+            if (n == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            c->offset += n;
+        }
+        return 1;
+    }
+
+    return write_pending(c->fd, c->ssl, payload_data(payload, c->object_id), c->size, &c->offset,
+                         config->send_mode == SEND_ZEROCOPY ? MSG_ZEROCOPY : 0);
+}
+
+/*
+ * Reads a response head (status line and headers) into the connection buffer.
+ * Returns 1 once the head is complete, 0 if more data is needed and -1 on error or EOF.
+ * Body bytes that came with the head are left at the start of inbuf.
+ */
+static int read_response_head(struct ClientConn *c)
+{
+    while (1)
+    {
+        char *end = NULL;
+        if (c->in_len > 0)
+        {
+            c->inbuf[c->in_len] = '\0';
+            end = strstr(c->inbuf, "\r\n\r\n");
+        }
+        if (end != NULL)
+        {
+            size_t head_len = end + 4 - c->inbuf;
+            c->status = 0;
+            sscanf(c->inbuf, "HTTP/%*s %d", &c->status);
+            c->content_length = 0;
+            char *cl = strcasestr(c->inbuf, "\r\nContent-Length:");
+            if (cl != NULL && cl < end)
+                c->content_length = strtol(cl + strlen("\r\nContent-Length:"), NULL, 10);
+            char *close_hdr = strcasestr(c->inbuf, "\r\nConnection: close");
+            if (close_hdr != NULL && close_hdr < end)
+                c->keep_alive = false;
+            c->in_len -= head_len;
+            memmove(c->inbuf, c->inbuf + head_len, c->in_len);
+            return 1;
+        }
+        if (c->in_len >= sizeof(c->inbuf) - 1)
+        {
+            fprintf(stderr, "ERROR: Response head too long\n");
+            return -1;
+        }
+
+        ssize_t n = c->ssl != NULL ? tls_read(c->ssl, c->inbuf + c->in_len, sizeof(c->inbuf) - 1 - c->in_len)
+                                   : recv(c->fd, c->inbuf + c->in_len, sizeof(c->inbuf) - 1 - c->in_len, 0);
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("ERROR reading data from socket");
+            return -1;
+        }
+        if (n == 0)
+        {
+            // Not an error yet if a kept-alive connection timed out, see fail_request()
+            if (!c->reused || c->in_len > 0)
+                fprintf(stderr, "ERROR: Server closed the connection\n");
+            return -1;
+        }
+        c->in_len += n;
+    }
+}
+
+/* SHA-256 of size bytes at offset of a payload variant, hashed on first use and cached */
+static const char *cached_hash(struct Worker *w, const unsigned int variant, const unsigned long offset,
+                               const unsigned long size)
+{
+    const struct Payload *payload = w->config->payload;
+    struct HashCacheEntry *entry = &w->hash_cache[(size*31 + offset*17 + variant) % HASH_CACHE_SIZE];
+
+    if (!entry->valid || entry->size != size || entry->offset != offset || entry->variant != variant)
+    {
+        unsigned long long start = now_ns();
+        sha256_hex(payload_data(payload, variant) + offset, size, entry->hash);
+        entry->valid = true;
+        entry->variant = variant;
+        entry->offset = offset;
+        entry->size = size;
+        w->hash_ns += now_ns() - start;
+    }
+    return entry->hash;
+}
+
+/* Starts hashing a GET body that is about to be read */
+static void start_verify(struct Worker *w, struct ClientConn *c)
+{
+    c->verifying = w->config->verify && c->op == OP_GET && c->status/100 == 2;
+    if (!c->verifying)
+        return;
+    EVP_DigestInit_ex(c->md, EVP_sha256(), NULL);
+    c->variant = -1;
+    // A server that ignored the range sends the whole object
+    c->body_start = c->status == 206 ? c->range_start : 0;
+}
+
+static void verify_chunk(struct Worker *w, struct ClientConn *c, const char *data, const size_t len)
+{
+    const struct Payload *payload = w->config->payload;
+    unsigned int i;
+
+    // Guess which variant was uploaded under this key from the start of the body
+    if (c->variant == -1 && len > 0)
+    {
+        size_t n = len < VERIFY_PREFIX_SIZE ? len : VERIFY_PREFIX_SIZE;
+        for (i = 0; i < payload->n_variants && c->body_start + n <= payload->object_size; i++)
+        {
+            if (!memcmp(payload_data(payload, i) + c->body_start, data, n))
+            {
+                c->variant = i;
+                break;
+            }
+        }
+    }
+    EVP_DigestUpdate(c->md, data, len);
+}
+
+/* Compares the hash of a fully read body with the hash of the payload it should be a copy of */
+static bool verify_body(struct Worker *w, struct ClientConn *c)
+{
+    const struct Payload *payload = w->config->payload;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hash[SHA256_HEX_LENGTH];
+    unsigned int i;
+
+    EVP_DigestFinal_ex(c->md, digest, NULL);
+    to_hex(digest, SHA256_DIGEST_LENGTH, hash);
+    if (c->body_start + c->content_length > payload->object_size)
+        return false;
+    if (c->variant >= 0 && !strcmp(hash, cached_hash(w, c->variant, c->body_start, c->content_length)))
+        return true;
+    // The guess may have been wrong if the variants start alike
+    for (i = 0; i < payload->n_variants; i++)
+        if ((int)i != c->variant && !strcmp(hash, cached_hash(w, i, c->body_start, c->content_length)))
+            return true;
+    return false;
+}
+
+/* Moves len bytes that were spliced into the pipe on to /dev/null */
+static int drain_pipe(struct Worker *w, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = splice(w->pipe_fds[0], NULL, w->devnull, NULL, len, SPLICE_F_MOVE);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("ERROR splicing to /dev/null");
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Reads the response body, discarding it or feeding it to the verification hash.
+ * Returns 1 when it was fully read, 0 if more data is needed and -1 on error.
+ */
+static int read_response_body(struct Worker *w, struct ClientConn *c)
+{
+    // Over TLS, only records the kernel decrypts can be spliced, and only once OpenSSL has handed out what it holds
+    bool splicing = w->config->recv_mode == RECV_SPLICE && !c->verifying &&
+                    (c->ssl == NULL || (tls_ktls_recv(c->ssl) && SSL_pending(c->ssl) == 0));
+
+    // Whatever came in with the head counts towards the body
+    if (c->in_len > 0)
+    {
+        size_t used = c->in_len < (size_t)c->body_left ? c->in_len : (size_t)c->body_left;
+        if (c->verifying)
+            verify_chunk(w, c, c->inbuf, used);
+        c->body_left -= used;
+        c->in_len = 0;
+    }
+    while (c->body_left > 0)
+    {
+        size_t want = (size_t)c->body_left < RECV_BUFFER_SIZE ? (size_t)c->body_left : RECV_BUFFER_SIZE;
+        ssize_t n;
+        if (splicing)
+            n = splice(c->fd, NULL, w->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else if (c->ssl != NULL)
+            n = tls_read(c->ssl, w->recv_buf, want);
+        else
+            n = recv(c->fd, w->recv_buf, want, 0);
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("ERROR reading data from socket");
+            return -1;
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "ERROR: Server closed the connection\n");
+            return -1;
+        }
+        if (splicing && drain_pipe(w, n) == -1)
+            return -1;
+        if (c->verifying)
+            verify_chunk(w, c, w->recv_buf, n);
+        c->body_left -= n;
+    }
+    return 1;
+}
+
+static void next_request(struct Worker *w, struct ClientConn *c);
+static int send_object(struct Worker *w, struct ClientConn *c, unsigned long object_id, unsigned long long intended_ns);
+
+static void close_connection(struct Worker *w, struct ClientConn *c)
+{
+    if (c->ssl != NULL)
+    {
+        // Responses carry their length, so like most HTTP clients this doesn't send a close_notify (which
+        // would race with the FIN and leave the server in TIME_WAIT), but then OpenSSL drops the session
+        SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN);
+        // With TLS 1.3 the session tickets come after the handshake, so the session is taken at the end
+        SSL_SESSION *session = SSL_get0_session(c->ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        if (w->config->tls_resume && session != NULL && SSL_SESSION_is_resumable(session))
+#else
+        // Before 1.1.1 (no TLS 1.3) the session is complete once the handshake is
+        if (w->config->tls_resume && session != NULL)
+#endif
+        {
+            SSL_SESSION_free(w->session);
+            w->session = SSL_get1_session(c->ssl);
+        }
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->reused = false;
+}
+
+/* Writes out the buffered per-request records. Appends of whole buffers don't interleave between threads. */
+static void flush_log(struct Worker *w)
+{
+    if (w->log_len > 0 && write(w->config->log_fd, w->log_buf, w->log_len) == -1)
+        perror("ERROR writing request log");
+    w->log_len = 0;
+}
+
+/* Adds a record of a finished request with the duration of each phase and the TCP state of its connection */
+static void log_request(struct Worker *w, const struct ClientConn *c, const unsigned long size, const bool ok,
+                        const unsigned long long *phase_ns, const struct tcp_info *info)
+{
+    const struct RunConfig *config = w->config;
+    char *rec = w->log_buf + w->log_len;
+    double ts = (c->start_ns + config->realtime_offset_ns)/1e9;
+    unsigned long long total = phase_ns[N_PHASES];
+    const char *fmt;
+
+    if (config->log_format == LOG_JSON)
+        fmt = "{\"ts\":%.6f,\"thread\":%d,\"id\":%lu,\"op\":\"%s\",\"key\":%lu,\"size\":%lu,\"status\":%d,"
+              "\"ok\":%d,\"reused\":%d,\"queue_us\":%.1f,\"connect_us\":%.1f,\"send_headers_us\":%.1f,"
+              "\"wait_continue_us\":%.1f,\"send_body_us\":%.1f,\"wait_response_us\":%.1f,\"read_body_us\":%.1f,"
+              "\"total_us\":%.1f,\"rtt_us\":%u,\"rttvar_us\":%u,\"retrans\":%u,\"cwnd\":%u}\n";
+    else
+        fmt = "%.6f,%d,%lu,%s,%lu,%lu,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%u,%u,%u,%u\n";
+    w->log_len += snprintf(rec, LOG_RECORD_SIZE, fmt, ts, w->id, c->object_id, op_name(c->op),
+                           config->key_mode == KEY_WORKLOAD ? c->key : c->object_id, size, c->status, ok,
+                           c->reused, (c->start_ns - c->intended_ns)/1e3,
+                           phase_ns[PHASE_CONNECT]/1e3, phase_ns[PHASE_SEND_HEADERS]/1e3,
+                           phase_ns[PHASE_WAIT_CONTINUE]/1e3, phase_ns[PHASE_SEND_BODY]/1e3,
+                           phase_ns[PHASE_WAIT_RESPONSE]/1e3, phase_ns[PHASE_READ_BODY]/1e3, total/1e3,
+                           info->tcpi_rtt, info->tcpi_rttvar, info->tcpi_total_retrans, info->tcpi_snd_cwnd);
+    if (w->log_len > LOG_BUFFER_SIZE - LOG_RECORD_SIZE)
+        flush_log(w);
+}
+
+/* Splits the time since the request was sent into phases and records them */
+static void record_phases(struct Worker *w, struct ClientConn *c, const bool ok, const unsigned long size,
+                          const unsigned long long now)
+{
+    unsigned long long phase_ns[N_PHASES + 1];
+    unsigned long long prev = c->start_ns;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int i;
+
+    for (i = 0; i < N_PHASES; i++)
+    {
+        phase_ns[i] = 0;
+        if (c->phase_end_ns[i] == 0)
+            continue;
+        phase_ns[i] = c->phase_end_ns[i] - prev;
+        prev = c->phase_end_ns[i];
+        if (ok)
+            hist_record(&w->phases[i], phase_ns[i]);
+    }
+    phase_ns[N_PHASES] = now - c->start_ns;
+
+    // Sampled at completion; the connection may be gone after a failure
+    memset(&info, 0, sizeof(info));
+    if (c->fd != -1 && getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        w->rtt_us_sum += info.tcpi_rtt;
+        w->rtt_samples++;
+        w->retransmits += info.tcpi_total_retrans;
+    }
+
+    if (w->config->log_fd != -1)
+        log_request(w, c, size, ok, phase_ns, &info);
+}
+
+static void finish_request(struct Worker *w, struct ClientConn *c, bool ok)
+{
+    const struct RunConfig *config = w->config;
+
+    w->active--;
+    // The size of a GET is only known from its response, DELETEs have none
+    unsigned long size = c->op == OP_GET ? (unsigned long)c->content_length : c->size;
+    struct OpStats *stats = &w->stats[c->op][c->op == OP_DELETE ? 0 : size_class(size)];
+    unsigned long long now = now_ns();
+    record_phases(w, c, ok, size, now);
+    if (ok)
+    {
+        hist_record(&w->latency, now - c->intended_ns);
+        hist_record(&w->service, now - c->start_ns);
+        w->ops++;
+        // Read by the interval report
+        __atomic_store_n(&w->bytes, w->bytes + size, __ATOMIC_RELAXED);
+        if (config->workload != NULL || config->trace != NULL)
+        {
+            hist_record(&stats->latency, now - c->intended_ns);
+            stats->ops++;
+            stats->bytes += size;
+        }
+        if (config->verbose)
+        {
+            if (config->trace != NULL)
+                printf("INFO: %s of record %lu done (%lu B).\n", op_name(c->op), c->object_id+1, size);
+            else if (config->workload != NULL)
+                printf("INFO: %s of key %lu done (%lu B).\n", op_name(c->op), c->key, size);
+            else
+                printf("INFO: Object %lu sent.\n", c->object_id+1);
+        }
+    }
+    else
+    {
+        w->errors++;
+        stats->errors++;
+        if (config->trace != NULL)
+            fprintf(stderr, "ERROR: %s of record %lu failed (status %d)\n", op_name(c->op), c->object_id+1, c->status);
+        else if (config->workload != NULL)
+            fprintf(stderr, "ERROR: %s of key %lu failed (status %d)\n", op_name(c->op), c->key, c->status);
+        else
+            fprintf(stderr, "ERROR: Object %lu failed (status %d)\n", c->object_id+1, c->status);
+    }
+
+    if (ok && config->reuse && c->keep_alive)
+        c->reused = true;
+    else
+        close_connection(w, c);
+
+    next_request(w, c);
+}
+
+/*
+ * A kept-alive connection may have been closed by the server while idle.
+ * Retry the object once on a fresh connection if nothing was received on it yet.
+ * Requests without a body are idempotent and are retried until their response starts.
+ */
+static void fail_request(struct Worker *w, struct ClientConn *c)
+{
+    bool no_body = c->op != OP_PUT && c->body_left == -1;
+    if (c->reused && c->in_len == 0 && (c->state <= CONN_WAIT_CONTINUE || no_body))
+    {
+        close_connection(w, c);
+        w->active--;
+        if (send_object(w, c, c->object_id, c->intended_ns) == -1)
+            next_request(w, c);
+        return;
+    }
+    finish_request(w, c, false);
+}
+
+/* Takes the next object off the shared counter. Returns false when the run is over. */
+static bool claim_object(struct Worker *w, unsigned long *object_id)
+{
+    const struct RunConfig *config = w->config;
+
+    if (config->deadline_ns && now_ns() >= config->deadline_ns)
+        return false;
+    if (config->arrival == ARRIVAL_TRACE)
+    {
+        // Every thread replays its own share of the records, so it knows when the next one is due
+        *object_id = w->next_record;
+        w->next_record += config->n_threads;
+    }
+    else
+        *object_id = __atomic_fetch_add(&shared->next_object, 1, __ATOMIC_RELAXED);
+    return config->n_objects == 0 || *object_id < config->n_objects;
+}
+
+static void backlog_push(struct Backlog *backlog, unsigned long object_id, unsigned long long intended_ns)
+{
+    if (backlog->count == backlog->capacity)
+    {
+        // Grow and unwrap the ring
+        size_t capacity = backlog->capacity ? 2*backlog->capacity : 1024;
+        unsigned long *ids = malloc(capacity*sizeof(*ids));
+        unsigned long long *times = malloc(capacity*sizeof(*times));
+        size_t i;
+        for (i = 0; i < backlog->count; i++)
+        {
+            ids[i] = backlog->object_ids[(backlog->head + i) % backlog->capacity];
+            times[i] = backlog->intended_ns[(backlog->head + i) % backlog->capacity];
+        }
+        free(backlog->object_ids);
+        free(backlog->intended_ns);
+        backlog->object_ids = ids;
+        backlog->intended_ns = times;
+        backlog->head = 0;
+        backlog->capacity = capacity;
+    }
+    size_t tail = (backlog->head + backlog->count) % backlog->capacity;
+    backlog->object_ids[tail] = object_id;
+    backlog->intended_ns[tail] = intended_ns;
+    backlog->count++;
+}
+
+static bool backlog_pop(struct Backlog *backlog, unsigned long *object_id, unsigned long long *intended_ns)
+{
+    if (backlog->count == 0)
+        return false;
+    *object_id = backlog->object_ids[backlog->head];
+    *intended_ns = backlog->intended_ns[backlog->head];
+    backlog->head = (backlog->head + 1) % backlog->capacity;
+    backlog->count--;
+    return true;
+}
+
+/* Gives a connection that has just become free its next request, or parks it */
+static void next_request(struct Worker *w, struct ClientConn *c)
+{
+    const struct RunConfig *config = w->config;
+    unsigned long object_id;
+    unsigned long long intended_ns;
+
+    while (1)
+    {
+        c->state = CONN_IDLE;
+        if (config->arrival == ARRIVAL_CLOSED)
+        {
+            if (!claim_object(w, &object_id))
+                break;
+            intended_ns = now_ns();
+        }
+        else if (!backlog_pop(&w->backlog, &object_id, &intended_ns))
+        {
+            // Wait for the next arrival, but notice if the server closes the connection
+            if (c->fd != -1)
+                set_events(w, c, EPOLLIN);
+            w->free_conns[w->n_free++] = c;
+            return;
+        }
+        if (send_object(w, c, object_id, intended_ns) == 0)
+            return;
+        // Move on, so a dead server doesn't hang the run
+    }
+
+    if (c->fd != -1)
+        close_connection(w, c);
+}
+
+/* Time between two open-loop arrivals */
+static unsigned long long interarrival_ns(struct Worker *w)
+{
+    const struct RunConfig *config = w->config;
+
+    if (config->arrival == ARRIVAL_CONSTANT)
+        return 1e9/config->rate;
+
+    // Exponentially distributed gap
+    return -log(1.0 - rng_uniform(&w->rng)) * 1e9/config->rate;
+}
+
+/* When a trace record is due in a timed replay, past records are due right away */
+static unsigned long long record_due_ns(const struct RunConfig *config, const unsigned long record)
+{
+    const struct Trace *trace = config->trace;
+
+    if (record >= config->n_objects)
+        return config->trace_start_ns;
+    return config->trace_start_ns +
+           (unsigned long long)((trace->records[record].timestamp - trace->records[0].timestamp)*1e9/config->trace_speed);
+}
+
+/* Issues all open-loop requests that are due and arms the timer for the next one */
+static void handle_arrivals(struct Worker *w)
+{
+    unsigned long long now = now_ns();
+    unsigned long object_id;
+
+    while (!w->arrivals_done && w->next_arrival_ns <= now)
+    {
+        if (!claim_object(w, &object_id))
+        {
+            w->arrivals_done = true;
+            break;
+        }
+        // Requests are timed from when they were due, not from when a connection was free
+        if (w->n_free > 0)
+        {
+            struct ClientConn *c = w->free_conns[--w->n_free];
+            if (send_object(w, c, object_id, w->next_arrival_ns) == -1)
+                next_request(w, c);
+        }
+        else
+            backlog_push(&w->backlog, object_id, w->next_arrival_ns);
+        if (w->config->arrival == ARRIVAL_TRACE)
+            w->next_arrival_ns = record_due_ns(w->config, w->next_record);
+        else
+            w->next_arrival_ns += interarrival_ns(w);
+    }
+
+    if (!w->arrivals_done)
+    {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = w->next_arrival_ns/1000000000ULL;
+        its.it_value.tv_nsec = w->next_arrival_ns%1000000000ULL;
+        timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+}
+
+/*
+ * Draws the operation, size and key of a workload request. The draws are seeded
+ * from the object index, so a retry repeats the same request and runs are reproducible.
+ */
+static void pick_request(const struct Workload *workload, struct ClientConn *c)
+{
+    // splitmix64 of the index, made odd since xorshift must not start from 0
+    uint64_t rng = (c->object_id + 1) * 0x9E3779B97F4A7C15ULL;
+    rng = (rng ^ (rng >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    rng = (rng ^ (rng >> 27)) * 0x94D049BB133111EBULL;
+    rng = (rng ^ (rng >> 31)) | 1;
+
+    c->op = workload_op(workload, &rng);
+    c->size = c->op == OP_PUT ? workload_size(workload, &rng) : 0;
+    c->key = workload_key(workload, &rng);
+}
+
+/* SHA-256 of the body of a PUT, hashed on the fly (and cached) when it's shorter than the payload */
+static const char *content_hash(struct Worker *w, const struct ClientConn *c)
+{
+    const struct Payload *payload = w->config->payload;
+
+    if (c->size == payload->object_size)
+        return payload_hash(payload, c->object_id);
+    return cached_hash(w, c->object_id % payload->n_variants, 0, c->size);
+}
+
+/* Names the object and signs its request, each request gets its own key, date and signature */
+static int prepare_request(struct Worker *w, struct ClientConn *c)
+{
+    const struct RunConfig *config = w->config;
+    char path[512];
+    char auth_header[AUTH_HEADER_SIZE];
+    char amz_date[AMZ_DATE_SIZE];
+    const char *hash = EMPTY_PAYLOAD_HASH;
+
+    if (config->trace != NULL)
+    {
+        const struct TraceRecord *record = &config->trace->records[c->object_id];
+        c->op = record->op;
+        c->size = c->op == OP_PUT ? record->size : 0;
+        c->key = c->object_id;
+    }
+    else if (config->workload != NULL)
+        pick_request(config->workload, c);
+    else
+    {
+        c->op = config->op;
+        c->size = c->op == OP_PUT ? config->object_size : 0;
+    }
+    if (c->op == OP_PUT)
+        hash = content_hash(w, c);
+    c->range_len = 0;
+    if (c->op == OP_GET && config->range_len > 0)
+    {
+        c->range_len = config->range_len;
+        c->range_start = config->range_start;
+        if (config->range_random)
+            c->range_start = rng_uniform(&w->rng)*(config->object_size - config->range_len + 1);
+    }
+
+    unsigned long long start = now_ns();
+    switch (config->key_mode)
+    {
+        case KEY_FIXED:
+            snprintf(path, sizeof(path), "/%s/%s", config->bucket, config->object_name);
+            break;
+        case KEY_SEQUENTIAL:
+            snprintf(path, sizeof(path), "/%s/%s-%lu", config->bucket, config->object_name, c->object_id);
+            break;
+        case KEY_RANDOM:
+            // xorshift64
+            w->rng ^= w->rng << 13;
+            w->rng ^= w->rng >> 7;
+            w->rng ^= w->rng << 17;
+            snprintf(path, sizeof(path), "/%s/%s-%016llx", config->bucket, config->object_name,
+                     (unsigned long long)w->rng);
+            break;
+        case KEY_WORKLOAD:
+            snprintf(path, sizeof(path), "/%s/%s-%lu", config->bucket, config->object_name, c->key);
+            break;
+        case KEY_TRACE:
+        {
+            // Traces hold keys as the server saw them, decoded
+            const struct TraceRecord *record = &config->trace->records[c->object_id];
+            char name[sizeof(path) - 1];
+            snprintf(name, sizeof(name), "/%s/%s", record->bucket[0] ? record->bucket : config->bucket, record->key);
+            if (uri_encode(name, path, sizeof(path)) == -1)
+            {
+                fprintf(stderr, "ERROR: Key of trace record %lu too long\n", c->object_id+1);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    if (sigv4_sign(&w->signer, op_name(c->op), path, config->host_header, hash, time(NULL), auth_header, amz_date) == -1)
+        return -1;
+
+    c->headers_len = snprintf(c->headers, sizeof(c->headers), "%s %s HTTP/1.1\r\n"
+                              "Host: %s\r\n"
+                              "%s\r\n"
+                              "x-amz-content-sha256: %s\r\n"
+                              "x-amz-date: %s\r\n",
+                              op_name(c->op), path, config->host_header, auth_header, hash, amz_date);
+    // Don't send "Expect: 100-Continue" when in send-only mode
+    if (c->op == OP_PUT)
+        c->headers_len += snprintf(c->headers + c->headers_len, sizeof(c->headers) - c->headers_len,
+                                   "%sContent-Length: %lu\r\n",
+                                   config->sendonly ? "" : "Expect: 100-Continue\r\n", c->size);
+    if (c->range_len > 0)
+        c->headers_len += snprintf(c->headers + c->headers_len, sizeof(c->headers) - c->headers_len,
+                                   "Range: bytes=%lu-%lu\r\n", c->range_start, c->range_start + c->range_len - 1);
+    c->headers_len += snprintf(c->headers + c->headers_len, sizeof(c->headers) - c->headers_len, "\r\n");
+
+    w->sign_ns += now_ns() - start;
+    if (c->object_id == 0)
+    {
+        printf("\n== HEADERS ==\n");
+        printf("%s\n", c->headers);
+    }
+
+    return 0;
+}
+
+/* Sends an object over a kept-alive connection or a new one. Returns -1 if it couldn't be started. */
+static int send_object(struct Worker *w, struct ClientConn *c, unsigned long object_id, unsigned long long intended_ns)
+{
+    const struct RunConfig *config = w->config;
+
+    c->object_id = object_id;
+    c->intended_ns = intended_ns;
+    if (prepare_request(w, c) == -1)
+    {
+        w->errors++;
+        return -1;
+    }
+    c->start_ns = now_ns();
+    memset(c->phase_end_ns, 0, sizeof(c->phase_end_ns));
+    c->offset = 0;
+    c->in_len = 0;
+    c->status = 0;
+    c->verifying = false;
+    c->keep_alive = true;
+
+    if (c->fd != -1)
+    {
+        c->state = CONN_SEND_HEADERS;
+        set_events(w, c, EPOLLOUT);
+        w->active++;
+        return 0;
+    }
+
+    c->fd = open_connection(config);
+    if (c->fd == -1)
+    {
+        w->errors++;
+        return -1;
+    }
+    w->connects++;
+
+    struct epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT;
+    if (epoll_ctl(w->efd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        abort();
+    }
+    c->state = CONN_CONNECTING;
+    w->active++;
+
+    return 0;
+}
+
+/* Advances a connection's state machine as far as the socket allows */
+static void handle_event(struct Worker *w, struct ClientConn *c, uint32_t events)
+{
+    const struct RunConfig *config = w->config;
+    int r;
+
+    if ((events & EPOLLERR) && config->send_mode == SEND_ZEROCOPY)
+        drain_zerocopy_completions(c->fd);
+
+    switch (c->state)
+    {
+        case CONN_CONNECTING:
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0)
+            {
+                fprintf(stderr, "ERROR connecting: %s\n", strerror(err));
+                finish_request(w, c, false);
+                return;
+            }
+            if (config->tls != NULL)
+            {
+                c->ssl = SSL_new(config->tls);
+                SSL_set_fd(c->ssl, c->fd);
+                SSL_set_connect_state(c->ssl);
+                if (w->session != NULL)
+                    SSL_set_session(c->ssl, w->session);
+            }
+            c->state = CONN_HANDSHAKE;
+        }
+        // fall through
+        case CONN_HANDSHAKE:
+            if (c->ssl != NULL)
+            {
+                r = tls_handshake(c->ssl, &w->tls);
+                if (r == -1)
+                {
+                    finish_request(w, c, false);
+                    return;
+                }
+                if (r == 0)
+                {
+                    set_events(w, c, SSL_want_write(c->ssl) ? EPOLLOUT : EPOLLIN);
+                    return;
+                }
+            }
+            c->phase_end_ns[PHASE_CONNECT] = now_ns();
+            c->state = CONN_SEND_HEADERS;
+            // fall through
+        case CONN_SEND_HEADERS:
+            r = write_pending(c->fd, c->ssl, c->headers, c->headers_len, &c->offset, 0);
+            if (r == -1)
+            {
+                if (!c->reused)
+                    perror("ERROR writing to socket");
+                fail_request(w, c);
+                return;
+            }
+            if (r == 0)
+            {
+                // The handshake may have left the connection waiting for input
+                set_events(w, c, EPOLLOUT);
+                return;
+            }
+            c->phase_end_ns[PHASE_SEND_HEADERS] = now_ns();
+            c->offset = 0;
+            if (c->op != OP_PUT)
+            {
+                c->state = CONN_WAIT_RESPONSE;
+                c->body_left = -1;
+                set_events(w, c, EPOLLIN);
+                return;
+            }
+            if (!config->sendonly)
+            {
+                // Wait for 100 Continue
+                c->state = CONN_WAIT_CONTINUE;
+                set_events(w, c, EPOLLIN);
+                return;
+            }
+            c->state = CONN_SEND_BODY;
+            // fall through
+        case CONN_SEND_BODY:
+            r = write_body(c, config);
+            if (r == -1)
+            {
+                perror("ERROR writing data to socket");
+                finish_request(w, c, false);
+                return;
+            }
+            if (r == 0)
+            {
+                set_events(w, c, EPOLLOUT);
+                return;
+            }
+            c->phase_end_ns[PHASE_SEND_BODY] = now_ns();
+            if (config->sendonly)
+            {
+                finish_request(w, c, true);
+                return;
+            }
+            c->state = CONN_WAIT_RESPONSE;
+            c->body_left = -1;
+            set_events(w, c, EPOLLIN);
+            return;
+        case CONN_WAIT_CONTINUE:
+            r = read_response_head(c);
+            if (r == -1)
+            {
+                fail_request(w, c);
+                return;
+            }
+            if (r == 0)
+                return;
+            if (c->status == 100)
+            {
+                c->phase_end_ns[PHASE_WAIT_CONTINUE] = now_ns();
+                c->state = CONN_SEND_BODY;
+                handle_event(w, c, EPOLLOUT);
+                return;
+            }
+            // The server answered without asking for the body
+            c->phase_end_ns[PHASE_WAIT_RESPONSE] = now_ns();
+            c->state = CONN_WAIT_RESPONSE;
+            c->body_left = c->content_length;
+            // fall through
+        case CONN_WAIT_RESPONSE:
+            if (c->body_left == -1)
+            {
+                r = read_response_head(c);
+                if (r == -1)
+                {
+                    fail_request(w, c);
+                    return;
+                }
+                if (r == 0)
+                    return;
+                c->phase_end_ns[PHASE_WAIT_RESPONSE] = now_ns();
+                c->body_left = c->content_length;
+                start_verify(w, c);
+            }
+            r = read_response_body(w, c);
+            if (r == -1)
+            {
+                finish_request(w, c, false);
+                return;
+            }
+            if (r == 0)
+                return;
+            if (c->content_length > 0)
+                c->phase_end_ns[PHASE_READ_BODY] = now_ns();
+            if (c->verifying)
+            {
+                if (!verify_body(w, c))
+                {
+                    w->verify_errors++;
+                    fprintf(stderr, "ERROR: Content of object %lu doesn't match what was uploaded\n", c->object_id+1);
+                    finish_request(w, c, false);
+                    return;
+                }
+                w->verified++;
+            }
+            finish_request(w, c, c->status/100 == 2);
+            return;
+        case CONN_IDLE:
+            // A parked keep-alive connection was closed by the server, it reconnects on its next request
+            if (c->fd != -1)
+                close_connection(w, c);
+            return;
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    struct Worker *w = (struct Worker*)arg;
+    const struct RunConfig *config = w->config;
+    struct epoll_event events[MAXEVENTS];
+    int i;
+
+    if (sigv4_init(&w->signer, config->key_id, config->secret, "us-east-1", "s3") == -1)
+        abort();
+    w->rng = now_ns() ^ ((unsigned long long)(w->id + 1) << 32);
+
+    w->efd = epoll_create1(0);
+    if (w->efd == -1)
+    {
+        perror("epoll_create");
+        abort();
+    }
+
+    w->conns = calloc(w->n_conns, sizeof(struct ClientConn));
+    w->free_conns = calloc(w->n_conns, sizeof(struct ClientConn*));
+    if (config->workload != NULL || config->trace != NULL || config->verify)
+        w->hash_cache = calloc(HASH_CACHE_SIZE, sizeof(struct HashCacheEntry));
+    if (config->log_fd != -1)
+        w->log_buf = malloc(LOG_BUFFER_SIZE);
+    w->recv_buf = malloc(RECV_BUFFER_SIZE);
+    for (i = 0; i < w->n_conns; i++)
+    {
+        w->conns[i].fd = -1;
+        if (config->verify)
+            w->conns[i].md = EVP_MD_CTX_new();
+    }
+    if (config->recv_mode == RECV_SPLICE)
+    {
+        w->devnull = open("/dev/null", O_WRONLY);
+        if (w->devnull == -1 || pipe(w->pipe_fds) == -1)
+        {
+            perror("ERROR setting up splice");
+            abort();
+        }
+        // A bigger pipe moves more per splice; not fatal if the limit is lower
+        fcntl(w->pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+
+    if (config->arrival == ARRIVAL_CLOSED)
+    {
+        for (i = 0; i < w->n_conns; i++)
+            next_request(w, &w->conns[i]);
+    }
+    else
+    {
+        for (i = 0; i < w->n_conns; i++)
+            w->free_conns[w->n_free++] = &w->conns[i];
+        w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct epoll_event event;
+        event.data.ptr = NULL;
+        event.events = EPOLLIN;
+        if (w->tfd == -1 || epoll_ctl(w->efd, EPOLL_CTL_ADD, w->tfd, &event) == -1)
+        {
+            perror("timerfd");
+            abort();
+        }
+        if (config->arrival == ARRIVAL_TRACE)
+        {
+            w->next_record = w->id;
+            w->next_arrival_ns = record_due_ns(config, w->next_record);
+        }
+        else
+        {
+            // Threads start at different offsets, so their arrivals interleave
+            w->next_arrival_ns = now_ns() + (unsigned long long)(1e9/config->rate*w->id/config->n_threads);
+        }
+        handle_arrivals(w);
+    }
+
+    while (w->active > 0 || w->backlog.count > 0 || (config->arrival != ARRIVAL_CLOSED && !w->arrivals_done))
+    {
+        int n = epoll_wait(w->efd, events, MAXEVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            abort();
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                uint64_t expirations;
+                if (read(w->tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                    perror("read timerfd");
+                handle_arrivals(w);
+            }
+            else
+                handle_event(w, (struct ClientConn*)events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (i = 0; i < w->n_conns; i++)
+    {
+        if (w->conns[i].fd != -1)
+            close(w->conns[i].fd);
+        SSL_free(w->conns[i].ssl);
+        EVP_MD_CTX_free(w->conns[i].md);
+    }
+    SSL_SESSION_free(w->session);
+    free(w->conns);
+    free(w->recv_buf);
+    if (config->recv_mode == RECV_SPLICE)
+    {
+        close(w->pipe_fds[0]);
+        close(w->pipe_fds[1]);
+        close(w->devnull);
+    }
+    free(w->free_conns);
+    free(w->hash_cache);
+    if (config->log_fd != -1)
+        flush_log(w);
+    free(w->log_buf);
+    free(w->backlog.object_ids);
+    free(w->backlog.intended_ns);
+    if (config->arrival != ARRIVAL_CLOSED)
+        close(w->tfd);
+    close(w->efd);
+    sigv4_destroy(&w->signer);
+    __atomic_fetch_add(&shared->workers_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* True until all workers are done, or all worker processes exited (possibly before their workers were done) */
+static bool workers_running(const int n_threads, const pid_t *children, const int n_children)
+{
+    int i;
+
+    if (__atomic_load_n(&shared->workers_done, __ATOMIC_ACQUIRE) >= n_threads)
+        return false;
+    if (n_children == 0)
+        return true;
+    for (i = 0; i < n_children; i++)
+    {
+        // WNOWAIT leaves the child to be reaped later
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, children[i], &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Prints per-interval throughput and latency percentiles until all workers are done */
+static void report_intervals(struct Worker *workers, int n_threads, const pid_t *children, int n_children,
+                             double interval, struct Histogram *current, struct Histogram *previous)
+{
+    unsigned long long start = now_ns();
+    unsigned long long last_report = start;
+    unsigned long last_bytes = 0;
+    int i;
+
+    hist_reset(previous);
+    printf("%8s %10s %10s %10s %10s %10s %10s %10s %8s\n", "time [s]", "ops", "ops/s", "MiB/s",
+           "p50 [us]", "p99 [us]", "p99.9 [us]", "max [us]", "backlog");
+    while (workers_running(n_threads, children, n_children))
+    {
+        struct timespec ts = {0, 10*1000*1000};
+        nanosleep(&ts, NULL);
+        unsigned long long now = now_ns();
+        if (now < last_report + interval*1e9)
+            continue;
+
+        // Interval histogram = current totals - totals at the previous report
+        unsigned long backlog = 0, bytes = 0;
+        hist_reset(current);
+        for (i = 0; i < n_threads; i++)
+        {
+            hist_add(current, &workers[i].latency);
+            backlog += __atomic_load_n(&workers[i].backlog.count, __ATOMIC_RELAXED);
+            bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+        }
+        struct Histogram *delta = malloc(sizeof(struct Histogram));
+        memcpy(delta, current, sizeof(struct Histogram));
+        hist_subtract(delta, previous);
+        memcpy(previous, current, sizeof(struct Histogram));
+
+        double elapsed = (now - last_report)/1e9;
+        printf("%8.1f %10lu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f %8lu\n", (now - start)/1e9,
+               delta->total_count, delta->total_count/elapsed, (bytes - last_bytes)/elapsed/(MiB),
+               hist_percentile(delta, 50)/1e3, hist_percentile(delta, 99)/1e3,
+               hist_percentile(delta, 99.9)/1e3, hist_max(delta)/1e3, backlog);
+        fflush(stdout);
+        free(delta);
+        last_report = now;
+        last_bytes = bytes;
+    }
+}
+
+/* Prints percentiles of the time successful requests spent in each phase */
+static void print_phase_stats(struct Worker *workers, int n_threads)
+{
+    struct Histogram *phase = malloc(sizeof(struct Histogram));
+    unsigned long long rtt_us_sum = 0;
+    unsigned long rtt_samples = 0, retransmits = 0;
+    int p, i;
+
+    printf("%-14s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean [us]", "p50 [us]", "p90 [us]",
+           "p99 [us]", "p99.9 [us]", "max [us]");
+    for (p = 0; p < N_PHASES; p++)
+    {
+        hist_reset(phase);
+        for (i = 0; i < n_threads; i++)
+            hist_add(phase, &workers[i].phases[p]);
+        if (phase->total_count == 0)
+            continue;
+        printf("%-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[p], phase->total_count,
+               hist_mean(phase)/1e3, hist_percentile(phase, 50)/1e3, hist_percentile(phase, 90)/1e3,
+               hist_percentile(phase, 99)/1e3, hist_percentile(phase, 99.9)/1e3, hist_max(phase)/1e3);
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        rtt_us_sum += workers[i].rtt_us_sum;
+        rtt_samples += workers[i].rtt_samples;
+        retransmits += workers[i].retransmits;
+    }
+    if (rtt_samples > 0)
+        printf("INFO: TCP: mean smoothed RTT %.1f us, %lu retransmit(s) seen at request completion\n",
+               (double)rtt_us_sum/rtt_samples, retransmits);
+    free(phase);
+}
+
+/* Prints results broken down by operation and size class */
+static void print_op_stats(struct Worker *workers, int n_threads, double elapsed)
+{
+    struct Histogram *latency = malloc(sizeof(struct Histogram));
+    int op, class, i;
+
+    printf("%-8s %-12s %10s %8s %10s %10s %10s %10s %10s %10s\n", "op", "size", "ops", "errors", "ops/s", "MiB/s",
+           "p50 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+    for (op = 0; op < N_OPS; op++)
+    {
+        for (class = 0; class < N_SIZE_CLASSES; class++)
+        {
+            unsigned long ops = 0, bytes = 0, errors = 0;
+            hist_reset(latency);
+            for (i = 0; i < n_threads; i++)
+            {
+                const struct OpStats *stats = &workers[i].stats[op][class];
+                hist_add(latency, &stats->latency);
+                ops += stats->ops;
+                bytes += stats->bytes;
+                errors += stats->errors;
+            }
+            if (ops + errors == 0)
+                continue;
+            printf("%-8s %-12s %10lu %8lu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f\n", op_name(op),
+                   op == OP_DELETE ? "-" : size_class_name(class), ops, errors, ops/elapsed, bytes/elapsed/(MiB),
+                   hist_percentile(latency, 50)/1e3, hist_percentile(latency, 99)/1e3,
+                   hist_percentile(latency, 99.9)/1e3, hist_max(latency)/1e3);
+        }
+    }
+    free(latency);
+}
+
+/* Returns the index-th CPU (wrapping around) of those this process may run on */
+static int pick_cpu(const int index)
+{
+    cpu_set_t allowed;
+    int cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return -1;
+    int n_cpus = CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed) && seen++ == index % n_cpus)
+            return cpu;
+    return -1;
+}
+
+/* Starts the workers [first, first + count) in threads of this process */
+static void start_workers(struct Worker *workers, const int first, const int count)
 {
-    return HMAC(EVP_sha256(), key, keylen, data, datalen, result, resultlen);
+    int i;
+    for (i = first; i < first + count; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+        {
+            fprintf(stderr, "ERROR: Couldn't create worker thread\n");
+            exit(1);
+        }
+    }
 }
 
-void to_hex(const unsigned char *source, const unsigned int source_len, char *result, unsigned int result_len)
+/*
+ * Forks a process per group of workers, pinned to its own CPU. Workers and the shared
+ * run state live in shared memory, so the parent reads their results like it does for threads.
+ */
+static pid_t *fork_workers(struct Worker *workers, const int n_processes, const int threads_per_process)
 {
-    char res[2*source_len];
+    pid_t *children = calloc(n_processes, sizeof(pid_t));
     int i;
-    for (i = 0; i < source_len; ++i)
-        sprintf(&result[i*2], "%02x", source[i]);
-    result = res;
-    result_len = strlen(res);
+
+    // Anything still buffered would be printed once by every child
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < n_processes; i++)
+    {
+        int cpu = pick_cpu(i);
+        children[i] = fork();
+        if (children[i] == -1)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (children[i] > 0)
+            continue;
+
+        if (cpu != -1)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) == -1)
+                perror("sched_setaffinity");
+            else
+                fprintf(stderr, "INFO: Process %d (pid %d) pinned to CPU %d\n", i, getpid(), cpu);
+        }
+        int first = i*threads_per_process;
+        start_workers(workers, first, threads_per_process);
+        int j;
+        for (j = first; j < first + threads_per_process; j++)
+            pthread_join(workers[j].thread, NULL);
+        fflush(stdout);
+        _exit(0);
+    }
+    return children;
+}
+
+void print_usage(char *argv[])
+{
+    fprintf(stderr,"usage %s [-P processes] [-t threads] [-c concurrency] [-f] [-k key-naming] [-p payload] [-s send-mode] [-R rate [-A arrival]] [-d duration] [-i interval] [-w workload] [-T trace [-X speed]] [-m mode [-g range] [-V]] [-r recv-mode] [-B rcvbuf] [-S [-N]] [-H connections] [-o log-file [-O format]] [-v] hostname port bucket object-name object-size num-objects send-only\n", argv[0]);
+    fprintf(stderr,"\t-P <processes> - fork this many worker processes, each pinned to a CPU and running -t threads (default: run the threads in this process)\n");
+    fprintf(stderr,"\t-t <threads> - number of threads (per process with -P), each running its own event loop (default: 1)\n");
+    fprintf(stderr,"\t-c <concurrency> - total number of requests in flight (default: 1)\n");
+    fprintf(stderr,"\t-f - open a fresh connection for every object instead of keeping connections alive\n");
+    fprintf(stderr,"\t-k <key-naming> - object keys: seq (<object-name>-<counter>), random (<object-name>-<random suffix>) or fixed (<object-name>) (default: seq)\n");
+    fprintf(stderr,"\t-p <payload> - object content: constant ('*' repeated), random[:variants] or file:<path> (default: random)\n");
+    fprintf(stderr,"\t-s <send-mode> - how the body is sent: copy, sendfile or zerocopy (MSG_ZEROCOPY) (default: sendfile)\n");
+    fprintf(stderr,"\t-R <rate> - open loop: send <rate> requests/s in total, regardless of responses, using up to <concurrency> connections\n");
+    fprintf(stderr,"\t-A <arrival> - open-loop request spacing: constant or poisson (default: constant)\n");
+    fprintf(stderr,"\t-d <duration> - stop sending new requests after <duration> seconds\n");
+    fprintf(stderr,"\t-i <interval> - print throughput and latency percentiles every <interval> seconds\n");
+    fprintf(stderr,"\t-w <workload> - take the operation mix, object sizes, key popularity, concurrency and duration from a workload file (see workload.h), <object-size> is then ignored\n");
+    fprintf(stderr,"\t-T <trace> - replay the requests of a trace (see trace.h) with their buckets, keys and sizes, <object-name> and <object-size> are then ignored and <num-objects> limits the number of requests (0 for all)\n");
+    fprintf(stderr,"\t-X <speed> - replay the trace at its original timing (1), <speed> times faster, or as fast as <concurrency> allows (0) (default: 1)\n");
+    fprintf(stderr,"\t-m <mode> - put uploads objects, get reads back the objects a put run with the same arguments uploaded (default: put)\n");
+    fprintf(stderr,"\t-g <range> - GET byte ranges: <start>:<length>, or random:<length> for random offsets within <object-size>\n");
+    fprintf(stderr,"\t-V - verify GET bodies against the uploaded content with a streaming SHA-256\n");
+    fprintf(stderr,"\t-r <recv-mode> - how response bodies are read: copy (recv into a %d MiB buffer) or splice (to /dev/null, no copies) (default: copy)\n", RECV_BUFFER_SIZE/(MiB));
+    fprintf(stderr,"\t-B <rcvbuf> - socket receive buffer size (SO_RCVBUF) in bytes (default: system default)\n");
+    fprintf(stderr,"\t-S - connect over TLS, resuming sessions, with encryption handed to the kernel (kTLS) once a handshake is done if it can; sendfile only stays zero-copy with kTLS, zerocopy isn't supported\n");
+    fprintf(stderr,"\t-N - do a full TLS handshake on every connection instead of resuming the session of an earlier one\n");
+    fprintf(stderr,"\t-H <connections> - hold this many idle connections open for the whole run besides the ones sending requests, like the keep-alive connections of a busy frontend; they never send anything, not even a TLS handshake, and to a loopback server they come from 127.0.0.2 and up, as a source address runs out of ports\n");
+    fprintf(stderr,"\t-o <log-file> - write a record with the timing of each phase and TCP_INFO of every request\n");
+    fprintf(stderr,"\t-O <format> - format of the request records: csv or json (JSON lines) (default: csv)\n");
+    fprintf(stderr,"\t-v - print a line for every object sent\n");
+    fprintf(stderr,"\t<bucket> - name of an existing bucket\n");
+    fprintf(stderr,"\t<object-name> - name (or name prefix, see -k) for objects in RGW (will be created)\n");
+    fprintf(stderr,"\t<object-size> - size (in B) of the new object\n");
+    fprintf(stderr,"\t<num-objects> - number of objects to send (0 for no limit, requires -d)\n");
+    fprintf(stderr,"\t<send-only> - set to 1 to ignore responses from server, 0 otherwise\n");
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 9)
+    int n_threads = 1;
+    int n_processes = 0;
+    int concurrency = 0;
+    short verbose = 0;
+    int opt, i;
+
+    bool reuse = true;
+    const char *payload_spec = "random";
+    enum KeyMode key_mode = KEY_SEQUENTIAL;
+    enum SendMode send_mode = SEND_SENDFILE;
+    enum ArrivalMode arrival = ARRIVAL_CONSTANT;
+    double rate = 0;
+    double duration = 0;
+    double interval = 0;
+    const char *workload_file = NULL;
+    const char *trace_file = NULL;
+    double trace_speed = 1;
+    const char *log_file = NULL;
+    enum LogFormat log_format = LOG_CSV;
+    enum OpType op = OP_PUT;
+    enum RecvMode recv_mode = RECV_COPY;
+    bool verify = false;
+    const char *range = NULL;
+    int rcvbuf = 0;
+    bool tls = false;
+    bool tls_resume = true;
+    int n_hold = 0;
+
+    while ((opt = getopt(argc, argv, "P:t:c:fk:p:s:R:A:d:i:w:T:X:m:g:Vr:B:SNH:o:O:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'P':
+                n_processes = atoi(optarg);
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'f':
+                reuse = false;
+                break;
+            case 'k':
+                if (!strcmp(optarg, "fixed"))
+                    key_mode = KEY_FIXED;
+                else if (!strcmp(optarg, "seq"))
+                    key_mode = KEY_SEQUENTIAL;
+                else if (!strcmp(optarg, "random"))
+                    key_mode = KEY_RANDOM;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown key naming: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                payload_spec = optarg;
+                break;
+            case 's':
+                if (!strcmp(optarg, "copy"))
+                    send_mode = SEND_COPY;
+                else if (!strcmp(optarg, "sendfile"))
+                    send_mode = SEND_SENDFILE;
+                else if (!strcmp(optarg, "zerocopy"))
+                    send_mode = SEND_ZEROCOPY;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown send mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'A':
+                if (!strcmp(optarg, "constant"))
+                    arrival = ARRIVAL_CONSTANT;
+                else if (!strcmp(optarg, "poisson"))
+                    arrival = ARRIVAL_POISSON;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown arrival mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            case 'w':
+                workload_file = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'X':
+                trace_speed = atof(optarg);
+                if (trace_speed < 0)
+                {
+                    fprintf(stderr, "ERROR: Invalid replay speed: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                if (!strcmp(optarg, "put"))
+                    op = OP_PUT;
+                else if (!strcmp(optarg, "get"))
+                    op = OP_GET;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'g':
+                range = optarg;
+                break;
+            case 'V':
+                verify = true;
+                break;
+            case 'r':
+                if (!strcmp(optarg, "copy"))
+                    recv_mode = RECV_COPY;
+                else if (!strcmp(optarg, "splice"))
+                    recv_mode = RECV_SPLICE;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown receive mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                rcvbuf = atoi(optarg);
+                break;
+            case 'S':
+                tls = true;
+                break;
+            case 'N':
+                tls_resume = false;
+                break;
+            case 'H':
+                n_hold = atoi(optarg);
+                if (n_hold < 0)
+                {
+                    fprintf(stderr, "ERROR: Invalid number of idle connections: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                log_file = optarg;
+                break;
+            case 'O':
+                if (!strcmp(optarg, "csv"))
+                    log_format = LOG_CSV;
+                else if (!strcmp(optarg, "json"))
+                    log_format = LOG_JSON;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown log format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                print_usage(argv);
+                exit(0);
+        }
+    }
+
+    if (argc - optind < 7)
     {
-        fprintf(stderr,"usage %s hostname port bucket object-name object-size object-hash num-objects send-only\n", argv[0]);
-        fprintf(stderr,"\t<bucket> - name of an existing bucket\n");
-        fprintf(stderr,"\t<object-name> - name for object in RGW (will be created)\n");
-        fprintf(stderr,"\t<object-size> - size (in B) of the new object\n");
-        fprintf(stderr,"\t<object-hash> - sha256 checksum of the object to send\n");
-        fprintf(stderr,"\t<num-objects> - number of objects to send\n");
-        fprintf(stderr,"\t<send-only> - set to 1 to ignore responses from server, 0 otherwise\n");
+        print_usage(argv);
         exit(0);
     }
 
-    const char *host = argv[1];
-    const int portno = atoi(argv[2]);
+    // Concurrency and duration from the command line win over the workload file
+    struct Workload workload;
+    if (workload_file != NULL)
+    {
+        if (workload_load(&workload, workload_file) == -1)
+            exit(1);
+        if (concurrency == 0)
+            concurrency = workload.concurrency;
+        if (duration == 0)
+            duration = workload.duration;
+    }
+    if (concurrency == 0)
+        concurrency = 1;
+    if (n_threads < 1 || n_threads > MAX_THREADS || concurrency < 1)
+    {
+        fprintf(stderr, "ERROR: Number of threads must be between 1 and %d and concurrency at least 1\n", MAX_THREADS);
+        exit(1);
+    }
+    if (n_processes < 0 || n_processes > MAX_PROCESSES)
+    {
+        fprintf(stderr, "ERROR: Number of processes must be between 0 and %d (0 runs the threads in this process)\n", MAX_PROCESSES);
+        exit(1);
+    }
+
+    const char *host = argv[optind];
+    const int portno = atoi(argv[optind+1]);
     printf("host: %s\n", host);
     printf("port: %d\n", portno);
-    const char *bucket = argv[3];
-    const char *object_name = argv[4];
-    const long unsigned int object_size = atoi(argv[5]);
-    // SHA256 of an empty string = e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855
-    const char *payload_hash = argv[6];
-    const long unsigned int n_objects = atoi(argv[7]);
-    const short sendonly = atoi(argv[8]);
+    const char *bucket = argv[optind+2];
+    const char *object_name = argv[optind+3];
+    long unsigned int object_size = atoi(argv[optind+4]);
+    long unsigned int n_objects = atoi(argv[optind+5]);
+    const short sendonly = atoi(argv[optind+6]);
+
+    // The trace decides what is sent and when
+    struct Trace trace;
+    if (trace_file != NULL)
+    {
+        if (workload_file != NULL || rate > 0)
+        {
+            fprintf(stderr, "ERROR: A trace can't be replayed with a workload (-w) or a request rate (-R)\n");
+            exit(1);
+        }
+        if (trace_load(&trace, trace_file) == -1)
+            exit(1);
+        if (n_objects == 0 || n_objects > trace.n_records)
+            n_objects = trace.n_records;
+        for (i = 0; sendonly && i < (int)n_objects; i++)
+        {
+            if (trace.records[i].op != OP_PUT)
+            {
+                fprintf(stderr, "ERROR: The trace has GET or DELETE requests, send-only mode only works with PUTs\n");
+                exit(1);
+            }
+        }
+        // The payload is cut to each object's size
+        object_size = trace.max_size > 0 ? trace.max_size : 1;
+        double span = trace.records[n_objects - 1].timestamp - trace.records[0].timestamp;
+        if (trace_speed > 0)
+            fprintf(stderr, "INFO: Replaying %lu request(s) of %s over %.1f s (%gx speed), objects up to %lu B\n",
+                    n_objects, trace_file, span/trace_speed, trace_speed, trace.max_size);
+        else
+            fprintf(stderr, "INFO: Replaying %lu request(s) of %s as fast as possible, objects up to %lu B\n",
+                    n_objects, trace_file, trace.max_size);
+    }
+
+    if (n_objects == 0 && duration <= 0)
+    {
+        fprintf(stderr, "ERROR: An unlimited number of objects requires a duration (-d)\n");
+        exit(1);
+    }
 
     if (sendonly)
         fprintf(stderr, "INFO: send-only mode enabled.\n");
+    if (workload_file != NULL)
+    {
+        if (sendonly && workload.op_cumulative[OP_PUT] < 1)
+        {
+            fprintf(stderr, "ERROR: GET and DELETE requests need the responses, send-only mode only works with PUTs\n");
+            exit(1);
+        }
+        // The payload is cut to each object's size
+        object_size = workload_max_size(&workload);
+        fprintf(stderr, "INFO: Workload from %s, objects up to %lu B, %lu key(s)\n", workload_file,
+                object_size, workload.key_space);
+    }
+    if (sendonly && op != OP_PUT && trace_file == NULL)
+    {
+        fprintf(stderr, "ERROR: GET requests need the responses, send-only mode only works with PUTs\n");
+        exit(1);
+    }
+    if (verify && recv_mode == RECV_SPLICE)
+    {
+        fprintf(stderr, "ERROR: Bodies that are spliced to /dev/null can't be verified\n");
+        exit(1);
+    }
+    if (tls && send_mode == SEND_ZEROCOPY)
+    {
+        fprintf(stderr, "ERROR: MSG_ZEROCOPY doesn't work over TLS, use sendfile with kTLS instead\n");
+        exit(1);
+    }
+
+    // Byte ranges for GETs
+    unsigned long range_start = 0, range_len = 0;
+    bool range_random = false;
+    if (range != NULL)
+    {
+        if (!strncmp(range, "random:", strlen("random:")))
+        {
+            range_random = true;
+            range_len = strtoul(range + strlen("random:"), NULL, 10);
+        }
+        else if (sscanf(range, "%lu:%lu", &range_start, &range_len) != 2)
+            range_len = 0;
+        if (range_len == 0 || (range_random && range_len > object_size))
+        {
+            fprintf(stderr, "ERROR: Invalid range: %s (random ranges must fit in <object-size>)\n", range);
+            exit(1);
+        }
+    }
 
     char creds_filename[512];
     const char *homedir = getenv("HOME");
@@ -72,209 +2050,279 @@ int main(int argc, char *argv[])
     fscanf(creds_file, "[default]\naws_access_key_id = %s\naws_secret_access_key = %s\n", key_id, key);
     fclose(creds_file);
 
-    const time_t current_time = time(NULL); // current time
-    char date_stamp[10];
-    strftime( date_stamp, sizeof(date_stamp), "%Y%m%d", gmtime(&current_time) );
-    printf("date_stamp: %s\n", date_stamp);
-
-    const char *region_name = "us-east-1";
-    const char *service_name = "s3";
-
-    const char *method = "PUT";
-    char path[256] = "/";
-    strcat(path, bucket);
-    strcat(path, "/");
-    strcat(path, object_name);
-
-    // Canonical request
-    char now[17];
-    strftime( now, sizeof(now), "%Y%m%dT%H%M%SZ", gmtime(&current_time) );
-    printf("now: %s (%lu)\n", now, strlen(now));
-    char canonical_request[4096];
-    sprintf(canonical_request, "%s\n"
-        "%s\n"
-        "\n"
-        "host:%s:%d\n"
-        "x-amz-content-sha256:%s\n"
-        "x-amz-date:%s\n"
-        "\n"
-        "host;x-amz-content-sha256;x-amz-date\n"
-        "%s",
-        method, path, host, portno, payload_hash, now, payload_hash);
-
-    // Canonical request hash
-    const unsigned char *canonical_request_digest = SHA256(canonical_request, strlen(canonical_request), NULL);
-    char canonical_request_hash[2*SHA256_DIGEST_LENGTH];
-    to_hex(canonical_request_digest, SHA256_DIGEST_LENGTH, canonical_request_hash, strlen(canonical_request_hash));
-
-    // Policy string to sign
-    char string_to_sign[1024];
-    sprintf(string_to_sign, "AWS4-HMAC-SHA256\n"
-        "%s\n"
-        "%s/%s/%s/aws4_request\n"
-        "%s",
-        now, date_stamp, region_name, service_name, canonical_request_hash);
-
-
-    char aws_key[128] = {'\0'};
-    strcat(aws_key, "AWS4");
-    strcat(aws_key, key);
-    unsigned char *kdate_digest = NULL;
-    unsigned int kdate_digest_len;
-    kdate_digest = hmac_sha256( aws_key, strlen(aws_key), date_stamp, strlen(date_stamp), NULL, &kdate_digest_len );
-    char kdate[2*kdate_digest_len];
-    unsigned int kdate_len;
-    to_hex(kdate_digest, kdate_digest_len, kdate, kdate_len);
-
-    unsigned char *kregion_digest = NULL;
-    unsigned int kregion_digest_len;
-    kregion_digest = hmac_sha256( kdate_digest, kdate_digest_len, region_name, strlen(region_name), NULL, &kregion_digest_len );
-    char kregion[2*kregion_digest_len];
-    unsigned int kregion_len;
-    to_hex(kregion_digest, kregion_digest_len, kregion, kregion_len);
-
-    unsigned char *kservice_digest = NULL;
-    unsigned int kservice_digest_len;
-    kservice_digest = hmac_sha256( kregion_digest, kregion_digest_len, service_name, strlen(service_name), NULL, &kservice_digest_len );
-    char kservice[2*kservice_digest_len];
-    unsigned int kservice_len;
-    to_hex(kservice_digest, kservice_digest_len, kservice, kservice_len);
-
-    const char *ksigning_data = "aws4_request";
-    unsigned char *ksigning_digest = NULL;
-    unsigned int ksigning_digest_len;
-    ksigning_digest = hmac_sha256( kservice_digest, kservice_digest_len, ksigning_data, strlen(ksigning_data), NULL, &ksigning_digest_len );
-    char ksigning[2*ksigning_digest_len];
-    unsigned int ksigning_len;
-    to_hex(ksigning_digest, ksigning_digest_len, ksigning, ksigning_len);
-
-    // Signature
-    unsigned char *signature_digest = NULL;
-    unsigned int signature_digest_len;
-    signature_digest = hmac_sha256( ksigning_digest, ksigning_digest_len, string_to_sign, strlen(string_to_sign), NULL, &signature_digest_len );
-    char signature[2*signature_digest_len];
-    unsigned int signature_len;
-    to_hex(signature_digest, signature_digest_len, signature, signature_len);
-
-    // Authorisation header
-    char auth_header[1024];
-    sprintf(auth_header, "Authorization: AWS4-HMAC-SHA256"
-            " Credential=%s/%s/%s/%s/aws4_request,"
-            " SignedHeaders=host;x-amz-content-sha256;x-amz-date,"
-            " Signature=%s",
-            key_id, date_stamp, region_name, service_name, signature);
-
-    // Prepare headers
-    char headers_to_send[4096];
-    if (sendonly)
+    struct Payload payload;
+    if (payload_init(&payload, payload_spec, object_size) == -1)
+        exit(1);
+
+    struct RunConfig config;
+    memset(&config, 0, sizeof(config));
+    // Requests are signed by the workers, each with its own key name
+    config.key_id = key_id;
+    config.secret = key;
+    snprintf(config.host_header, sizeof(config.host_header), "%s:%d", host, portno);
+    config.bucket = bucket;
+    config.object_name = object_name;
+    config.key_mode = key_mode;
+    if (workload_file != NULL)
     {
-        // Don't send "Expect: 100-Continue" when in send-only mode
-        sprintf(headers_to_send, "%s %s HTTP/1.1\r\n"
-                "Host: %s:%d\r\n"
-                "%s\r\n"
-                "x-amz-content-sha256: %s\r\n"
-                "x-amz-date: %s\r\n"
-                "Content-Length: %lu\r\n"
-                "\r\n",
-                method, path, host, portno, auth_header, payload_hash, now, object_size);
+        config.workload = &workload;
+        config.key_mode = KEY_WORKLOAD;
     }
-    else
+    if (trace_file != NULL)
     {
-        sprintf(headers_to_send, "%s %s HTTP/1.1\r\n"
-                "Host: %s:%d\r\n"
-                "%s\r\n"
-                "x-amz-content-sha256: %s\r\n"
-                "x-amz-date: %s\r\n"
-                "Expect: 100-Continue\r\n"
-                "Content-Length: %lu\r\n"
-                "\r\n",
-                method, path, host, portno, auth_header, payload_hash, now, object_size);
+        config.trace = &trace;
+        config.key_mode = KEY_TRACE;
     }
-    printf("\n== HEADERS ==\n");
-    printf("%s\n", headers_to_send);
 
+    // Resolve the server address once for all connections
+    struct addrinfo hints, *result;
+    unsigned long long resolve_start = now_ns();
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int s = getaddrinfo(host, argv[optind+1], &hints, &result);
+    if (s != 0)
+    {
+        fprintf(stderr, "ERROR, no such host: %s\n", gai_strerror(s));
+        exit(1);
+    }
+    memcpy(&config.addr, result->ai_addr, result->ai_addrlen);
+    config.addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    fprintf(stderr, "INFO: Resolved %s in %.1f us\n", host, (now_ns() - resolve_start)/1e3);
 
-    char outbuf[1024];
+    // Data was prepared once; all requests send from the same read-only payload
+    config.payload = &payload;
+    config.send_mode = send_mode;
+    config.recv_mode = recv_mode;
+    config.rcvbuf = rcvbuf;
+    config.op = op;
+    config.verify = verify;
+    config.range_start = range_start;
+    config.range_len = range_len;
+    config.range_random = range_random;
+    if (op == OP_GET && workload_file == NULL && trace_file == NULL)
+        fprintf(stderr, "INFO: Reading objects back%s\n", verify ? " and verifying their content" : "");
 
-    unsigned long i;
-    for (i = 0; i < n_objects; ++i)
+    // Without reading responses there is no way to know when a connection is free again
+    config.reuse = reuse && !sendonly;
+    if (!config.reuse)
+        fprintf(stderr, "INFO: Opening a fresh connection for every object\n");
+    config.object_size = object_size;
+    config.n_objects = n_objects;
+    config.sendonly = sendonly;
+    config.verbose = verbose;
+    if (tls)
     {
-        printf("INFO: Sending object %lu...\n", i+1);
-        // Send through a TCP socket
-        struct sockaddr_in serv_addr;
-        struct hostent *server;
-        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0)
-        {
-            perror("ERROR opening socket");
+        config.tls = tls_client_context();
+        if (config.tls == NULL)
             exit(1);
-        }
-        server = gethostbyname(argv[1]);
-        if (server == NULL)
+        config.tls_resume = tls_resume;
+        // OpenSSL writes to the socket without MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+        fprintf(stderr, "INFO: Connecting over TLS%s\n", tls_resume ? ", resuming sessions" : " with full handshakes");
+    }
+
+    // Every thread needs at least one connection
+    if (n_processes > concurrency)
+        n_processes = concurrency;
+    if (n_processes > 0 && concurrency < n_processes*n_threads)
+        n_threads = concurrency/n_processes;
+    if (concurrency < n_threads)
+        n_threads = concurrency;
+    int threads_per_process = n_threads;
+    if (n_processes > 0)
+    {
+        n_threads *= n_processes;
+        fprintf(stderr, "INFO: %d process(es) with %d thread(s) each, %d concurrent request(s)\n",
+                n_processes, threads_per_process, concurrency);
+    }
+    else
+        fprintf(stderr, "INFO: %d thread(s), %d concurrent request(s)\n", n_threads, concurrency);
+    config.n_threads = n_threads;
+    if (trace_file != NULL && trace_speed > 0)
+    {
+        config.arrival = ARRIVAL_TRACE;
+        config.trace_speed = trace_speed;
+    }
+    else if (rate > 0)
+    {
+        config.arrival = arrival;
+        config.rate = rate/n_threads;
+        fprintf(stderr, "INFO: Open loop, %s arrivals at %.1f requests/s\n",
+                arrival == ARRIVAL_POISSON ? "Poisson" : "constant", rate);
+    }
+    else
+        config.arrival = ARRIVAL_CLOSED;
+
+    config.log_fd = -1;
+    if (log_file != NULL)
+    {
+        config.log_fd = open(log_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (config.log_fd == -1)
         {
-            fprintf(stderr,"ERROR, no such host\n");
+            perror(log_file);
             exit(1);
         }
-        bzero((char *) &serv_addr, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        bcopy((char *)server->h_addr,
-             (char *)&serv_addr.sin_addr.s_addr,
-             server->h_length);
-        serv_addr.sin_port = htons(portno);
+        config.log_format = log_format;
+        const char *header = "ts,thread,id,op,key,size,status,ok,reused,queue_us,connect_us,send_headers_us,"
+                             "wait_continue_us,send_body_us,wait_response_us,read_body_us,total_us,"
+                             "rtt_us,rttvar_us,retrans,cwnd\n";
+        if (log_format == LOG_CSV && write(config.log_fd, header, strlen(header)) == -1)
+            perror(log_file);
+    }
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    config.realtime_offset_ns = (real.tv_sec - mono.tv_sec)*1000000000LL + (real.tv_nsec - mono.tv_nsec);
 
-        // Prepare data
-        // Create object on the heap to bypass stack size limitations
-        char *object_content = (char*) malloc(object_size+1);
-        memset(object_content, '*', object_size*sizeof(char));
+    // Workers hold their histograms, too big for the stack. They are shared with worker processes,
+    // which only ever write their own, while this process reads them to report.
+    size_t workers_size = n_threads*sizeof(struct Worker);
+    struct Worker *workers = mmap(NULL, workers_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    shared = mmap(NULL, sizeof(struct SharedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED || shared == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        struct Worker *w = &workers[i];
+        w->id = i;
+        w->config = &config;
+        // Spread connections evenly, the first threads take the remainder
+        w->n_conns = concurrency/n_threads + (i < concurrency%n_threads ? 1 : 0);
+    }
 
-        if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    // Held before the run starts, so the requests are served alongside them
+    int *held = NULL;
+    int n_held = 0;
+    if (n_hold > 0)
+    {
+        // Every connection takes a descriptor, the rest is for the workers' pipes, files and the like
+        struct rlimit rl;
+        rlim_t needed = n_hold + concurrency + 64;
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < needed)
         {
-            perror("ERROR connecting");
-            free(object_content);
-            exit(1);
+            rl.rlim_cur = needed < rl.rlim_max ? needed : rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
         }
-        // Send headers
-        int n = write(sockfd, headers_to_send, strlen(headers_to_send));
-        if (n < 0)
+        if (rl.rlim_cur < needed)
         {
-            perror("ERROR writing to socket");
-            free(object_content);
+            fprintf(stderr, "ERROR: Holding %d connection(s) takes more descriptors than the limit of %lu, "
+                    "raise it with `ulimit -Hn`\n", n_hold, (unsigned long)rl.rlim_cur);
             exit(1);
         }
-        if (!sendonly)
+        unsigned long long hold_start = now_ns();
+        held = malloc(n_hold*sizeof(int));
+        n_held = hold_connections(&config, n_hold, held);
+        fprintf(stderr, "INFO: Holding %d idle connection(s), opened in %.2f s\n", n_held, (now_ns() - hold_start)/1e9);
+        if (n_held < n_hold)
         {
-            // Get response (100 Continue)
-            n = read(sockfd, outbuf, sizeof(outbuf));
-            if (n < 0)
-            {
-                perror("ERROR reading data from socket");
-                free(object_content);
-                exit(1);
-            }
-        }
-        // Send data
-        n = write(sockfd, object_content, object_size);
-        if (n < 0)
-        {
-            perror("ERROR writing data to socket");
-            free(object_content);
+            fprintf(stderr, "ERROR: Only %d of %d idle connection(s) could be opened\n", n_held, n_hold);
             exit(1);
         }
-        if (!sendonly)
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (duration > 0)
+        config.deadline_ns = now_ns() + duration*1e9;
+    config.trace_start_ns = now_ns();
+    pid_t *children = NULL;
+    if (n_processes > 0)
+        children = fork_workers(workers, n_processes, threads_per_process);
+    else
+        start_workers(workers, 0, n_threads);
+
+    struct Histogram *latency = malloc(sizeof(struct Histogram));
+    struct Histogram *service = malloc(sizeof(struct Histogram));
+    if (interval > 0)
+        report_intervals(workers, n_threads, children, n_processes, interval, latency, service);
+
+    int failed_processes = 0;
+    for (i = 0; i < n_processes; i++)
+    {
+        int status;
+        if (waitpid(children[i], &status, 0) == -1)
+            perror("waitpid");
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
         {
-            // Wait for final response (200 OK)
-            n = read(sockfd, outbuf, sizeof(outbuf));
-            if (n < 0)
-            {
-                perror("ERROR reading data from socket");
-                free(object_content);
-                exit(1);
-            }
+            fprintf(stderr, "ERROR: Worker process %d (pid %d) failed, its results are incomplete\n", i, children[i]);
+            failed_processes++;
         }
-        free(object_content);
-        close(sockfd);
-        printf("INFO: Object %lu sent.\n", i+1);
     }
 
-    return 0;
+    unsigned long ops = 0, bytes = 0, errors = 0, connects = 0, verified = 0, verify_errors = 0;
+    unsigned long long sign_ns = 0, hash_ns = 0;
+    struct TlsStats tls_stats;
+    memset(&tls_stats, 0, sizeof(tls_stats));
+    hist_reset(latency);
+    hist_reset(service);
+    for (i = 0; i < n_threads; i++)
+    {
+        if (n_processes == 0)
+            pthread_join(workers[i].thread, NULL);
+        hist_add(latency, &workers[i].latency);
+        hist_add(service, &workers[i].service);
+        sign_ns += workers[i].sign_ns;
+        hash_ns += workers[i].hash_ns;
+        ops += workers[i].ops;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        connects += workers[i].connects;
+        tls_stats_add(&tls_stats, &workers[i].tls);
+        verified += workers[i].verified;
+        verify_errors += workers[i].verify_errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+
+    printf("INFO: %s %lu object(s) (%lu error(s)) in %.3f s\n",
+           config.op == OP_GET && config.workload == NULL && config.trace == NULL ? "Read" : "Sent",
+           ops, errors, elapsed);
+    printf("INFO: %.1f ops/s, %.2f MiB/s\n", ops/elapsed, bytes/elapsed/(MiB));
+    printf("INFO: %lu connection(s) opened\n", connects);
+    if (n_held > 0)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("INFO: Held %d idle connection(s), %d of them closed by the server, client peak RSS %.1f MiB\n",
+               n_held, count_closed(held, n_held), usage.ru_maxrss/1024.0);
+    }
+    if (config.tls != NULL)
+        tls_print_stats(stdout, &tls_stats, elapsed);
+    if (verify)
+        printf("INFO: Verified %lu object(s), %lu didn't match what was uploaded\n", verified, verify_errors);
+    if (ops + errors > 0)
+        printf("INFO: Signing took %.2f us per request (%.2f%% of worker time)\n",
+               sign_ns/1e3/(ops + errors), 100.0*sign_ns/1e9/(elapsed*n_threads));
+    hist_print(stdout, "Latency (from intended send time)", latency);
+    hist_print(stdout, "Service time (from actual send time)", service);
+    print_phase_stats(workers, n_threads);
+    if (config.workload != NULL || config.trace != NULL)
+    {
+        if (ops + errors > 0)
+            printf("INFO: Hashing object bodies took %.2f us per request\n", hash_ns/1e3/(ops + errors));
+        print_op_stats(workers, n_threads, elapsed);
+    }
+
+    payload_destroy(&payload);
+    SSL_CTX_free(config.tls);
+    if (config.trace != NULL)
+        trace_destroy(&trace);
+    if (config.log_fd != -1)
+        close(config.log_fd);
+    munmap(workers, workers_size);
+    munmap(shared, sizeof(struct SharedState));
+    for (i = 0; i < n_held; i++)
+        close(held[i]);
+    free(held);
+    free(children);
+    free(latency);
+    free(service);
+
+    return errors || failed_processes ? 1 : 0;
 }
@@ -0,0 +1,231 @@
+/*
+ * Compression stage of the storage write path (-z). Objects are compressed as a
+ * stream, COMPRESS_CHUNK_SIZE bytes at a time, into a single zstd or LZ4 frame.
+ * Like RGW's compressor plugins, a context is created for every object. The
+ * codecs are only there if baseliner was built with HAVE_ZSTD / HAVE_LZ4 (see
+ * the Makefile).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compress.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#define DEFAULT_ZSTD_LEVEL 1    // as compressor_zstd_level in Ceph
+#define DEFAULT_LZ4_LEVEL 1
+#define MAX_LZ4_LEVEL 12        // levels from 3 on use LZ4 HC
+#define LZ4_FRAME_HEADER_MAX 19
+
+static const char *codec_names[] = {"zstd", "lz4"};
+
+/* Parses codec[:level] */
+int compression_init(struct Compression *compression, const char *spec)
+{
+    char codec[16];
+    int min_level = 1, max_level = 0;
+
+    memset(compression, 0, sizeof(*compression));
+    size_t len = strcspn(spec, ":");
+    snprintf(codec, sizeof(codec), "%.*s", (int)len, spec);
+    if (!strcmp(codec, "zstd"))
+    {
+        compression->type = COMPRESSION_ZSTD;
+        compression->level = DEFAULT_ZSTD_LEVEL;
+#ifdef HAVE_ZSTD
+        max_level = ZSTD_maxCLevel();
+#endif
+    }
+    else if (!strcmp(codec, "lz4"))
+    {
+        compression->type = COMPRESSION_LZ4;
+        compression->level = DEFAULT_LZ4_LEVEL;
+#ifdef HAVE_LZ4
+        max_level = MAX_LZ4_LEVEL;
+#endif
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unknown compression type: %s (zstd or lz4)\n", codec);
+        return -1;
+    }
+    if (max_level == 0)
+    {
+        fprintf(stderr, "ERROR: baseliner was built without %s support (see the Makefile)\n", codec);
+        return -1;
+    }
+    if (spec[len] == ':')
+    {
+        char *end;
+        compression->level = strtol(spec + len + 1, &end, 10);
+        if (*end != '\0' || compression->level < min_level || compression->level > max_level)
+        {
+            fprintf(stderr, "ERROR: Invalid %s level: %s (%d to %d)\n", codec, spec + len + 1, min_level, max_level);
+            return -1;
+        }
+    }
+    snprintf(compression->name, sizeof(compression->name), "%s:%d", codec, compression->level);
+    pthread_mutex_init(&compression->lock, NULL);
+    hist_reset(&compression->latency);
+
+    return 0;
+}
+
+/* Size of a buffer that any object of len bytes is guaranteed to compress into */
+size_t compression_bound(const struct Compression *compression, const size_t len)
+{
+#ifdef HAVE_ZSTD
+    if (compression->type == COMPRESSION_ZSTD)
+        return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+    if (compression->type == COMPRESSION_LZ4)
+    {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = compression->level;
+        size_t n_chunks = (len + COMPRESS_CHUNK_SIZE - 1)/COMPRESS_CHUNK_SIZE;
+        // Every update needs room for a whole chunk, the last one also for the end of the frame
+        return LZ4_FRAME_HEADER_MAX + (n_chunks > 0 ? n_chunks : 1)*LZ4F_compressBound(COMPRESS_CHUNK_SIZE, &prefs);
+    }
+#endif
+    return len;
+}
+
+#ifdef HAVE_ZSTD
+static long compress_zstd(const int level, const char *in, const size_t len, char *out, const size_t out_size)
+{
+    ZSTD_CStream *stream = ZSTD_createCStream();
+    ZSTD_outBuffer output = {out, out_size, 0};
+    size_t offset = 0;
+    size_t r = ZSTD_initCStream(stream, level);
+
+    while (!ZSTD_isError(r) && offset < len)
+    {
+        size_t n = len - offset < COMPRESS_CHUNK_SIZE ? len - offset : COMPRESS_CHUNK_SIZE;
+        ZSTD_inBuffer input = {in + offset, n, 0};
+        while (!ZSTD_isError(r) && input.pos < input.size)
+            r = ZSTD_compressStream(stream, &output, &input);
+        offset += n;
+    }
+    // Returns what is left to flush, which fits as the output is big enough for the whole frame
+    if (!ZSTD_isError(r))
+        r = ZSTD_endStream(stream, &output);
+    ZSTD_freeCStream(stream);
+    if (ZSTD_isError(r) || r != 0)
+    {
+        fprintf(stderr, "ERROR: zstd compression failed: %s\n", ZSTD_isError(r) ? ZSTD_getErrorName(r) : "output full");
+        return -1;
+    }
+
+    return output.pos;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static long compress_lz4(const int level, const char *in, const size_t len, char *out, const size_t out_size)
+{
+    LZ4F_compressionContext_t ctx;
+    LZ4F_preferences_t prefs;
+    size_t offset = 0;
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    prefs.frameInfo.contentSize = len;
+    size_t r = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+    if (LZ4F_isError(r))
+    {
+        fprintf(stderr, "ERROR: LZ4 compression failed: %s\n", LZ4F_getErrorName(r));
+        return -1;
+    }
+    size_t pos = r = LZ4F_compressBegin(ctx, out, out_size, &prefs);
+    while (!LZ4F_isError(r) && offset < len)
+    {
+        size_t n = len - offset < COMPRESS_CHUNK_SIZE ? len - offset : COMPRESS_CHUNK_SIZE;
+        r = LZ4F_compressUpdate(ctx, out + pos, out_size - pos, in + offset, n, NULL);
+        pos += LZ4F_isError(r) ? 0 : r;
+        offset += n;
+    }
+    if (!LZ4F_isError(r))
+    {
+        r = LZ4F_compressEnd(ctx, out + pos, out_size - pos, NULL);
+        pos += LZ4F_isError(r) ? 0 : r;
+    }
+    LZ4F_freeCompressionContext(ctx);
+    if (LZ4F_isError(r))
+    {
+        fprintf(stderr, "ERROR: LZ4 compression failed: %s\n", LZ4F_getErrorName(r));
+        return -1;
+    }
+
+    return pos;
+}
+#endif
+
+/*
+ * Compresses an object into out, which must hold compression_bound() bytes. Returns
+ * the compressed size, or -1 on error. Objects that don't get smaller are better
+ * written as they are, they are counted as such.
+ */
+long compress_object(struct Compression *compression, const char *in, const size_t len, char *out, const size_t out_size)
+{
+    long n = -1;
+    unsigned long long start = clock_ns(CLOCK_MONOTONIC);
+    unsigned long long cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+#ifdef HAVE_ZSTD
+    if (compression->type == COMPRESSION_ZSTD)
+        n = compress_zstd(compression->level, in, len, out, out_size);
+#endif
+#ifdef HAVE_LZ4
+    if (compression->type == COMPRESSION_LZ4)
+        n = compress_lz4(compression->level, in, len, out, out_size);
+#endif
+
+    unsigned long long cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    unsigned long long elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    pthread_mutex_lock(&compression->lock);
+    compression->objects++;
+    compression->in_bytes += len;
+    if (n == -1 || (size_t)n >= len)
+    {
+        compression->stored_raw++;
+        compression->out_bytes += len;
+    }
+    else
+        compression->out_bytes += n;
+    compression->cpu_ns += cpu_ns;
+    hist_record(&compression->latency, elapsed);
+    pthread_mutex_unlock(&compression->lock);
+
+    return n;
+}
+
+/* Value of COMPRESSION_XATTR for an object of the given original size. Returns its length. */
+int compression_xattr(const struct Compression *compression, const size_t original_size, char *buf, const size_t size)
+{
+    return snprintf(buf, size, "%s %lu", codec_names[compression->type], (unsigned long)original_size);
+}
+
+void compression_print_stats(const struct Compression *compression)
+{
+    fprintf(stderr, "INFO: Compressed %lu object(s) with %s: %llu B -> %llu B written (ratio %.2f), "
+            "%lu stored uncompressed\n", compression->objects, compression->name, compression->in_bytes,
+            compression->out_bytes, compression->out_bytes > 0 ? (double)compression->in_bytes/compression->out_bytes : 0,
+            compression->stored_raw);
+    if (compression->objects == 0)
+        return;
+    fprintf(stderr, "INFO: Compression CPU time: %.2f ms per MiB, %.2f s in total\n",
+            compression->cpu_ns/1e6/(compression->in_bytes/1048576.0), compression->cpu_ns/1e9);
+    hist_print(stderr, "Compression time per object", &compression->latency);
+}
+
+void compression_destroy(struct Compression *compression)
+{
+    pthread_mutex_destroy(&compression->lock);
+}
@@ -0,0 +1,39 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <stddef.h>
+#include <pthread.h>
+#include "histogram.h"
+
+#define COMPRESS_CHUNK_SIZE 65536           //B, fed to the compressor at a time
+#define COMPRESSION_XATTR "compression"     // "<codec> <original size>" on compressed objects
+#define COMPRESSION_XATTR_SIZE 64
+
+enum CompressionType
+{
+    COMPRESSION_ZSTD,
+    COMPRESSION_LZ4
+};
+
+/* Compresses objects before they are written to storage (-z), like RGW does for compressed placements */
+struct Compression
+{
+    enum CompressionType type;
+    int level;
+    char name[32];                      // codec:level, for messages
+    pthread_mutex_t lock;
+    // Statistics, under the lock
+    unsigned long objects;
+    unsigned long stored_raw;           // objects that didn't get smaller, written as they came
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;       // as written, so including the ones stored raw
+    unsigned long long cpu_ns;
+    struct Histogram latency;           // of compressing a whole object
+};
+
+int compression_init(struct Compression*, const char*);
+size_t compression_bound(const struct Compression*, const size_t);
+long compress_object(struct Compression*, const char*, const size_t, char*, const size_t);
+int compression_xattr(const struct Compression*, const size_t, char*, const size_t);
+void compression_print_stats(const struct Compression*);
+void compression_destroy(struct Compression*);
+#endif
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "histogram.h"
+
+static unsigned int value_to_index(uint64_t value)
+{
+    if (value >= (1ULL << HIST_MAX_BITS))
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    if (value < (1 << HIST_SUB_BUCKET_BITS))
+        return value;
+
+    // Shift the value so that it falls into the upper half of the sub-buckets
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int shift = msb - (HIST_SUB_BUCKET_BITS - 1);
+    return (shift + 1)*HIST_HALF_SUB_BUCKETS + (value >> shift) - HIST_HALF_SUB_BUCKETS;
+}
+
+/* Middle of the range of values counted at the given index */
+static uint64_t index_to_value(const unsigned int index)
+{
+    if (index < (1 << HIST_SUB_BUCKET_BITS))
+        return index;
+
+    unsigned int shift = index/HIST_HALF_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index%HIST_HALF_SUB_BUCKETS + HIST_HALF_SUB_BUCKETS;
+    return (sub_bucket << shift) + ((1ULL << shift) >> 1);
+}
+
+void hist_reset(struct Histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void hist_record(struct Histogram *hist, uint64_t value)
+{
+    unsigned int index = value_to_index(value);
+
+    // Relaxed stores are enough for a single writer and let readers see whole values
+    __atomic_store_n(&hist->counts[index], hist->counts[index] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total_count, hist->total_count + 1, __ATOMIC_RELAXED);
+}
+
+void hist_add(struct Histogram *dst, const struct Histogram *src)
+{
+    unsigned int i;
+    for (i = 0; i < HIST_N_COUNTS; i++)
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->total_count += __atomic_load_n(&src->total_count, __ATOMIC_RELAXED);
+}
+
+/* Removes an earlier snapshot of the same histogram, leaving what was recorded since */
+void hist_subtract(struct Histogram *dst, const struct Histogram *src)
+{
+    unsigned int i;
+    for (i = 0; i < HIST_N_COUNTS; i++)
+        dst->counts[i] -= src->counts[i];
+    dst->sum -= src->sum;
+    dst->total_count -= src->total_count;
+}
+
+uint64_t hist_percentile(const struct Histogram *hist, const double percentile)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_N_COUNTS; i++)
+        total += hist->counts[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(percentile/100.0*total + 0.5);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (i = 0; i < HIST_N_COUNTS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= target)
+            return index_to_value(i);
+    }
+    return index_to_value(HIST_N_COUNTS - 1);
+}
+
+uint64_t hist_max(const struct Histogram *hist)
+{
+    int i;
+    for (i = HIST_N_COUNTS - 1; i >= 0; i--)
+        if (hist->counts[i] > 0)
+            return index_to_value(i);
+    return 0;
+}
+
+double hist_mean(const struct Histogram *hist)
+{
+    return hist->total_count ? (double)hist->sum/hist->total_count : 0.0;
+}
+
+/* An "INFO:" line with the mean, usual percentiles and max of a histogram of ns, in us */
+void hist_print(FILE *out, const char *label, const struct Histogram *hist)
+{
+    fprintf(out, "INFO: %s [us]: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", label,
+            hist_mean(hist)/1e3, hist_percentile(hist, 50)/1e3, hist_percentile(hist, 90)/1e3,
+            hist_percentile(hist, 99)/1e3, hist_percentile(hist, 99.9)/1e3, hist_max(hist)/1e3);
+}
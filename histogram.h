@@ -0,0 +1,47 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power of
+ * two is split into 64 linear sub-buckets, which keeps the relative error
+ * under 1% for values up to 2^HIST_MAX_BITS (about 18 minutes in ns).
+ * The structure contains no pointers, so it can live in shared memory.
+ * A histogram must have a single writer, but can be read at any time.
+ */
+#define HIST_SUB_BUCKET_BITS 7
+#define HIST_MAX_BITS 40
+#define HIST_HALF_SUB_BUCKETS (1 << (HIST_SUB_BUCKET_BITS - 1))
+#define HIST_N_COUNTS ((HIST_MAX_BITS - HIST_SUB_BUCKET_BITS + 2) * HIST_HALF_SUB_BUCKETS)
+
+struct Histogram
+{
+    uint64_t total_count;
+    uint64_t sum;
+    uint64_t counts[HIST_N_COUNTS];
+};
+
+void hist_reset(struct Histogram*);
+void hist_record(struct Histogram*, uint64_t);
+void hist_add(struct Histogram*, const struct Histogram*);
+void hist_subtract(struct Histogram*, const struct Histogram*);
+uint64_t hist_percentile(const struct Histogram*, const double);
+uint64_t hist_max(const struct Histogram*);
+double hist_mean(const struct Histogram*);
+void hist_print(FILE*, const char*, const struct Histogram*);
+
+/* Time in ns on the given clock, the values the histograms record */
+static inline unsigned long long clock_ns(const clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long now_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+#endif
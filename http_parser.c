@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "http_parser.h"
+
+/* Extracts method, bucket and object key from the request line at the start of buf */
+void http_parse_request_line(const char *buf, const ssize_t count, struct RequestLine *request)
+{
+    char line[HTTP_MAX_LINE];
+    ssize_t len = 0;
+
+    while (len < count && len < HTTP_MAX_LINE - 1 && buf[len] != '\r' && buf[len] != '\n')
+        len++;
+    memcpy(line, buf, len);
+    line[len] = '\0';
+
+    request->bucket[0] = '\0';
+    request->key[0] = '\0';
+    if (sscanf(line, "%7s", request->method) != 1)
+        request->method[0] = '\0';
+    char *path = strchr(line, ' ');
+    if (path == NULL || path[1] != '/')
+        return;
+    path += 2;
+    char *end = strchr(path, ' ');
+    if (end != NULL)
+        *end = '\0';
+    char *key = strchr(path, '/');
+    if (key != NULL)
+    {
+        *key = '\0';
+        snprintf(request->key, sizeof(request->key), "%s", key+1);
+    }
+    snprintf(request->bucket, sizeof(request->bucket), "%s", path);
+}
+
+/*
+ * Returns the value of the Content-Length field of a NUL-terminated request
+ * head, or -1 if it's missing. The head is tokenised in place.
+ */
+long http_content_length(char *head)
+{
+    char *saveptr;
+    char *pch = strtok_r(head, " :\r\n", &saveptr);
+    while (pch != NULL)
+    {
+        if (!strcmp(pch, "Content-Length"))
+            break;
+        pch = strtok_r(NULL, " :\r\n", &saveptr);
+    }
+    if (pch == NULL)
+        return -1;
+    pch = strtok_r(NULL, " :\r\n", &saveptr);
+    if (pch == NULL)
+        return -1;
+
+    return strtol(pch, NULL, 10);
+}
+
+/*
+ * Resolves the "Range: bytes=" field of a NUL-terminated request head against an
+ * object of size bytes: "<first>-[<last>]", or "-<n>" for the last n bytes. Returns
+ * 1 with the range in first and last, 0 if there is no range or it isn't valid
+ * (e.g. last before first, so the whole object is sent) and -1 if it can't be
+ * satisfied (it starts past the end, or asks for the last 0 bytes).
+ */
+int http_range(const char *head, const uint64_t size, uint64_t *first, uint64_t *last)
+{
+    const char *range = strcasestr(head, "\r\nRange: bytes=");
+    char *end;
+
+    if (range == NULL)
+        return 0;
+    range += strlen("\r\nRange: bytes=");
+    if (range[0] == '-')
+    {
+        if (!isdigit((unsigned char)range[1]))
+            return 0;
+        uint64_t n = strtoull(range + 1, NULL, 10);
+        if (n == 0 || size == 0)
+            return -1;
+        *first = n < size ? size - n : 0;
+        *last = size - 1;
+        return 1;
+    }
+    if (!isdigit((unsigned char)range[0]))
+        return 0;
+    *first = strtoull(range, &end, 10);
+    if (*end != '-')
+        return 0;
+    *last = UINT64_MAX;
+    if (isdigit((unsigned char)end[1]))
+    {
+        *last = strtoull(end + 1, NULL, 10);
+        if (*last < *first)
+            return 0;
+    }
+    if (*first >= size)
+        return -1;
+    if (*last >= size)
+        *last = size - 1;
+    return 1;
+}
+
+/* Decodes %XX escapes of a request path component, the inverse of what clients send */
+void http_uri_decode(const char *source, char *result, const size_t size)
+{
+    size_t len = 0;
+
+    while (*source != '\0' && len < size - 1)
+    {
+        if (source[0] == '%' && isxdigit((unsigned char)source[1]) && isxdigit((unsigned char)source[2]))
+        {
+            char hex[3] = {source[1], source[2], '\0'};
+            result[len++] = strtol(hex, NULL, 16);
+            source += 3;
+        }
+        else
+            result[len++] = *source++;
+    }
+    result[len] = '\0';
+}
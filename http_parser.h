@@ -0,0 +1,20 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HTTP_MAX_LINE 512 //B, longer request lines are cut
+#define MAX_HEAD_SIZE 4096 //B, longer request heads are cut
+
+/* The parts of a request line the server cares about, e.g. "PUT /bucket/key HTTP/1.1" */
+struct RequestLine {
+    char method[8];
+    char bucket[64];
+    char key[256];
+};
+
+void http_parse_request_line(const char*, const ssize_t, struct RequestLine*);
+long http_content_length(char*);
+int http_range(const char*, const uint64_t, uint64_t*, uint64_t*);
+void http_uri_decode(const char*, char*, const size_t);
+#endif
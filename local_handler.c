@@ -0,0 +1,221 @@
+/*
+ * Stand-in for ceph_handler.c that keeps objects as files in a local
+ * directory, so the storage path of the server can be exercised (and
+ * benchmarked, see scripts/bench.py) without a Ceph cluster. Built with
+ * -DLOCAL_STORAGE (see the baseliner_local target in the Makefile).
+ *
+ * The directory is taken from BASELINER_LOCAL_DIR, /tmp/baseliner-objects by default.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "ceph_handler.h"
+
+#define DEFAULT_LOCAL_DIR "/tmp/baseliner-objects"
+
+/* Object names may contain '/', which can't be part of a file name */
+static void file_name(const char *obj_name, char *name, const size_t size)
+{
+    size_t i;
+    for (i = 0; obj_name[i] != '\0' && i < size - 1; i++)
+        name[i] = obj_name[i] == '/' ? '_' : obj_name[i];
+    name[i] = '\0';
+}
+
+int ceph_connect(struct Connection *conn, const int argc, const char **argv, const short verbose)
+{
+    const char *dir = getenv("BASELINER_LOCAL_DIR");
+    if (dir == NULL || dir[0] == '\0')
+        dir = DEFAULT_LOCAL_DIR;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "%s: cannot create directory %s: %s\n", argv[0], dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    conn->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (conn->dir_fd == -1)
+    {
+        fprintf(stderr, "%s: cannot open directory %s: %s\n", argv[0], dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("INFO: Storing objects in %s instead of Ceph.\n", dir);
+
+    return 0;
+}
+
+/* Writes the content of an object to its file and returns the file, still open */
+static int write_file(struct Connection *conn, const char *obj_name, const char *obj_content, const unsigned long obj_size)
+{
+    char name[NAME_MAX + 1];
+    unsigned long done = 0;
+
+    file_name(obj_name, name, sizeof(name));
+    int fd = openat(conn->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "ERROR: Cannot write object \"%s\": %s\n", obj_name, strerror(errno));
+        exit(1);
+    }
+    while (done < obj_size)
+    {
+        ssize_t n = write(fd, obj_content + done, obj_size - done);
+        if (n == -1)
+        {
+            fprintf(stderr, "ERROR: Cannot write object \"%s\": %s\n", obj_name, strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+
+    return fd;
+}
+
+int ceph_write_object(struct Connection *conn, const char *obj_name, const char *obj_content, const unsigned long obj_size, const short verbose)
+{
+    close(write_file(conn, obj_name, obj_content, obj_size));
+    if (verbose)
+        printf("\nWrote %lu bytes to object \"%s\".\n", obj_size, obj_name);
+
+    return 0;
+}
+
+/* Xattrs of files have to be in a namespace, RADOS ones don't */
+int ceph_write_object_xattr(struct Connection *conn, const char *obj_name, const char *obj_content, unsigned long obj_size,
+                            const char *xattr_name, const char *xattr_value, const size_t xattr_len, const short verbose)
+{
+    char name[XATTR_NAME_MAX + 1];
+
+    int fd = write_file(conn, obj_name, obj_content, obj_size);
+    snprintf(name, sizeof(name), "user.%s", xattr_name);
+    if (fsetxattr(fd, name, xattr_value, xattr_len, 0) == -1)
+    {
+        fprintf(stderr, "ERROR: Cannot set xattr %s on object \"%s\": %s\n", xattr_name, obj_name, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    if (verbose)
+        printf("\nWrote %lu bytes to object \"%s\" with xattr %s.\n", obj_size, obj_name, xattr_name);
+
+    return 0;
+}
+
+int ceph_remove_object(struct Connection *conn, const char *obj_name, const short verbose)
+{
+    char name[NAME_MAX + 1];
+
+    file_name(obj_name, name, sizeof(name));
+    if (unlinkat(conn->dir_fd, name, 0) == -1)
+    {
+        /* Someone else may have removed it first */
+        if (errno == ENOENT)
+            return -ENOENT;
+        fprintf(stderr, "ERROR: Cannot remove object. %s\n", strerror(errno));
+        exit(1);
+    }
+    if (verbose)
+        printf("\nRemoved object \"%s\".\n", obj_name);
+
+    return 0;
+}
+
+int ceph_stat_object(struct Connection *conn, const char *obj_name, uint64_t *obj_size)
+{
+    char name[NAME_MAX + 1];
+    struct stat st;
+
+    file_name(obj_name, name, sizeof(name));
+    if (fstatat(conn->dir_fd, name, &st, 0) == -1)
+    {
+        int err = errno;
+        if (err != ENOENT)
+            fprintf(stderr, "ERROR: Cannot stat object \"%s\": %s\n", obj_name, strerror(err));
+        return -err;
+    }
+    *obj_size = st.st_size;
+
+    return 0;
+}
+
+long ceph_read_object(struct Connection *conn, const char *obj_name, char *buf, const size_t len, const uint64_t offset, const short verbose)
+{
+    char name[NAME_MAX + 1];
+    size_t done = 0;
+
+    file_name(obj_name, name, sizeof(name));
+    int fd = openat(conn->dir_fd, name, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "ERROR: Cannot read object \"%s\": %s\n", obj_name, strerror(errno));
+        return -1;
+    }
+    while (done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1)
+        {
+            fprintf(stderr, "ERROR: Cannot read object \"%s\": %s\n", obj_name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    if (verbose)
+        printf("\nRead %lu bytes at offset %lu of object \"%s\".\n", done, (unsigned long)offset, obj_name);
+
+    return done;
+}
+
+/* Omap entries are appended to a file named after the object, one "key<TAB>value" line each */
+int ceph_omap_set(struct Connection *conn, const char *obj_name, const char **keys, const char **vals, const size_t *val_lens, const size_t n_entries, const short verbose)
+{
+    char name[NAME_MAX + 1];
+    size_t i, len = 0;
+
+    for (i = 0; i < n_entries; i++)
+        len += strlen(keys[i]) + val_lens[i] + 2;
+    char *buf = malloc(len);
+    char *p = buf;
+    for (i = 0; i < n_entries; i++)
+    {
+        size_t key_len = strlen(keys[i]);
+        memcpy(p, keys[i], key_len);
+        p += key_len;
+        *p++ = '\t';
+        memcpy(p, vals[i], val_lens[i]);
+        p += val_lens[i];
+        *p++ = '\n';
+    }
+
+    /* A single append, so the batch lands as one write like the omap op does */
+    file_name(obj_name, name, sizeof(name));
+    int fd = openat(conn->dir_fd, name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1 || write(fd, buf, len) != (ssize_t)len)
+    {
+        fprintf(stderr, "ERROR: Cannot set omap entries on object \"%s\": %s\n", obj_name, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    free(buf);
+    if (verbose)
+        printf("\nSet %lu omap entries on object \"%s\".\n", n_entries, obj_name);
+
+    return 0;
+}
+
+int ceph_close(struct Connection *conn)
+{
+    close(conn->dir_fd);
+
+    return 0;
+}
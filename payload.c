@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include "payload.h"
+
+// Fixed seed, so the same settings always generate the same objects
+#define PAYLOAD_SEED 0x9E3779B97F4A7C15ULL
+
+/* Fills the buffer with xorshift64* output: fast, and incompressible for any practical purpose */
+static void fill_random(char *buf, const size_t len, uint64_t seed)
+{
+    uint64_t x = seed ? seed : PAYLOAD_SEED;
+    size_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        uint64_t r = x * 0x2545F4914F6CDD1DULL;
+        memcpy(buf + i, &r, sizeof(r));
+    }
+    for (; i < len; i++)
+        buf[i] = (char)(x >> (8*(i % 8)));
+}
+
+/*
+ * Hex SHA-256 of a buffer. EVP picks the fastest implementation for the CPU
+ * (SHA extensions or AVX2 on x86, the crypto extensions on ARMv8).
+ */
+void sha256_hex(const void *data, const size_t len, char *hex)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned int digest_len;
+    int i;
+
+    EVP_Digest(data, len, digest, &digest_len, EVP_sha256(), NULL);
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    {
+        hex[2*i] = "0123456789abcdef"[digest[i] >> 4];
+        hex[2*i+1] = "0123456789abcdef"[digest[i] & 0xf];
+    }
+    hex[2*SHA256_DIGEST_LENGTH] = '\0';
+}
+
+int payload_init(struct Payload *payload, const char *spec, const size_t object_size)
+{
+    unsigned int n_variants = 1;
+    unsigned int i;
+
+    memset(payload, 0, sizeof(*payload));
+    payload->object_size = object_size;
+
+    if (!strcmp(spec, "constant"))
+        payload->type = PAYLOAD_CONSTANT;
+    else if (!strncmp(spec, "random", strlen("random")))
+    {
+        payload->type = PAYLOAD_RANDOM;
+        n_variants = DEFAULT_PAYLOAD_VARIANTS;
+        if (spec[strlen("random")] == ':')
+            n_variants = atoi(spec + strlen("random:"));
+    }
+    else if (!strncmp(spec, "file:", strlen("file:")))
+        payload->type = PAYLOAD_FILE;
+    else
+    {
+        fprintf(stderr, "ERROR: Unknown payload type: %s\n", spec);
+        return -1;
+    }
+    if (n_variants < 1)
+        n_variants = 1;
+
+    if (payload->type == PAYLOAD_FILE)
+    {
+        const char *path = spec + strlen("file:");
+        struct stat st;
+        payload->fd = open(path, O_RDONLY);
+        if (payload->fd == -1 || fstat(payload->fd, &st) == -1)
+        {
+            perror(path);
+            return -1;
+        }
+        if ((size_t)st.st_size < object_size)
+        {
+            fprintf(stderr, "ERROR: %s is smaller than the object size (%ld < %lu)\n", path, (long)st.st_size, object_size);
+            return -1;
+        }
+        // Consecutive object-sized windows of the file make the variants
+        n_variants = object_size ? st.st_size/object_size : 1;
+        if (n_variants > DEFAULT_PAYLOAD_VARIANTS)
+            n_variants = DEFAULT_PAYLOAD_VARIANTS;
+        payload->size = st.st_size;
+        payload->data = mmap(NULL, payload->size > 0 ? payload->size : 1, PROT_READ, MAP_SHARED | MAP_POPULATE, payload->fd, 0);
+    }
+    else
+    {
+        // Don't let the variants take all the memory for big objects
+        if (object_size > 0 && n_variants > MAX_PAYLOAD_MEMORY/object_size)
+            n_variants = MAX_PAYLOAD_MEMORY/object_size > 0 ? MAX_PAYLOAD_MEMORY/object_size : 1;
+        payload->size = object_size*n_variants;
+        payload->fd = syscall(SYS_memfd_create, "payload", 0);
+        if (payload->fd == -1 || ftruncate(payload->fd, payload->size) == -1)
+        {
+            perror("ERROR creating payload");
+            return -1;
+        }
+        payload->data = mmap(NULL, payload->size > 0 ? payload->size : 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, payload->fd, 0);
+    }
+    if (payload->data == MAP_FAILED)
+    {
+        perror("ERROR mapping payload");
+        return -1;
+    }
+    payload->n_variants = n_variants;
+
+    if (payload->type == PAYLOAD_CONSTANT)
+        memset(payload->data, '*', payload->size);
+    else if (payload->type == PAYLOAD_RANDOM)
+        for (i = 0; i < n_variants; i++)
+            fill_random(payload->data + i*object_size, object_size, PAYLOAD_SEED + i);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    payload->hashes = calloc(n_variants, sizeof(*payload->hashes));
+    for (i = 0; i < n_variants; i++)
+        sha256_hex(payload->data + i*object_size, object_size, payload->hashes[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    fprintf(stderr, "INFO: Payload: %s, %u variant(s) of %lu B, hashed in %.1f ms (%.0f MiB/s)\n",
+            spec, n_variants, object_size, elapsed*1e3,
+            elapsed > 0 ? (double)object_size*n_variants/elapsed/(1024*1024) : 0.0);
+
+    return 0;
+}
+
+/* Offset of an object's content in the payload file */
+off_t payload_offset(const struct Payload *payload, const unsigned long object_id)
+{
+    return (off_t)(object_id % payload->n_variants) * payload->object_size;
+}
+
+const char *payload_data(const struct Payload *payload, const unsigned long object_id)
+{
+    return payload->data + payload_offset(payload, object_id);
+}
+
+const char *payload_hash(const struct Payload *payload, const unsigned long object_id)
+{
+    return payload->hashes[object_id % payload->n_variants];
+}
+
+void payload_destroy(struct Payload *payload)
+{
+    munmap(payload->data, payload->size > 0 ? payload->size : 1);
+    close(payload->fd);
+    free(payload->hashes);
+}
+
+/*
+ * MSG_ZEROCOPY completions are queued on the socket error queue. The payload is
+ * never modified, so there is nothing to wait for, but the queue must be drained.
+ */
+void drain_zerocopy_completions(int fd)
+{
+    char control[128];
+    struct msghdr msg;
+
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+            break;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/sha.h>
+
+#define MAX_PAYLOAD_MEMORY 1024*1024*1024UL // cap on memory used by all variants
+#define DEFAULT_PAYLOAD_VARIANTS 16
+#define SHA256_HEX_LENGTH 2*SHA256_DIGEST_LENGTH+1
+
+// Not defined by older C libraries
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum PayloadType
+{
+    PAYLOAD_CONSTANT,   // '*' repeated, compresses extremely well
+    PAYLOAD_RANDOM,     // pseudo-random bytes, incompressible
+    PAYLOAD_FILE        // taken from a file
+};
+
+/*
+ * Object content shared by all requests. It lives in a file (a memfd for
+ * generated payloads), so it can be sent both from memory and with sendfile.
+ * Objects are spread over several distinct variants, so that deduplication
+ * in the data path doesn't skew results.
+ */
+struct Payload
+{
+    enum PayloadType type;
+    int fd;
+    char *data;                 // whole mapping of fd
+    size_t size;                // size of the mapping
+    size_t object_size;
+    unsigned int n_variants;
+    char (*hashes)[SHA256_HEX_LENGTH];   // hex SHA-256 of each variant
+};
+
+int payload_init(struct Payload*, const char*, const size_t);
+off_t payload_offset(const struct Payload*, const unsigned long);
+const char *payload_data(const struct Payload*, const unsigned long);
+const char *payload_hash(const struct Payload*, const unsigned long);
+void sha256_hex(const void*, const size_t, char*);
+void drain_zerocopy_completions(int);
+void payload_destroy(struct Payload*);
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Per-thread perf event counters for the instrumentation mode (-e). Every thread
+ * opens its counters on first use as a single group, so one read() returns all of
+ * them, and closes them when it exits. Counters that can't be opened (no PMU in a
+ * VM, perf_event_paranoid, ...) are reported once at startup and left out.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf_counters.h"
+
+struct CounterType
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const struct CounterType counter_types[N_PERF_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static const char *phase_names[N_PERF_PHASES] = {"accept", "read", "parse", "copy", "store", "respond"};
+
+/* Set up by perf_init, read-only afterwards */
+static bool available[N_PERF_COUNTERS];
+static bool exclude_kernel = false;
+static pthread_key_t counters_key;
+
+/* The group of a thread, in the order the counters were opened */
+struct ThreadCounters
+{
+    int fds[N_PERF_COUNTERS];
+    int index[N_PERF_COUNTERS];     // of each counter in the values read, -1 if not opened
+    int n_open;
+};
+
+static int open_counter(const enum PerfCounter counter, const int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = counter_types[counter].type;
+    attr.size = sizeof(attr);
+    attr.config = counter_types[counter].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void close_counters(void *arg)
+{
+    struct ThreadCounters *counters = arg;
+    int i;
+    for (i = 0; i < counters->n_open; i++)
+        close(counters->fds[i]);
+    free(counters);
+}
+
+static struct ThreadCounters *thread_counters(void)
+{
+    struct ThreadCounters *counters = pthread_getspecific(counters_key);
+    int i;
+
+    if (counters != NULL)
+        return counters;
+    counters = calloc(1, sizeof(*counters));
+    for (i = 0; i < N_PERF_COUNTERS; i++)
+    {
+        counters->index[i] = -1;
+        if (!available[i])
+            continue;
+        int fd = open_counter(i, counters->n_open > 0 ? counters->fds[0] : -1);
+        if (fd == -1)
+            continue;
+        counters->index[i] = counters->n_open;
+        counters->fds[counters->n_open++] = fd;
+    }
+    pthread_setspecific(counters_key, counters);
+    return counters;
+}
+
+/* Finds out which counters can be opened. Returns -1 if none can. */
+int perf_init(struct PerfStats *stats)
+{
+    char unavailable[256] = "";
+    int i, n_available = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_init(&stats->lock, NULL);
+    pthread_key_create(&counters_key, close_counters);
+
+    for (i = 0; i < N_PERF_COUNTERS; i++)
+    {
+        int fd = open_counter(i, -1);
+        // Counting in the kernel needs perf_event_paranoid < 2, user space is the next best thing
+        if (fd == -1 && (errno == EACCES || errno == EPERM) && !exclude_kernel)
+        {
+            exclude_kernel = true;
+            fd = open_counter(i, -1);
+        }
+        if (fd == -1)
+        {
+            size_t len = strlen(unavailable);
+            snprintf(unavailable + len, sizeof(unavailable) - len, "%s%s (%s)", len > 0 ? ", " : "",
+                     counter_types[i].name, strerror(errno));
+            continue;
+        }
+        close(fd);
+        available[i] = true;
+        n_available++;
+    }
+    if (unavailable[0] != '\0')
+        fprintf(stderr, "WARNING: Perf counters unavailable: %s\n", unavailable);
+    if (n_available == 0)
+    {
+        fprintf(stderr, "ERROR: No perf counters can be opened\n");
+        return -1;
+    }
+    fprintf(stderr, "INFO: Counting request phases with perf events%s\n",
+            exclude_kernel ? " in user space only (perf_event_paranoid >= 2)" : "");
+
+    return 0;
+}
+
+/* Reads the counters of the calling thread, opening them on the first call */
+void perf_sample(struct PerfSample *sample)
+{
+    struct ThreadCounters *counters = thread_counters();
+    uint64_t values[1 + N_PERF_COUNTERS];
+    struct timespec ts;
+    int i;
+
+    memset(sample, 0, sizeof(*sample));
+    if (counters->n_open > 0 && read(counters->fds[0], values, sizeof(values)) > 0)
+    {
+        // values[0] is the number of counters in the group
+        for (i = 0; i < N_PERF_COUNTERS; i++)
+            if (counters->index[i] != -1)
+                sample->values[i] = values[1 + counters->index[i]];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sample->ns = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Adds what the counters went up by since start to a phase */
+void perf_tally(struct PerfTally *tally, const enum PerfPhase phase, const struct PerfSample *start)
+{
+    struct PerfSample end;
+    int i;
+
+    perf_sample(&end);
+    tally->calls[phase]++;
+    tally->ns[phase] += end.ns - start->ns;
+    for (i = 0; i < N_PERF_COUNTERS; i++)
+        tally->values[phase][i] += end.values[i] - start->values[i];
+}
+
+/* Adds a tally to the totals and clears it. Requests that were cut short count as phases only. */
+void perf_flush(struct PerfStats *stats, struct PerfTally *tally, const bool request_done)
+{
+    int p, i;
+
+    pthread_mutex_lock(&stats->lock);
+    if (request_done)
+        stats->requests++;
+    for (p = 0; p < N_PERF_PHASES; p++)
+    {
+        stats->total.calls[p] += tally->calls[p];
+        stats->total.ns[p] += tally->ns[p];
+        for (i = 0; i < N_PERF_COUNTERS; i++)
+            stats->total.values[p][i] += tally->values[p][i];
+    }
+    pthread_mutex_unlock(&stats->lock);
+    memset(tally, 0, sizeof(*tally));
+}
+
+/* Prints the mean per request of every phase (per connection for accept) */
+void perf_print_stats(const struct PerfStats *stats)
+{
+    const struct PerfTally *total = &stats->total;
+    int p, i;
+
+    fprintf(stderr, "INFO: Perf counters per request phase, mean per request over %lu request(s):\n", stats->requests);
+    fprintf(stderr, "%-8s %10s %10s", "phase", "calls", "time [ns]");
+    for (i = 0; i < N_PERF_COUNTERS; i++)
+        fprintf(stderr, " %13s", counter_types[i].name);
+    fprintf(stderr, " %6s\n", "IPC");
+    for (p = 0; p < N_PERF_PHASES; p++)
+    {
+        // Accepts happen once per connection, not per request
+        double n = p == PHASE_ACCEPT ? (double)total->calls[p] : (double)stats->requests;
+        if (total->calls[p] == 0 || n == 0)
+            continue;
+        fprintf(stderr, "%-8s %10.1f %10.0f", phase_names[p], total->calls[p]/n, total->ns[p]/n);
+        for (i = 0; i < N_PERF_COUNTERS; i++)
+        {
+            if (available[i])
+                fprintf(stderr, " %13.1f", total->values[p][i]/n);
+            else
+                fprintf(stderr, " %13s", "-");
+        }
+        if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && total->values[p][PERF_CYCLES] > 0)
+            fprintf(stderr, " %6.2f\n", (double)total->values[p][PERF_INSTRUCTIONS]/total->values[p][PERF_CYCLES]);
+        else
+            fprintf(stderr, " %6s\n", "-");
+    }
+}
+
+void perf_destroy(struct PerfStats *stats)
+{
+    pthread_mutex_destroy(&stats->lock);
+}
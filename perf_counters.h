@@ -0,0 +1,57 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_PAGE_FAULTS,
+    N_PERF_COUNTERS
+};
+
+/* Phases of serving a request that counters are read around (-e) */
+enum PerfPhase
+{
+    PHASE_ACCEPT,       // accepting a connection and setting it up, on the event loop
+    PHASE_READ,         // read() calls
+    PHASE_PARSE,        // parsing the request line and headers
+    PHASE_COPY,         // copying the body into the object buffer
+    PHASE_STORE,        // writing to storage, including compression and the bucket index
+    PHASE_RESPOND,      // sending responses, including reading objects for GET
+    N_PERF_PHASES
+};
+
+/* Counter values of the calling thread at some point */
+struct PerfSample
+{
+    uint64_t ns;
+    uint64_t values[N_PERF_COUNTERS];
+};
+
+/* Counts of the phases of a request, so far, collected without locking */
+struct PerfTally
+{
+    uint64_t calls[N_PERF_PHASES];
+    uint64_t ns[N_PERF_PHASES];
+    uint64_t values[N_PERF_PHASES][N_PERF_COUNTERS];
+};
+
+struct PerfStats
+{
+    pthread_mutex_t lock;
+    unsigned long requests;
+    struct PerfTally total;
+};
+
+int perf_init(struct PerfStats*);
+void perf_sample(struct PerfSample*);
+void perf_tally(struct PerfTally*, const enum PerfPhase, const struct PerfSample*);
+void perf_flush(struct PerfStats*, struct PerfTally*, const bool);
+void perf_print_stats(const struct PerfStats*);
+void perf_destroy(struct PerfStats*);
+#endif
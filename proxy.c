@@ -0,0 +1,493 @@
+/*
+ * Passthrough mode of baseliner (-p): requests are relayed to an upstream S3
+ * endpoint (RGW, or another baseliner) to measure what a proxy hop such as
+ * HAProxy or nginx costs at a minimum. Heads are forwarded as they are, bodies
+ * are spliced through a pipe in both directions, so they are never copied to
+ * user space, and upstream connections are kept alive in a pool.
+ *
+ * Client sockets are non-blocking and waited on with poll(), upstream sockets
+ * are blocking with send and receive timeouts.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+
+/* Waits until the client socket is ready, adding the time to *wait_ns. Returns -1 on timeout or error. */
+static int wait_client(const int fd, const short events, unsigned long long *wait_ns)
+{
+    struct pollfd pfd = {fd, events, 0};
+    unsigned long long start = now_ns();
+    int r;
+
+    do
+        r = poll(&pfd, 1, PROXY_TIMEOUT*1000);
+    while (r == -1 && errno == EINTR);
+    *wait_ns += now_ns() - start;
+    if (r == 0)
+    {
+        fprintf(stderr, "ERROR: Client on descriptor %d timed out\n", fd);
+        return -1;
+    }
+    return r == -1 ? -1 : 0;
+}
+
+/* Sends the whole buffer, to the non-blocking client or the blocking upstream */
+static int send_all(const int fd, const char *buf, size_t len, const int flags, const bool client,
+                    unsigned long long *wait_ns)
+{
+    while (len > 0)
+    {
+        unsigned long long start = now_ns();
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL | flags);
+        if (!client)
+            *wait_ns += now_ns() - start;
+        if (n == -1)
+        {
+            if (client && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (wait_client(fd, POLLOUT, wait_ns) == -1)
+                    return -1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Moves len bytes out of the pipe to the non-blocking client or the blocking upstream */
+static int drain_pipe(const int *pipe_fds, const int to, size_t len, const bool to_client,
+                      unsigned long long *client_wait_ns, unsigned long long *upstream_wait_ns)
+{
+    while (len > 0)
+    {
+        unsigned long long start = now_ns();
+        ssize_t n = splice(pipe_fds[0], NULL, to, NULL, len, SPLICE_F_MOVE | (to_client ? SPLICE_F_NONBLOCK : 0));
+        if (!to_client)
+            *upstream_wait_ns += now_ns() - start;
+        if (n == -1)
+        {
+            if (to_client && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (wait_client(to, POLLOUT, client_wait_ns) == -1)
+                    return -1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            perror("ERROR splicing to socket");
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Moves len bytes from one socket to the other through the pipe, without copying
+ * them to user space. The pipe is empty again when it returns successfully.
+ */
+static int splice_all(const int from, const int to, const int *pipe_fds, unsigned long len, const bool from_client,
+                      unsigned long long *client_wait_ns, unsigned long long *upstream_wait_ns)
+{
+    while (len > 0)
+    {
+        size_t want = len < PROXY_PIPE_SIZE ? len : PROXY_PIPE_SIZE;
+        unsigned long long start = now_ns();
+        ssize_t n = splice(from, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | (from_client ? SPLICE_F_NONBLOCK : 0));
+        if (!from_client)
+            *upstream_wait_ns += now_ns() - start;
+        if (n == -1)
+        {
+            if (from_client && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (wait_client(from, POLLIN, client_wait_ns) == -1)
+                    return -1;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            perror("ERROR splicing from socket");
+            return -1;
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "ERROR: %s closed the connection in the middle of a body\n", from_client ? "Client" : "Upstream");
+            return -1;
+        }
+        len -= n;
+        if (drain_pipe(pipe_fds, to, n, !from_client, client_wait_ns, upstream_wait_ns) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads a response head from the upstream into buf, which may already hold the
+ * start of it. Returns the length of the head, bytes after it are left in buf
+ * (*len counts them too), or -1 on error, EOF or timeout.
+ */
+static long read_head(const int fd, char *buf, size_t *len, unsigned long long *wait_ns)
+{
+    while (1)
+    {
+        buf[*len] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if (end != NULL)
+            return end + 4 - buf;
+        if (*len == PROXY_HEAD_SIZE - 1)
+        {
+            fprintf(stderr, "ERROR: Upstream response head too long\n");
+            return -1;
+        }
+        unsigned long long start = now_ns();
+        ssize_t n = recv(fd, buf + *len, PROXY_HEAD_SIZE - 1 - *len, 0);
+        *wait_ns += now_ns() - start;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        *len += n;
+    }
+}
+
+static struct Upstream *upstream_connect(struct Proxy *proxy)
+{
+    struct Upstream *upstream = malloc(sizeof(struct Upstream));
+    struct timeval timeout = {PROXY_TIMEOUT, 0};
+    int one = 1;
+
+    upstream->reused = false;
+    upstream->fd = socket(proxy->addr.ss_family, SOCK_STREAM, 0);
+    if (upstream->fd == -1)
+    {
+        perror("ERROR opening upstream socket");
+        free(upstream);
+        return NULL;
+    }
+    setsockopt(upstream->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(upstream->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(upstream->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(upstream->fd, (struct sockaddr*)&proxy->addr, proxy->addrlen) == -1)
+    {
+        fprintf(stderr, "ERROR connecting to upstream %s: %s\n", proxy->name, strerror(errno));
+        close(upstream->fd);
+        free(upstream);
+        return NULL;
+    }
+    if (pipe2(upstream->pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("ERROR creating pipe");
+        close(upstream->fd);
+        free(upstream);
+        return NULL;
+    }
+    // A bigger pipe moves more per splice; not fatal if the limit is lower
+    fcntl(upstream->pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+
+    pthread_mutex_lock(&proxy->lock);
+    proxy->connects++;
+    pthread_mutex_unlock(&proxy->lock);
+    return upstream;
+}
+
+static void upstream_close(struct Upstream *upstream)
+{
+    close(upstream->fd);
+    close(upstream->pipe_fds[0]);
+    close(upstream->pipe_fds[1]);
+    free(upstream);
+}
+
+/* Takes an idle upstream connection from the pool, or opens a new one */
+static struct Upstream *upstream_acquire(struct Proxy *proxy)
+{
+    struct Upstream *upstream = NULL;
+
+    pthread_mutex_lock(&proxy->lock);
+    if (proxy->n_idle > 0)
+        upstream = proxy->idle[--proxy->n_idle];
+    pthread_mutex_unlock(&proxy->lock);
+    if (upstream != NULL)
+        return upstream;
+    return upstream_connect(proxy);
+}
+
+static void upstream_release(struct Proxy *proxy, struct Upstream *upstream)
+{
+    upstream->reused = true;
+    pthread_mutex_lock(&proxy->lock);
+    if (proxy->n_idle == proxy->capacity)
+    {
+        proxy->capacity = proxy->capacity ? 2*proxy->capacity : 64;
+        proxy->idle = realloc(proxy->idle, proxy->capacity*sizeof(struct Upstream*));
+    }
+    proxy->idle[proxy->n_idle++] = upstream;
+    pthread_mutex_unlock(&proxy->lock);
+}
+
+/* True if the head (up to its end) has the given header, e.g. "\r\nConnection: close" */
+static bool has_header(const char *head, const size_t head_len, const char *header)
+{
+    const char *found = strcasestr(head, header);
+    return found != NULL && (size_t)(found - head) < head_len;
+}
+
+/* Content-Length of a response head, -1 if the body only ends when the connection does */
+static long response_length(const char *head, const size_t head_len, const int status, const bool head_request)
+{
+    if (head_request || status/100 == 1 || status == 204 || status == 304)
+        return 0;
+    const char *cl = strcasestr(head, "\r\nContent-Length:");
+    if (cl == NULL || (size_t)(cl - head) >= head_len)
+        return -1;
+    return strtol(cl + strlen("\r\nContent-Length:"), NULL, 10);
+}
+
+static void record_exchange(struct Proxy *proxy, const struct ProxyExchange *exchange,
+                            const unsigned long long client_wait_ns, const bool ok)
+{
+    unsigned long long waited = exchange->upstream_ns + client_wait_ns;
+
+    pthread_mutex_lock(&proxy->lock);
+    proxy->requests++;
+    if (ok)
+    {
+        hist_record(&proxy->added, exchange->total_ns > waited ? exchange->total_ns - waited : 0);
+        hist_record(&proxy->upstream, exchange->upstream_ns);
+    }
+    else
+        proxy->errors++;
+    pthread_mutex_unlock(&proxy->lock);
+}
+
+/* Answers a request that never got a response from the upstream */
+static void bad_gateway(const int client_fd, unsigned long long *wait_ns)
+{
+    const char *resp = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send_all(client_fd, resp, strlen(resp), 0, true, wait_ns);
+}
+
+/* Relays a response of unknown length (e.g. chunked) until the upstream closes its connection */
+static int relay_until_close(const struct Upstream *upstream, const int client_fd, struct ProxyExchange *exchange,
+                             unsigned long long *client_wait_ns)
+{
+    while (1)
+    {
+        unsigned long long start = now_ns();
+        ssize_t n = splice(upstream->fd, NULL, upstream->pipe_fds[1], NULL, PROXY_PIPE_SIZE, SPLICE_F_MOVE);
+        exchange->upstream_ns += now_ns() - start;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            return 0;
+        if (n == -1 || drain_pipe(upstream->pipe_fds, client_fd, n, true, client_wait_ns, &exchange->upstream_ns) == -1)
+            return -1;
+        exchange->response_bytes += n;
+    }
+}
+
+/*
+ * Relays the request body, if the upstream asks for it, and then the response. resp
+ * holds what was read from the upstream so far, a complete head unless resp_head_len
+ * is -1. Returns 1 if the upstream connection can be reused, 0 if not and -1 on error.
+ */
+static int relay(struct Proxy *proxy, const int client_fd, struct Upstream *upstream, struct ProxyExchange *exchange,
+                 char *resp, size_t resp_len, long resp_head_len, const bool expect, const bool head_request,
+                 unsigned long body_left, bool *client_reusable, unsigned long long *client_wait_ns)
+{
+    int status = 0;
+
+    if (resp_head_len != -1)
+        sscanf(resp, "HTTP/%*s %d", &status);
+    if (resp_head_len != -1 && expect && body_left > 0 && status == 100)
+    {
+        // Pass "100 Continue" on, then the body
+        if (send_all(client_fd, resp, resp_head_len, 0, true, client_wait_ns) == -1)
+            return -1;
+        resp_len -= resp_head_len;
+        memmove(resp, resp + resp_head_len, resp_len);
+        resp_head_len = -1;
+    }
+    if (resp_head_len == -1)
+    {
+        if (splice_all(client_fd, upstream->fd, upstream->pipe_fds, body_left, true,
+                       client_wait_ns, &exchange->upstream_ns) == -1)
+            return -1;
+        exchange->request_bytes += body_left;
+        body_left = 0;
+        resp_head_len = read_head(upstream->fd, resp, &resp_len, &exchange->upstream_ns);
+        if (resp_head_len == -1)
+        {
+            fprintf(stderr, "ERROR: Upstream %s failed before responding\n", proxy->name);
+            bad_gateway(client_fd, client_wait_ns);
+            return -1;
+        }
+        sscanf(resp, "HTTP/%*s %d", &status);
+    }
+    exchange->status = status;
+
+    // The head goes back as it is, along with whatever part of the body came with it
+    long length = response_length(resp, resp_head_len, status, head_request);
+    size_t body_read = resp_len - resp_head_len;
+    if (length != -1 && body_read > (size_t)length)
+    {
+        fprintf(stderr, "ERROR: Upstream %s sent more than the response\n", proxy->name);
+        return -1;
+    }
+    // MSG_MORE keeps the head from going out in a segment of its own, and waiting for an ACK behind it
+    bool more = length == -1 || body_read < (size_t)length;
+    if (send_all(client_fd, resp, resp_len, more ? MSG_MORE : 0, true, client_wait_ns) == -1)
+        return -1;
+    exchange->response_bytes = body_read;
+    *client_reusable = false;
+    if (length == -1)
+        return relay_until_close(upstream, client_fd, exchange, client_wait_ns);
+    if (splice_all(upstream->fd, client_fd, upstream->pipe_fds, length - body_read, false,
+                   client_wait_ns, &exchange->upstream_ns) == -1)
+        return -1;
+    exchange->response_bytes = length;
+
+    // If the upstream refused the body the client announced, nothing else can come over its connection
+    bool close = has_header(resp, resp_head_len, "\r\nConnection: close");
+    *client_reusable = body_left == 0 && !close;
+    return close ? 0 : 1;
+}
+
+/*
+ * Relays one request and its response. data holds the request head (head_len
+ * bytes) and possibly the start of its body, the rest of the body (content_length
+ * bytes in total) is still to be read from the client. Returns 0 if the client
+ * connection can serve further requests, -1 if it must be closed.
+ */
+int proxy_forward(struct Proxy *proxy, const int client_fd, const char *data, const size_t len, const size_t head_len,
+                  const unsigned long content_length, struct ProxyExchange *exchange)
+{
+    unsigned long long start = now_ns();
+    unsigned long long client_wait_ns = 0;
+    char resp[PROXY_HEAD_SIZE];
+    size_t resp_len = 0;
+    long resp_head_len = -1;
+    bool expect = has_header(data, head_len, "\r\nExpect: 100-continue");
+    bool head_request = !strncmp(data, "HEAD ", strlen("HEAD "));
+    unsigned long body_left = content_length - (len - head_len);
+    struct Upstream *upstream;
+
+    memset(exchange, 0, sizeof(*exchange));
+    exchange->status = 502;
+    exchange->request_bytes = len - head_len;
+    // Kept-alive upstream connections may have been closed while idle: move on to the next
+    // one, and finally a fresh one, as long as no body was read from the client yet
+    while (1)
+    {
+        upstream = upstream_acquire(proxy);
+        if (upstream == NULL)
+        {
+            bad_gateway(client_fd, &client_wait_ns);
+            record_exchange(proxy, exchange, client_wait_ns, false);
+            return -1;
+        }
+        resp_len = 0;
+        resp_head_len = -1;
+        if (send_all(upstream->fd, data, len, 0, false, &exchange->upstream_ns) == 0)
+        {
+            // Without "Expect: 100-continue" the body goes out right away
+            if (body_left > 0 && !expect)
+                break;
+            resp_head_len = read_head(upstream->fd, resp, &resp_len, &exchange->upstream_ns);
+            if (resp_head_len != -1)
+                break;
+        }
+        bool retry = upstream->reused;
+        upstream_close(upstream);
+        if (!retry)
+        {
+            fprintf(stderr, "ERROR: Upstream %s failed before responding\n", proxy->name);
+            bad_gateway(client_fd, &client_wait_ns);
+            record_exchange(proxy, exchange, client_wait_ns, false);
+            return -1;
+        }
+    }
+
+    bool client_reusable = false;
+    int r = relay(proxy, client_fd, upstream, exchange, resp, resp_len, resp_head_len, expect, head_request,
+                  body_left, &client_reusable, &client_wait_ns);
+    exchange->total_ns = now_ns() - start;
+    record_exchange(proxy, exchange, client_wait_ns, r != -1);
+    if (r == 1)
+        upstream_release(proxy, upstream);
+    else
+        upstream_close(upstream);
+    return r == -1 || !client_reusable ? -1 : 0;
+}
+
+/* Resolves the upstream, given as host:port. Responses to closed clients must not kill the server. */
+int proxy_init(struct Proxy *proxy, const char *upstream)
+{
+    struct addrinfo hints, *result;
+    char host[256];
+
+    memset(proxy, 0, sizeof(*proxy));
+    const char *colon = strrchr(upstream, ':');
+    if (colon == NULL || colon == upstream || (size_t)(colon - upstream) >= sizeof(host))
+    {
+        fprintf(stderr, "ERROR: Upstream must be given as host:port, not %s\n", upstream);
+        return -1;
+    }
+    memcpy(host, upstream, colon - upstream);
+    host[colon - upstream] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int s = getaddrinfo(host, colon + 1, &hints, &result);
+    if (s != 0)
+    {
+        fprintf(stderr, "ERROR: Cannot resolve upstream %s: %s\n", upstream, gai_strerror(s));
+        return -1;
+    }
+    memcpy(&proxy->addr, result->ai_addr, result->ai_addrlen);
+    proxy->addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    snprintf(proxy->name, sizeof(proxy->name), "%s", upstream);
+    pthread_mutex_init(&proxy->lock, NULL);
+    hist_reset(&proxy->added);
+    hist_reset(&proxy->upstream);
+    // splice() has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    return 0;
+}
+
+void proxy_print_stats(const struct Proxy *proxy)
+{
+    fprintf(stderr, "INFO: Proxied %lu request(s) to %s (%lu failed) over %lu upstream connection(s)\n",
+            proxy->requests, proxy->name, proxy->errors, proxy->connects);
+    if (proxy->requests == proxy->errors)
+        return;
+    hist_print(stderr, "Added latency", &proxy->added);
+    hist_print(stderr, "Upstream time", &proxy->upstream);
+}
+
+void proxy_destroy(struct Proxy *proxy)
+{
+    size_t i;
+    for (i = 0; i < proxy->n_idle; i++)
+        upstream_close(proxy->idle[i]);
+    free(proxy->idle);
+    pthread_mutex_destroy(&proxy->lock);
+}
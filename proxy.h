@@ -0,0 +1,50 @@
+#ifndef PROXY_H
+#define PROXY_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "histogram.h"
+
+#define PROXY_HEAD_SIZE 4096        //B, of upstream response heads
+#define PROXY_PIPE_SIZE 1024*1024   //B, bodies are spliced through pipes of this size
+#define PROXY_TIMEOUT 30            //s, before a silent upstream or client is given up on
+
+/* A kept-alive connection to the upstream, with its own pipe to splice bodies through */
+struct Upstream {
+    int fd;
+    int pipe_fds[2];
+    bool reused;                // already served a request
+};
+
+/* What relaying a single request took */
+struct ProxyExchange {
+    int status;                         // of the upstream's response, 502 if there was none
+    unsigned long request_bytes;        // body bytes spliced to the upstream
+    unsigned long response_bytes;       // body bytes relayed back
+    unsigned long long total_ns;        // from the request head to the end of the response
+    unsigned long long upstream_ns;     // spent waiting on the upstream
+};
+
+/* Forwards requests to an upstream S3 endpoint over a pool of kept-alive connections */
+struct Proxy {
+    char name[320];                     // host:port, for messages
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    pthread_mutex_t lock;
+    struct Upstream **idle;
+    size_t n_idle;
+    size_t capacity;
+    // Statistics, under the lock
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long connects;
+    struct Histogram added;             // time a request spent in the proxy on top of the upstream time
+    struct Histogram upstream;
+};
+
+int proxy_init(struct Proxy*, const char*);
+int proxy_forward(struct Proxy*, const int, const char*, const size_t, const size_t, const unsigned long, struct ProxyExchange*);
+void proxy_print_stats(const struct Proxy*);
+void proxy_destroy(struct Proxy*);
+#endif
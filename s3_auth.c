@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <openssl/hmac.h>
+#include "s3_auth.h"
+
+#define SHA256_BLOCK_SIZE 64
+
+/* Writes 2*source_len hex digits and a terminating NUL to result */
+void to_hex(const unsigned char *source, const unsigned int source_len, char *result)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned int i;
+
+    for (i = 0; i < source_len; ++i)
+    {
+        result[2*i] = digits[source[i] >> 4];
+        result[2*i+1] = digits[source[i] & 0xf];
+    }
+    result[2*source_len] = '\0';
+}
+
+/*
+ * URI-encodes a path the way SigV4 expects: everything but unreserved characters
+ * and '/' is percent-encoded. Returns -1 if it doesn't fit in size bytes.
+ */
+int uri_encode(const char *source, char *result, const size_t size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    for (; *source != '\0'; source++)
+    {
+        unsigned char c = *source;
+        if (len + 4 > size)
+            return -1;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
+            result[len++] = c;
+        else
+        {
+            result[len++] = '%';
+            result[len++] = digits[c >> 4];
+            result[len++] = digits[c & 0xf];
+        }
+    }
+    result[len] = '\0';
+    return 0;
+}
+
+static unsigned char* hmac_sha256(const void *key, int keylen,
+                                  const unsigned char *data, int datalen,
+                                  unsigned char *result, unsigned int* resultlen)
+{
+    return HMAC(EVP_sha256(), key, keylen, data, datalen, result, resultlen);
+}
+
+/* Derives the signing key for the current day and precomputes its HMAC pad states */
+static void derive_signing_key(struct SigV4Signer *signer, const char *date_stamp)
+{
+    unsigned char kdate[SHA256_DIGEST_LENGTH], kregion[SHA256_DIGEST_LENGTH], kservice[SHA256_DIGEST_LENGTH];
+    unsigned char pad[SHA256_BLOCK_SIZE];
+    unsigned int len;
+    char aws_key[sizeof(signer->secret) + 4];
+    int i;
+
+    snprintf(aws_key, sizeof(aws_key), "AWS4%s", signer->secret);
+    hmac_sha256(aws_key, strlen(aws_key), (const unsigned char*)date_stamp, strlen(date_stamp), kdate, &len);
+    hmac_sha256(kdate, len, (const unsigned char*)signer->region, strlen(signer->region), kregion, &len);
+    hmac_sha256(kregion, len, (const unsigned char*)signer->service, strlen(signer->service), kservice, &len);
+    hmac_sha256(kservice, len, (const unsigned char*)"aws4_request", strlen("aws4_request"), signer->signing_key, &len);
+
+    // HMAC(K, m) = H((K ^ opad) || H((K ^ ipad) || m)), K is shorter than a block
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        pad[i] ^= signer->signing_key[i];
+    EVP_DigestInit_ex(signer->inner, EVP_sha256(), NULL);
+    EVP_DigestUpdate(signer->inner, pad, sizeof(pad));
+    memset(pad, 0x5c, sizeof(pad));
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        pad[i] ^= signer->signing_key[i];
+    EVP_DigestInit_ex(signer->outer, EVP_sha256(), NULL);
+    EVP_DigestUpdate(signer->outer, pad, sizeof(pad));
+
+    memcpy(signer->date_stamp, date_stamp, sizeof(signer->date_stamp));
+}
+
+int sigv4_init(struct SigV4Signer *signer, const char *key_id, const char *secret, const char *region, const char *service)
+{
+    memset(signer, 0, sizeof(*signer));
+    snprintf(signer->key_id, sizeof(signer->key_id), "%s", key_id);
+    snprintf(signer->secret, sizeof(signer->secret), "%s", secret);
+    signer->region = region;
+    signer->service = service;
+    signer->inner = EVP_MD_CTX_new();
+    signer->outer = EVP_MD_CTX_new();
+    signer->md = EVP_MD_CTX_new();
+    signer->last_time = (time_t)-1;
+    if (signer->inner == NULL || signer->outer == NULL || signer->md == NULL)
+    {
+        fprintf(stderr, "ERROR: Couldn't allocate digest contexts\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Signs a request and writes the Authorization header line (without CRLF) to
+ * auth_header and the matching x-amz-date value to amz_date.
+ * host is the value of the Host header, path must already be URI-encoded.
+ */
+int sigv4_sign(struct SigV4Signer *signer, const char *method, const char *path, const char *host,
+               const char *payload_hash, const time_t now, char *auth_header, char *amz_date)
+{
+    char canonical_request[1024];
+    char canonical_request_hash[2*SHA256_DIGEST_LENGTH+1];
+    char string_to_sign[256];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char signature[2*SHA256_DIGEST_LENGTH+1];
+    unsigned int len;
+    int n;
+
+    // Formatting dates is surprisingly expensive, so only do it once a second
+    if (now != signer->last_time)
+    {
+        struct tm tm;
+        char date_stamp[9];
+        gmtime_r(&now, &tm);
+        strftime(signer->amz_date, sizeof(signer->amz_date), "%Y%m%dT%H%M%SZ", &tm);
+        strftime(date_stamp, sizeof(date_stamp), "%Y%m%d", &tm);
+        if (strcmp(date_stamp, signer->date_stamp))
+            derive_signing_key(signer, date_stamp);
+        signer->last_time = now;
+    }
+    memcpy(amz_date, signer->amz_date, AMZ_DATE_SIZE);
+
+    // Canonical request
+    n = snprintf(canonical_request, sizeof(canonical_request), "%s\n%s\n\n"
+                 "host:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n\n"
+                 "host;x-amz-content-sha256;x-amz-date\n%s",
+                 method, path, host, payload_hash, signer->amz_date, payload_hash);
+    if (n < 0 || (size_t)n >= sizeof(canonical_request))
+    {
+        fprintf(stderr, "ERROR: Canonical request too long\n");
+        return -1;
+    }
+
+    // Canonical request hash
+    EVP_DigestInit_ex(signer->md, EVP_sha256(), NULL);
+    EVP_DigestUpdate(signer->md, canonical_request, n);
+    EVP_DigestFinal_ex(signer->md, digest, &len);
+    to_hex(digest, len, canonical_request_hash);
+
+    // Policy string to sign
+    n = snprintf(string_to_sign, sizeof(string_to_sign), "AWS4-HMAC-SHA256\n%s\n%s/%s/%s/aws4_request\n%s",
+                 signer->amz_date, signer->date_stamp, signer->region, signer->service, canonical_request_hash);
+
+    // Signature, using the precomputed HMAC states
+    EVP_MD_CTX_copy_ex(signer->md, signer->inner);
+    EVP_DigestUpdate(signer->md, string_to_sign, n);
+    EVP_DigestFinal_ex(signer->md, digest, &len);
+    EVP_MD_CTX_copy_ex(signer->md, signer->outer);
+    EVP_DigestUpdate(signer->md, digest, len);
+    EVP_DigestFinal_ex(signer->md, digest, &len);
+    to_hex(digest, len, signature);
+
+    // Authorisation header
+    snprintf(auth_header, AUTH_HEADER_SIZE, "Authorization: AWS4-HMAC-SHA256"
+             " Credential=%s/%s/%s/%s/aws4_request,"
+             " SignedHeaders=host;x-amz-content-sha256;x-amz-date,"
+             " Signature=%s",
+             signer->key_id, signer->date_stamp, signer->region, signer->service, signature);
+
+    return 0;
+}
+
+void sigv4_destroy(struct SigV4Signer *signer)
+{
+    EVP_MD_CTX_free(signer->inner);
+    EVP_MD_CTX_free(signer->outer);
+    EVP_MD_CTX_free(signer->md);
+}
@@ -0,0 +1,38 @@
+#ifndef S3_AUTH_H
+#define S3_AUTH_H
+#include <stddef.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#define AUTH_HEADER_SIZE 512
+#define AMZ_DATE_SIZE 17
+// x-amz-content-sha256 of requests without a body
+#define EMPTY_PAYLOAD_HASH "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/*
+ * Signs requests with AWS Signature Version 4. Not thread-safe: every thread
+ * needs its own signer. The signing key is derived once per day and its HMAC
+ * inner/outer states are kept, so a signature costs a handful of SHA-256 blocks.
+ */
+struct SigV4Signer
+{
+    char key_id[256];
+    char secret[256];
+    const char *region;
+    const char *service;
+    char date_stamp[9];                 // day the signing key was derived for
+    unsigned char signing_key[SHA256_DIGEST_LENGTH];
+    EVP_MD_CTX *inner;                  // SHA-256 state after (signing key ^ ipad)
+    EVP_MD_CTX *outer;                  // SHA-256 state after (signing key ^ opad)
+    EVP_MD_CTX *md;                     // scratch context
+    time_t last_time;                   // cache of the formatted x-amz-date
+    char amz_date[AMZ_DATE_SIZE];
+};
+
+void to_hex(const unsigned char*, const unsigned int, char*);
+int uri_encode(const char*, char*, const size_t);
+int sigv4_init(struct SigV4Signer*, const char*, const char*, const char*, const char*);
+int sigv4_sign(struct SigV4Signer*, const char*, const char*, const char*, const char*, const time_t, char*, char*);
+void sigv4_destroy(struct SigV4Signer*);
+#endif
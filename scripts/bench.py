@@ -0,0 +1,438 @@
+#!/usr/bin/env python
+"""
+Runs a matrix of benchmarks: server modes x object sizes x concurrency levels.
+
+Every mode runs `baseliner_local` (baseliner built with objects stored in a
+local directory instead of Ceph, see local_handler.c) on localhost:
+
+  raw      plain TCP, the client only sends (send-only mode)
+  http     HTTP web server (-w)
+  storage  HTTP web server storing every object (-c -w)
+  proxy    HTTP web server relaying every request (-p) to a second one in http
+           mode; compare with http for the latency a proxy hop adds, server
+           CPU is that of the proxy alone (not run by default)
+  busy     HTTP web server in low-latency mode (-w -b), spinning on epoll and
+           reading on the event loop; compare with http for the latency and
+           CPU cost of busy polling (not run by default)
+  zstd     HTTP web server storing every object compressed with zstd (-c -w -z),
+  lz4      or LZ4; compare with storage for the CPU and latency compression
+           costs, with --payload for how compressible objects are (not run by
+           default, baseliner_local must be built with the codecs)
+  tls      HTTP web server terminating TLS (-w -T) with a self-signed
+           certificate, the client connects with -S; compare with http for
+           what encryption costs (kTLS is used if the kernel has the tls
+           module, see the server log)
+  handshake  as tls, but the client opens a fresh connection for every
+           request (-f), resuming sessions, for the handshake rate (not run
+           by default)
+  idle     as http, while the client holds --hold more connections open
+           without sending anything (-H); compare with http for what idle
+           connections cost the active ones, and srv MiB for their memory
+           (not run by default)
+
+and drives it with `client_s3` for a fixed time per cell. For each cell it
+records throughput, CPU time per operation of the server and of the client,
+latency percentiles and the server's peak resident memory, prints a report
+and optionally saves it as JSON.
+
+Results are compared against a baseline file if one exists: cells where
+throughput dropped, or CPU per op or p99 latency rose, by more than the
+threshold are flagged as regressions and the script exits with status 1.
+Baselines only make sense on the machine they were recorded on, so the
+host and CPU count are stored with them.
+
+Run it with `make bench` (arguments go in BENCH_ARGS) from the top directory.
+"""
+from __future__ import print_function, division
+
+import argparse
+import json
+import os
+import platform
+import re
+import resource
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+TOP_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(TOP_DIR, "baseliner_local")
+CLIENT = os.path.join(TOP_DIR, "client_s3")
+
+MODES = {
+    "raw": [],
+    "http": ["-w"],
+    "storage": ["-c", "-w"],
+    "proxy": ["-w", "-p", "127.0.0.1:{upstream_port}"],
+    "busy": ["-w", "-b"],
+    "zstd": ["-c", "-w", "-z", "zstd"],
+    "lz4": ["-c", "-w", "-z", "lz4"],
+    "tls": ["-w", "-T", "{work_dir}/cert.pem", "-K", "{work_dir}/key.pem"],
+    "handshake": ["-w", "-T", "{work_dir}/cert.pem", "-K", "{work_dir}/key.pem"],
+    "idle": ["-w"],
+}
+# Extra client_s3 options of a mode
+CLIENT_ARGS = {
+    "tls": ["-S"],
+    "handshake": ["-S", "-f"],
+    "idle": ["-H", "{hold}"],
+}
+# Modes that relay to a server of another mode, started on the next port
+UPSTREAMS = {
+    "proxy": "http",
+}
+# baseliner keeps whole objects in a buffer of MAX_CONTENT_SIZE (1 MiB)
+MAX_OBJECT_SIZE = 1024*1024
+
+SENT_RE = re.compile(r"INFO: Sent (\d+) object\(s\) \((\d+) error\(s\)\) in ([\d.]+) s")
+RATE_RE = re.compile(r"INFO: ([\d.]+) ops/s, ([\d.]+) MiB/s")
+LATENCY_RE = re.compile(r"INFO: Latency \(from intended send time\) \[us\]: mean ([\d.]+), p50 ([\d.]+), "
+                        r"p90 ([\d.]+), p99 ([\d.]+), p99.9 ([\d.]+), max ([\d.]+)")
+
+# Metric, label, format and what counts as a regression: +1 if higher is worse, -1 if lower
+# is, 0 if it isn't judged (client CPU is reported, but the server is what's benchmarked)
+COLUMNS = [
+    ("ops_s", "ops/s", "%10.1f", -1),
+    ("mib_s", "MiB/s", "%10.2f", 0),
+    ("server_cpu_us", "srv us/op", "%10.1f", +1),
+    ("client_cpu_us", "cli us/op", "%10.1f", 0),
+    ("p50_us", "p50 [us]", "%10.1f", 0),
+    ("p99_us", "p99 [us]", "%10.1f", +1),
+    ("p999_us", "p99.9 [us]", "%10.1f", 0),
+    ("server_mib", "srv MiB", "%10.1f", 0),
+]
+
+
+def parse_size(text):
+    units = {"K": 1024, "M": 1024**2, "G": 1024**3}
+    text = text.strip().upper()
+    if text[-1] in units:
+        return int(text[:-1])*units[text[-1]]
+    return int(text)
+
+
+def format_size(size):
+    for unit, factor in (("M", 1024**2), ("K", 1024)):
+        if size >= factor and size % factor == 0:
+            return "%d%s" % (size//factor, unit)
+    return str(size)
+
+
+def process_cpu_seconds(pid):
+    """User + system time of a running process, including its finished threads"""
+    with open("/proc/%d/stat" % pid) as stat:
+        # The command name may contain spaces, so split after it
+        fields = stat.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12]))/os.sysconf("SC_CLK_TCK")
+
+
+def process_rss_mib(pid):
+    """Resident memory of a running process, 0 if it's gone"""
+    try:
+        with open("/proc/%d/status" % pid) as status:
+            for line in status:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1])/1024
+    except IOError:
+        pass
+    return 0.0
+
+
+def children_cpu_seconds():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+def port_in_use(port):
+    try:
+        socket.create_connection(("127.0.0.1", port), 0.2).close()
+        return True
+    except socket.error:
+        return False
+
+
+def make_certificate(work_dir):
+    """Self-signed certificate for the TLS modes, client_s3 doesn't verify it"""
+    with open(os.devnull, "w") as devnull:
+        subprocess.check_call(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                               "-nodes", "-subj", "/CN=localhost", "-days", "1",
+                               "-keyout", os.path.join(work_dir, "key.pem"), "-out", os.path.join(work_dir, "cert.pem")],
+                              stdout=devnull, stderr=devnull)
+
+
+def wait_for_port(port, server, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if server.poll() is not None:
+            return False
+        try:
+            sock = socket.create_connection(("127.0.0.1", port), 0.2)
+            sock.close()
+            return True
+        except socket.error:
+            time.sleep(0.05)
+    return False
+
+
+class Server(object):
+    def __init__(self, mode, port, work_dir, name=None):
+        self.mode = mode
+        self.port = port
+        self.work_dir = work_dir
+        self.env = dict(os.environ, BASELINER_LOCAL_DIR=os.path.join(work_dir, "objects"))
+        self.log = open(os.path.join(work_dir, "baseliner-%s.log" % (name or mode)), "ab")
+        self.process = None
+        self.upstream = None
+        if mode in UPSTREAMS:
+            self.upstream = Server(UPSTREAMS[mode], port + 1, work_dir, "%s-upstream" % mode)
+
+    def start(self):
+        # Otherwise whatever holds the port would be benchmarked instead
+        if port_in_use(self.port):
+            raise RuntimeError("port %d is already in use" % self.port)
+        upstream_port = None
+        if self.upstream is not None:
+            self.upstream.start()
+            upstream_port = self.upstream.port
+        args = [arg.format(upstream_port=upstream_port, work_dir=self.work_dir) for arg in MODES[self.mode]]
+        self.process = subprocess.Popen([SERVER] + args + [str(self.port)], env=self.env,
+                                        stdout=self.log, stderr=self.log)
+        if not wait_for_port(self.port, self.process):
+            self.stop()
+            raise RuntimeError("baseliner (%s) didn't start, see %s" % (self.mode, self.log.name))
+
+    def alive(self):
+        upstream_alive = self.upstream is None or self.upstream.alive()
+        return self.process is not None and self.process.poll() is None and upstream_alive
+
+    def cpu_seconds(self):
+        return process_cpu_seconds(self.process.pid)
+
+    def rss_mib(self):
+        return process_rss_mib(self.process.pid)
+
+    def stop(self):
+        if self.process is not None and self.process.poll() is None:
+            self.process.send_signal(signal.SIGINT)
+            deadline = time.time() + 5
+            while self.process.poll() is None and time.time() < deadline:
+                time.sleep(0.05)
+            if self.process.poll() is None:
+                self.process.kill()
+        if self.process is not None:
+            self.process.wait()
+        self.process = None
+        if self.upstream is not None:
+            self.upstream.stop()
+
+
+def run_cell(server, mode, size, concurrency, args, client_env):
+    """Runs the client against a running server, returns a dict of metrics or None on failure"""
+    threads = min(args.threads, concurrency)
+    send_only = "1" if mode == "raw" else "0"
+    cmd = [CLIENT, "-t", str(threads), "-c", str(concurrency), "-d", str(args.duration), "-p", args.payload]
+    cmd += [arg.format(hold=args.hold) for arg in CLIENT_ARGS.get(mode, [])]
+    cmd += ["127.0.0.1", str(server.port), "bench", "obj", str(size), "0", send_only]
+
+    server_cpu = server.cpu_seconds()
+    client_cpu = children_cpu_seconds()
+    server_mib = 0.0
+    # Into a file rather than a pipe, the server's memory is sampled while the client runs
+    with tempfile.TemporaryFile() as output_file:
+        client = subprocess.Popen(cmd, env=client_env, stdout=output_file, stderr=subprocess.STDOUT)
+        while client.poll() is None:
+            server_mib = max(server_mib, server.rss_mib())
+            time.sleep(0.05)
+        output_file.seek(0)
+        output = output_file.read().decode("utf-8", "replace")
+    client_cpu = children_cpu_seconds() - client_cpu
+    if not server.alive():
+        print("ERROR: baseliner (%s) died during the run" % mode, file=sys.stderr)
+        return None
+    server_cpu = server.cpu_seconds() - server_cpu
+
+    sent = SENT_RE.search(output)
+    rate = RATE_RE.search(output)
+    latency = LATENCY_RE.search(output)
+    if not (sent and rate and latency):
+        print("ERROR: Unexpected output from client_s3:\n%s" % output, file=sys.stderr)
+        return None
+
+    ops = int(sent.group(1))
+    return {
+        "ops": ops,
+        "errors": int(sent.group(2)),
+        "ops_s": float(rate.group(1)),
+        "mib_s": float(rate.group(2)),
+        "server_cpu_us": server_cpu*1e6/ops if ops else 0.0,
+        "client_cpu_us": client_cpu*1e6/ops if ops else 0.0,
+        "p50_us": float(latency.group(2)),
+        "p99_us": float(latency.group(4)),
+        "p999_us": float(latency.group(5)),
+        "server_mib": server_mib,
+    }
+
+
+def median_run(runs):
+    """The run with the median throughput, so a single noisy run doesn't decide, or None if any run failed"""
+    if None in runs:
+        return None
+    return sorted(runs, key=lambda run: run["ops_s"])[len(runs)//2]
+
+
+def cell_name(mode, size, concurrency):
+    return "%s/%s/c%d" % (mode, format_size(size), concurrency)
+
+
+def git_commit():
+    try:
+        return subprocess.check_output(["git", "rev-parse", "--short", "HEAD"], cwd=TOP_DIR,
+                                       stderr=open(os.devnull, "w")).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def machine_info():
+    return {"host": platform.node(), "cpus": os.sysconf("SC_NPROCESSORS_ONLN"), "kernel": platform.release()}
+
+
+def compare(results, baseline, threshold, latency_threshold):
+    """Returns {cell: [regressed metrics]} for cells present in both runs"""
+    regressions = {}
+    for name, cell in results.items():
+        base = baseline.get(name)
+        if cell is None or base is None:
+            continue
+        for metric, label, _, worse in COLUMNS:
+            if worse == 0 or base.get(metric, 0) <= 0:
+                continue
+            limit = latency_threshold if metric == "p99_us" else threshold
+            change = (cell[metric] - base[metric])/base[metric]*100
+            if change*worse > limit:
+                regressions.setdefault(name, []).append("%s %+.1f%%" % (label, change))
+    return regressions
+
+
+def print_report(order, results, regressions):
+    print("%-20s %8s" % ("cell", "errors") + "".join(" %10s" % column[1] for column in COLUMNS))
+    for name in order:
+        cell = results[name]
+        if cell is None:
+            print("%-20s %8s" % (name, "FAILED"))
+            continue
+        line = "%-20s %8d" % (name, cell["errors"])
+        line += "".join(" " + column[2] % cell[column[0]] for column in COLUMNS)
+        if name in regressions:
+            line += "  REGRESSION: " + ", ".join(regressions[name])
+        print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Runs the baseliner benchmark matrix.")
+    parser.add_argument("--modes", default="raw,http,storage", help="server modes (%s)" % ",".join(sorted(MODES)))
+    parser.add_argument("--sizes", default="4K,64K,1M", help="object sizes, with K or M suffixes (at most 1M)")
+    parser.add_argument("--concurrency", default="1,4,16", help="requests in flight")
+    parser.add_argument("--threads", type=int, default=1, help="client threads (at most the concurrency)")
+    parser.add_argument("--payload", default="random",
+                        help="object content, as client_s3 -p: random, constant or file:<path> (default: %(default)s)")
+    parser.add_argument("--duration", type=float, default=5, help="seconds per cell")
+    parser.add_argument("--hold", type=int, default=10000,
+                        help="idle connections the client holds open in idle mode (default: %(default)s)")
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="runs per cell, the one with the median throughput is reported (default: %(default)s)")
+    parser.add_argument("--port", type=int, default=8089, help="port for the server (the proxy's upstream takes the next one)")
+    parser.add_argument("--output", help="save the results to this JSON file")
+    parser.add_argument("--baseline", default=os.path.join(TOP_DIR, "bench-baseline.json"),
+                        help="compare against this results file if it exists (default: %(default)s)")
+    parser.add_argument("--save-baseline", action="store_true", help="save the results as the new baseline")
+    parser.add_argument("--threshold", type=float, default=10,
+                        help="%% change in throughput or server CPU/op flagged as a regression (default: %(default)s)")
+    parser.add_argument("--latency-threshold", type=float, default=25,
+                        help="%% change in p99 latency flagged as a regression (default: %(default)s)")
+    args = parser.parse_args()
+
+    modes = args.modes.split(",")
+    sizes = [parse_size(size) for size in args.sizes.split(",")]
+    levels = [int(level) for level in args.concurrency.split(",")]
+    for mode in modes:
+        if mode not in MODES:
+            parser.error("unknown mode: %s" % mode)
+    if max(sizes) > MAX_OBJECT_SIZE:
+        parser.error("object sizes can't exceed %d B (MAX_CONTENT_SIZE of baseliner)" % MAX_OBJECT_SIZE)
+    for binary in (SERVER, CLIENT):
+        if not os.access(binary, os.X_OK):
+            parser.error("%s not found, run `make bench`" % binary)
+
+    # client_s3 only needs a credentials file to sign requests, baseliner doesn't check them
+    work_dir = tempfile.mkdtemp(prefix="bench-")
+    os.makedirs(os.path.join(work_dir, ".aws"))
+    with open(os.path.join(work_dir, ".aws", "credentials"), "w") as creds:
+        creds.write("[default]\naws_access_key_id = BENCH\naws_secret_access_key = BENCH\n")
+    client_env = dict(os.environ, HOME=work_dir)
+    if any("{work_dir}/cert.pem" in MODES[mode] for mode in modes):
+        make_certificate(work_dir)
+
+    order = []
+    results = {}
+    print("INFO: %d cell(s), %d run(s) of %.1f s each, logs in %s"
+          % (len(modes)*len(sizes)*len(levels), args.repeat, args.duration, work_dir), file=sys.stderr)
+    try:
+        for mode in modes:
+            server = Server(mode, args.port, work_dir)
+            server.start()
+            try:
+                for size in sizes:
+                    for concurrency in levels:
+                        name = cell_name(mode, size, concurrency)
+                        print("INFO: Running %s" % name, file=sys.stderr)
+                        order.append(name)
+                        runs = []
+                        for _ in range(args.repeat):
+                            if not server.alive():
+                                server.stop()
+                                server.start()
+                            runs.append(run_cell(server, mode, size, concurrency, args, client_env))
+                        results[name] = median_run(runs)
+            finally:
+                server.stop()
+    finally:
+        shutil.rmtree(os.path.join(work_dir, "objects"), ignore_errors=True)
+
+    report = {"commit": git_commit(), "date": time.strftime("%Y-%m-%d %H:%M:%S"), "machine": machine_info(),
+              "duration": args.duration, "repeat": args.repeat, "payload": args.payload, "threads": args.threads, "cells": results}
+
+    regressions = {}
+    if os.path.exists(args.baseline) and not args.save_baseline:
+        with open(args.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+        print("INFO: Comparing with %s (commit %s, %s)" % (args.baseline, baseline.get("commit"), baseline.get("date")),
+              file=sys.stderr)
+        if baseline.get("machine") != report["machine"]:
+            print("WARNING: The baseline was recorded on a different machine (%s), results may not be comparable"
+                  % baseline.get("machine"), file=sys.stderr)
+        regressions = compare(results, baseline.get("cells", {}), args.threshold, args.latency_threshold)
+
+    print_report(order, results, regressions)
+
+    if args.output:
+        with open(args.output, "w") as output:
+            json.dump(report, output, indent=2, sort_keys=True)
+    if args.save_baseline:
+        with open(args.baseline, "w") as output:
+            json.dump(report, output, indent=2, sort_keys=True)
+        print("INFO: Saved the results as the baseline in %s" % args.baseline, file=sys.stderr)
+
+    failed = [name for name in order if results[name] is None]
+    if regressions:
+        print("ERROR: %d cell(s) regressed" % len(regressions), file=sys.stderr)
+    if failed:
+        print("ERROR: %d cell(s) failed" % len(failed), file=sys.stderr)
+    return 1 if regressions or failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+"""
+Converts an RGW ops log to a trace that `client_s3 -T` replays (see trace.h).
+
+Takes the JSON RGW writes to the ops log socket (rgw_ops_log_socket_path) or
+to a file, a JSON array (possibly cut short) or JSON lines, as well as the
+output of `radosgw-admin log show`. Object PUTs, GETs and DELETEs are kept,
+anything else (bucket operations, HEADs, listings, ...) is counted and skipped.
+
+The trace has a line per request, sorted by start time:
+
+  <timestamp>\t<op>\t<bucket>\t<key>\t<size>\t<latency_us>
+
+Usage: rgw_ops_log_to_trace.py [-o trace] [ops-log ...]  (stdin if no file given)
+"""
+from __future__ import print_function, division
+
+import argparse
+import calendar
+import json
+import re
+import sys
+
+try:
+    from urllib.parse import unquote
+except ImportError:
+    from urllib import unquote
+
+HEADER = "# timestamp\top\tbucket\tkey\tsize\tlatency_us\n"
+
+OPERATIONS = {
+    "put_obj": "PUT",
+    "get_obj": "GET",
+    "delete_obj": "DELETE",
+}
+
+TIME_RE = re.compile(r"(\d{4})-(\d\d)-(\d\d)[T ](\d\d):(\d\d):(\d\d)(\.\d+)?\s*(Z|[+-]\d\d:?\d\d)?")
+
+
+def parse_time(value):
+    """Seconds since the epoch of an RGW time stamp, UTC unless it has an offset"""
+    match = TIME_RE.match(value)
+    if match is None:
+        raise ValueError("unknown time format: %s" % value)
+    fields = [int(field) for field in match.groups()[:6]]
+    seconds = calendar.timegm(fields) + float(match.group(7) or 0)
+    offset = match.group(8)
+    if offset and offset != "Z":
+        minutes = int(offset[1:3])*60 + int(offset[-2:])
+        seconds -= minutes*60 if offset[0] == "+" else -minutes*60
+    return seconds
+
+
+def read_entries(text):
+    """Yields the log entries of any of the JSON layouts RGW writes"""
+    decoder = json.JSONDecoder()
+    pos = 0
+    while True:
+        # Arrays are read element by element, so one that was cut short still works
+        while pos < len(text) and text[pos] in " \t\r\n,[]":
+            pos += 1
+        if pos == len(text):
+            return
+        try:
+            value, pos = decoder.raw_decode(text, pos)
+        except ValueError:
+            # Most likely the last entry of a log that is still being written
+            print("WARNING: Ignoring unparsable data at offset %d" % pos, file=sys.stderr)
+            return
+        if isinstance(value, dict) and "log_entries" in value:
+            for entry in value["log_entries"]:
+                entry.setdefault("bucket", value.get("bucket", ""))
+                yield entry
+        elif isinstance(value, dict):
+            yield value
+
+
+def split_uri(uri):
+    """Method, bucket and key of a request line like "GET /bucket/key?query HTTP/1.1" """
+    parts = uri.split(" ")
+    method = parts[0] if len(parts) > 1 else ""
+    path = parts[1] if len(parts) > 1 else parts[0]
+    path = path.split("?", 1)[0].lstrip("/")
+    bucket, _, key = path.partition("/")
+    return method.upper(), unquote(bucket), unquote(key)
+
+
+def to_record(entry, time_unit):
+    """Trace fields of an entry, None if it can't be replayed"""
+    method, uri_bucket, uri_key = split_uri(entry.get("uri", ""))
+    operation = entry.get("operation", "")
+    op = OPERATIONS.get(operation)
+    if op is None and operation.upper() in ("PUT", "GET", "DELETE"):
+        op = operation.upper()
+    if op is None and not operation and method in ("PUT", "GET", "DELETE"):
+        op = method
+    # Bucket requests have no object
+    bucket = entry.get("bucket") or uri_bucket
+    key = entry.get("object") or uri_key
+    if op is None or not key:
+        return None
+    if any(c in key or c in bucket for c in "\t\r\n"):
+        return None
+
+    if op == "PUT":
+        size = entry.get("bytes_received") or entry.get("object_size") or 0
+    elif op == "GET":
+        size = entry.get("bytes_sent") or entry.get("object_size") or 0
+    else:
+        size = 0
+    latency = "-"
+    if "total_time" in entry:
+        latency = "%d" % (int(entry["total_time"])*(1000 if time_unit == "ms" else 1))
+    return (parse_time(entry["time"]), op, bucket, key, int(size), latency)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Converts an RGW ops log to a client_s3 trace.")
+    parser.add_argument("logs", nargs="*", help="ops log files (default: stdin)")
+    parser.add_argument("-o", "--output", help="trace file (default: stdout)")
+    parser.add_argument("--total-time-unit", choices=("ms", "us"), default="ms",
+                        help="unit of total_time, microseconds in logs of releases before Nautilus "
+                             "(default: %(default)s)")
+    args = parser.parse_args()
+
+    records = []
+    skipped = {}
+    for path in args.logs or ["-"]:
+        if path == "-":
+            text = sys.stdin.read()
+        else:
+            with open(path) as log:
+                text = log.read()
+        for entry in read_entries(text):
+            try:
+                record = to_record(entry, args.total_time_unit)
+            except (KeyError, ValueError) as e:
+                print("WARNING: Skipping entry: %s" % e, file=sys.stderr)
+                record = None
+            if record is None:
+                name = entry.get("operation") or split_uri(entry.get("uri", ""))[0] or "unknown"
+                skipped[name] = skipped.get(name, 0) + 1
+                continue
+            records.append(record)
+    records.sort(key=lambda record: record[0])
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    out.write(HEADER)
+    for record in records:
+        out.write("%.6f\t%s\t%s\t%s\t%d\t%s\n" % record)
+    if args.output:
+        out.close()
+
+    span = records[-1][0] - records[0][0] if records else 0
+    print("INFO: %d request(s) over %.1f s" % (len(records), span), file=sys.stderr)
+    for name in sorted(skipped):
+        print("INFO: Skipped %d %s request(s)" % (skipped[name], name), file=sys.stderr)
+    return 0 if records else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
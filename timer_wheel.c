@@ -0,0 +1,131 @@
+/*
+ * Hierarchical timing wheel, like the kernel's classic timer wheel. A timer due in
+ * fewer than 64 ticks goes to the level 0 slot of its tick; one due later goes to
+ * the level that covers it with the fewest ticks per slot. When level 0 wraps, the
+ * next slot of level 1 is emptied and its timers are placed again, now all within
+ * reach of level 0, and so on up the levels. Most timeouts are cancelled or pushed
+ * back long before they fire, and those only ever cost a list insertion and removal.
+ */
+#include <stddef.h>
+#include <string.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1UL << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct TimerWheel *wheel, const unsigned long now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+static void link_timer(struct Timer **slot, struct Timer *timer)
+{
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &timer->next;
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+/* Puts a timer in the slot of the lowest level that reaches its tick */
+static void place_timer(struct TimerWheel *wheel, struct Timer *timer)
+{
+    unsigned long delta = timer->expires - wheel->now;
+    int level;
+
+    // Overdue, it goes with the next tick
+    if ((long)delta < 0)
+    {
+        link_timer(&wheel->slots[0][wheel->now & SLOT_MASK], timer);
+        return;
+    }
+    if (delta > MAX_DELTA)
+    {
+        timer->expires = wheel->now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < 1UL << (TIMER_WHEEL_BITS*(level + 1)))
+            break;
+    }
+    link_timer(&wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS*level)) & SLOT_MASK], timer);
+}
+
+/* Moves the timers of a slot down, the time they were waiting for has come */
+static void cascade(struct TimerWheel *wheel, const int level, const unsigned long index)
+{
+    struct Timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL)
+    {
+        struct Timer *next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_add(struct TimerWheel *wheel, struct Timer *timer, const unsigned long expires)
+{
+    timer->expires = expires;
+    place_timer(wheel, timer);
+    wheel->pending++;
+}
+
+void timer_wheel_remove(struct TimerWheel *wheel, struct Timer *timer)
+{
+    if (!timer_pending(timer))
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->pending--;
+}
+
+/*
+ * Expires the timers due up to and including tick now. Returns them as a list
+ * linked through next, no longer pending, so they can be added again right away.
+ */
+struct Timer *timer_wheel_advance(struct TimerWheel *wheel, const unsigned long now)
+{
+    struct Timer *expired = NULL;
+
+    // Nothing to move down or expire on the way
+    if (wheel->pending == 0)
+    {
+        if ((long)(now - wheel->now) >= 0)
+            wheel->now = now + 1;
+        return NULL;
+    }
+    while ((long)(now - wheel->now) >= 0)
+    {
+        unsigned long index = wheel->now & SLOT_MASK;
+        int level;
+
+        // Each time a level wraps, the next slot of the level above comes down
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if ((wheel->now >> (TIMER_WHEEL_BITS*(level - 1))) & SLOT_MASK)
+                break;
+            cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_BITS*level)) & SLOT_MASK);
+        }
+
+        struct Timer *timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        while (timer != NULL)
+        {
+            struct Timer *next = timer->next;
+            timer->pprev = NULL;
+            timer->next = expired;
+            expired = timer;
+            wheel->pending--;
+            timer = next;
+        }
+        wheel->now++;
+    }
+
+    return expired;
+}
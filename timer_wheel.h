@@ -0,0 +1,40 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#include <stdbool.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4        // 2^24 ticks ahead at most, later timers fire then
+
+/* A timer, embedded in whatever it times out */
+struct Timer
+{
+    struct Timer *next;
+    struct Timer **pprev;           // the pointer to this timer in its slot, NULL if not pending
+    unsigned long expires;          // tick
+    void *data;
+};
+
+/*
+ * Hierarchical timing wheel: level 0 has a slot per tick, every further level a slot
+ * per full turn of the level below. Adding and removing a timer is O(1), and timers
+ * move down a level at most once per level as their time comes (see timer_wheel.c).
+ * Not thread-safe.
+ */
+struct TimerWheel
+{
+    unsigned long now;              // next tick to expire
+    unsigned long pending;
+    struct Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct TimerWheel*, const unsigned long);
+void timer_wheel_add(struct TimerWheel*, struct Timer*, const unsigned long);
+void timer_wheel_remove(struct TimerWheel*, struct Timer*);
+struct Timer *timer_wheel_advance(struct TimerWheel*, const unsigned long);
+
+static inline bool timer_pending(const struct Timer *timer)
+{
+    return timer->pprev != NULL;
+}
+#endif
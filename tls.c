@@ -0,0 +1,242 @@
+/*
+ * TLS for baseliner (-T) and client_s3 (-S), with OpenSSL on non-blocking sockets.
+ * Once a handshake is done, OpenSSL hands the keys to the kernel (kTLS, TCP_ULP
+ * "tls") if it can, so records are encrypted and decrypted in the kernel and
+ * sendfile() works on the socket again. That needs the tls kernel module and an
+ * AES-GCM cipher, otherwise records are encrypted in user space.
+ *
+ * The wrappers behave like read()/send(): they return -1 with errno EAGAIN when
+ * OpenSSL has to wait for the socket, 0 when the peer closed the connection.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+#define SESSION_ID_CONTEXT "baseliner"
+
+static unsigned long long thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void print_error(const char *what)
+{
+    char error[256];
+    ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+    fprintf(stderr, "ERROR: %s: %s\n", what, error);
+    ERR_clear_error();
+}
+
+/* Settings of both ends */
+static void set_common_options(SSL_CTX *ctx)
+{
+    // Retries continue from wherever the last write got to, like send() on a non-blocking socket
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Idle connections give back their record buffers (about 34 KiB), many connections are idle
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // A peer closing without close_notify is just the end of the connection (before 3.0 it always is)
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/* Context of a server with the certificate chain and key in PEM files, key may be NULL if it's in cert */
+SSL_CTX *tls_server_context(const char *cert, const char *key)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+    {
+        print_error("Creating a TLS context");
+        return NULL;
+    }
+    set_common_options(ctx);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key != NULL ? key : cert, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        print_error(cert);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    // Sessions are resumed from tickets (stateless) or the server's session cache
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)SESSION_ID_CONTEXT, strlen(SESSION_ID_CONTEXT));
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+#ifndef SSL_OP_ENABLE_KTLS
+    fprintf(stderr, "WARNING: OpenSSL was built without kTLS, records are encrypted in user space\n");
+#endif
+
+    return ctx;
+}
+
+/* Context of a client. Benchmark servers have self-signed certificates, so they aren't verified. */
+SSL_CTX *tls_client_context(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL)
+    {
+        print_error("Creating a TLS context");
+        return NULL;
+    }
+    set_common_options(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    return ctx;
+}
+
+/* Maps the result of a failed SSL call to what read()/send() would return */
+static ssize_t io_result(SSL *ssl, const int ret)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+#ifndef SSL_OP_IGNORE_UNEXPECTED_EOF
+            // Before 3.0 a peer closing without close_notify ends up here, without an error
+            if (ERR_peek_error() == 0 && errno == 0)
+                return 0;
+#endif
+            // errno says what went wrong
+            ERR_clear_error();
+            return -1;
+        default:
+            print_error("TLS");
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/*
+ * Advances the handshake of a connection. Returns 1 once it's done, 0 if it has to
+ * wait for the socket (SSL_want_write() tells for which direction) and -1 on error.
+ */
+int tls_handshake(SSL *ssl, struct TlsStats *stats)
+{
+    static bool warned = false;
+    unsigned long long start = thread_cpu_ns();
+    errno = 0;
+    int r = SSL_do_handshake(ssl);
+    __atomic_fetch_add(&stats->cpu_ns, thread_cpu_ns() - start, __ATOMIC_RELAXED);
+
+    if (r == 1)
+    {
+        bool ktls = tls_ktls_send(ssl);
+        __atomic_fetch_add(&stats->handshakes, 1, __ATOMIC_RELAXED);
+        if (SSL_session_reused(ssl))
+            __atomic_fetch_add(&stats->resumed, 1, __ATOMIC_RELAXED);
+        if (ktls)
+            __atomic_fetch_add(&stats->ktls_send, 1, __ATOMIC_RELAXED);
+        if (tls_ktls_recv(ssl))
+            __atomic_fetch_add(&stats->ktls_recv, 1, __ATOMIC_RELAXED);
+        if (!ktls && !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+            fprintf(stderr, "WARNING: kTLS isn't in use with %s, records are encrypted in user space "
+                    "(is the tls kernel module loaded? see %s)\n", SSL_get_cipher_name(ssl), TLS_ULP_FILE);
+        return 1;
+    }
+    int err = SSL_get_error(ssl, r);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        return 0;
+    __atomic_fetch_add(&stats->failed, 1, __ATOMIC_RELAXED);
+    if (err == SSL_ERROR_SYSCALL)
+    {
+        fprintf(stderr, "ERROR: TLS handshake failed: %s\n", errno ? strerror(errno) : "connection closed");
+        ERR_clear_error();
+    }
+    else
+        print_error("TLS handshake failed");
+    return -1;
+}
+
+ssize_t tls_read(SSL *ssl, void *buf, const size_t len)
+{
+#ifndef SSL_OP_IGNORE_UNEXPECTED_EOF
+    errno = 0;
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    size_t n;
+    int r = SSL_read_ex(ssl, buf, len, &n);
+    return r == 1 ? (ssize_t)n : io_result(ssl, r);
+#else
+    int r = SSL_read(ssl, buf, len < INT_MAX ? (int)len : INT_MAX);
+    return r > 0 ? r : io_result(ssl, r);
+#endif
+}
+
+/* Partial writes are enabled, so this may write less than len */
+ssize_t tls_write(SSL *ssl, const void *buf, const size_t len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    size_t n;
+    int r = SSL_write_ex(ssl, buf, len, &n);
+    return r == 1 ? (ssize_t)n : io_result(ssl, r);
+#else
+    int r = SSL_write(ssl, buf, len < INT_MAX ? (int)len : INT_MAX);
+    return r > 0 ? r : io_result(ssl, r);
+#endif
+}
+
+/* Sends part of a file without copying it to user space, only with kTLS (see tls_ktls_send()) */
+ssize_t tls_sendfile(SSL *ssl, const int fd, const off_t offset, const size_t len)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    ossl_ssize_t n = SSL_sendfile(ssl, fd, offset, len, 0);
+    return n >= 0 ? n : io_result(ssl, (int)n);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Whether the kernel encrypts what is sent on the connection */
+bool tls_ktls_send(SSL *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+    return false;
+#endif
+}
+
+/* Whether the kernel decrypts what is received on the connection */
+bool tls_ktls_recv(SSL *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+#else
+    return false;
+#endif
+}
+
+void tls_stats_add(struct TlsStats *total, const struct TlsStats *stats)
+{
+    total->handshakes += stats->handshakes;
+    total->resumed += stats->resumed;
+    total->failed += stats->failed;
+    total->ktls_send += stats->ktls_send;
+    total->ktls_recv += stats->ktls_recv;
+    total->cpu_ns += stats->cpu_ns;
+}
+
+/* Goes to stdout for client_s3, which prints its results there */
+void tls_print_stats(FILE *out, const struct TlsStats *stats, const double elapsed)
+{
+    fprintf(out, "INFO: TLS: %lu handshake(s) (%.1f/s), %lu resumed, %lu failed, %.1f us CPU per handshake\n",
+            stats->handshakes, elapsed > 0 ? stats->handshakes/elapsed : 0, stats->resumed, stats->failed,
+            stats->handshakes > 0 ? stats->cpu_ns/1e3/stats->handshakes : 0);
+    fprintf(out, "INFO: kTLS: sending on %lu, receiving on %lu of %lu connection(s)\n",
+            stats->ktls_send, stats->ktls_recv, stats->handshakes);
+}
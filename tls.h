@@ -0,0 +1,31 @@
+#ifndef TLS_H
+#define TLS_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#define TLS_ULP_FILE "/proc/sys/net/ipv4/tcp_available_ulp"
+
+/* Handshakes of the connections of a server, or of a client worker, updated atomically */
+struct TlsStats
+{
+    unsigned long handshakes;
+    unsigned long resumed;          // abbreviated handshakes, from a session ticket or the session cache
+    unsigned long failed;
+    unsigned long ktls_send;        // connections whose records are encrypted by the kernel
+    unsigned long ktls_recv;        // and decrypted by it
+    unsigned long long cpu_ns;      // spent in handshakes, on the threads doing them
+};
+
+SSL_CTX *tls_server_context(const char*, const char*);
+SSL_CTX *tls_client_context(void);
+int tls_handshake(SSL*, struct TlsStats*);
+ssize_t tls_read(SSL*, void*, const size_t);
+ssize_t tls_write(SSL*, const void*, const size_t);
+ssize_t tls_sendfile(SSL*, const int, const off_t, const size_t);
+bool tls_ktls_send(SSL*);
+bool tls_ktls_recv(SSL*);
+void tls_stats_add(struct TlsStats*, const struct TlsStats*);
+void tls_print_stats(FILE*, const struct TlsStats*, const double);
+#endif
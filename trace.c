@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "trace.h"
+
+// Not op_name() from workload.c, so the server doesn't need to link it
+static const char *trace_op_names[N_OPS] = {"PUT", "GET", "DELETE"};
+
+/* Looks up an operation by name. Returns -1 if it's not one that can be replayed. */
+int trace_op(const char *name, enum OpType *op)
+{
+    int i;
+
+    for (i = 0; i < N_OPS; i++)
+    {
+        if (!strcasecmp(name, trace_op_names[i]))
+        {
+            *op = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Writes a record as a trace line. Returns its length, which is more than size if it was cut. */
+int trace_format(const struct TraceRecord *record, char *buf, const size_t size)
+{
+    char latency[24] = "-";
+
+    if (record->latency_us >= 0)
+        snprintf(latency, sizeof(latency), "%ld", record->latency_us);
+    return snprintf(buf, size, "%.6f\t%s\t%s\t%s\t%lu\t%s\n", record->timestamp, trace_op_names[record->op],
+                    record->bucket, record->key, record->size, latency);
+}
+
+static int compare_timestamps(const void *a, const void *b)
+{
+    const struct TraceRecord *ra = a, *rb = b;
+
+    if (ra->timestamp < rb->timestamp)
+        return -1;
+    return ra->timestamp > rb->timestamp;
+}
+
+/* Splits a line at tabs, without merging empty fields like strtok does. Returns the number of fields. */
+static int split_fields(char *line, char **fields, const int max_fields)
+{
+    int n = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    while (n < max_fields)
+    {
+        fields[n++] = line;
+        line = strchr(line, '\t');
+        if (line == NULL)
+            break;
+        *line++ = '\0';
+    }
+    return n;
+}
+
+int trace_load(struct Trace *trace, const char *path)
+{
+    char line[TRACE_LINE_SIZE];
+    unsigned long capacity = 1024;
+    int line_no = 0;
+
+    memset(trace, 0, sizeof(*trace));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    trace->records = malloc(capacity*sizeof(struct TraceRecord));
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *fields[6];
+        line_no++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (trace->n_records == capacity)
+        {
+            capacity *= 2;
+            trace->records = realloc(trace->records, capacity*sizeof(struct TraceRecord));
+        }
+
+        struct TraceRecord *record = &trace->records[trace->n_records];
+        char *end;
+        if (split_fields(line, fields, 6) != 6 || trace_op(fields[1], &record->op) == -1)
+        {
+            fprintf(stderr, "ERROR: %s:%d: expected \"<timestamp> <op> <bucket> <key> <size> <latency_us>\" "
+                    "separated by tabs, with op PUT, GET or DELETE\n", path, line_no);
+            fclose(file);
+            trace_destroy(trace);
+            return -1;
+        }
+        record->timestamp = strtod(fields[0], &end);
+        if (end == fields[0] || fields[3][0] == '\0')
+        {
+            fprintf(stderr, "ERROR: %s:%d: invalid timestamp or empty key\n", path, line_no);
+            fclose(file);
+            trace_destroy(trace);
+            return -1;
+        }
+        snprintf(record->bucket, sizeof(record->bucket), "%s", fields[2]);
+        snprintf(record->key, sizeof(record->key), "%s", fields[3]);
+        record->size = strtoul(fields[4], NULL, 10);
+        record->latency_us = fields[5][0] == '-' ? -1 : strtol(fields[5], NULL, 10);
+        if (record->size > trace->max_size)
+            trace->max_size = record->size;
+        trace->n_records++;
+    }
+    fclose(file);
+
+    if (trace->n_records == 0)
+    {
+        fprintf(stderr, "ERROR: %s: no requests in trace\n", path);
+        trace_destroy(trace);
+        return -1;
+    }
+    // Servers log requests when they finish, replays need them in the order they started
+    qsort(trace->records, trace->n_records, sizeof(struct TraceRecord), compare_timestamps);
+
+    return 0;
+}
+
+void trace_destroy(struct Trace *trace)
+{
+    free(trace->records);
+    trace->records = NULL;
+    trace->n_records = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stddef.h>
+#include "workload.h"
+
+#define TRACE_LINE_SIZE 512
+#define TRACE_HEADER "# timestamp\top\tbucket\tkey\tsize\tlatency_us\n"
+
+/*
+ * One request of a recorded workload. Traces are text files with a record per line:
+ *
+ *   <timestamp>\t<op>\t<bucket>\t<key>\t<size>\t<latency_us>
+ *
+ * The timestamp is when the request started, in seconds since the epoch (with
+ * microseconds), op is PUT, GET or DELETE, and the key is not URI-encoded. The
+ * size is that of the object written or read, and the latency is "-" if not known.
+ * Lines starting with '#' are comments. baseliner -t writes this format, client_s3 -T
+ * replays it and scripts/rgw_ops_log_to_trace.py converts RGW ops logs to it.
+ */
+struct TraceRecord
+{
+    double timestamp;
+    enum OpType op;
+    char bucket[64];
+    char key[256];
+    unsigned long size;
+    long latency_us;        // -1 if not known
+};
+
+struct Trace
+{
+    struct TraceRecord *records;    // sorted by timestamp
+    unsigned long n_records;
+    unsigned long max_size;
+};
+
+int trace_load(struct Trace*, const char*);
+void trace_destroy(struct Trace*);
+int trace_format(const struct TraceRecord*, char*, const size_t);
+int trace_op(const char*, enum OpType*);
+#endif
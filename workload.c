@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "workload.h"
+
+#define KiB 1024UL
+#define DEFAULT_KEY_SPACE 10000
+#define MAX_LOGNORMAL_SIZE 1024*1024*1024UL
+
+static const char *op_names[N_OPS] = {"PUT", "GET", "DELETE"};
+static const char *size_class_names[N_SIZE_CLASSES] = {"<64KiB", "64KiB-1MiB", "1-16MiB", "16-256MiB", ">=256MiB"};
+
+/* Parses a size with an optional K, M or G (binary) suffix. Returns 0 on error. */
+static unsigned long parse_size(const char *str, char **end)
+{
+    unsigned long size = strtoul(str, end, 10);
+    switch (**end)
+    {
+        case 'K': case 'k': size *= KiB; (*end)++; break;
+        case 'M': case 'm': size *= KiB*KiB; (*end)++; break;
+        case 'G': case 'g': size *= KiB*KiB*KiB; (*end)++; break;
+    }
+    return size;
+}
+
+static int parse_ops(struct Workload *workload, const char *value)
+{
+    double weights[N_OPS] = {0};
+    double total = 0;
+    char buf[256];
+    char *saveptr;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    char *item = strtok_r(buf, ",", &saveptr);
+    while (item != NULL)
+    {
+        char *colon = strchr(item, ':');
+        if (colon == NULL)
+            return -1;
+        *colon = '\0';
+        for (i = 0; i < N_OPS; i++)
+            if (!strcasecmp(item, op_names[i]))
+                break;
+        if (i == N_OPS)
+        {
+            fprintf(stderr, "ERROR: Unknown operation in workload: %s\n", item);
+            return -1;
+        }
+        weights[i] = atof(colon + 1);
+        total += weights[i];
+        item = strtok_r(NULL, ",", &saveptr);
+    }
+    if (total <= 0)
+        return -1;
+
+    double sum = 0;
+    for (i = 0; i < N_OPS; i++)
+    {
+        sum += weights[i];
+        workload->op_cumulative[i] = sum/total;
+    }
+    return 0;
+}
+
+static int parse_sizes(struct Workload *workload, const char *value)
+{
+    char *end;
+
+    if (!strncmp(value, "fixed:", strlen("fixed:")))
+    {
+        workload->size_dist = SIZE_FIXED;
+        workload->size_min = workload->size_max = parse_size(value + strlen("fixed:"), &end);
+    }
+    else if (!strncmp(value, "uniform:", strlen("uniform:")))
+    {
+        workload->size_dist = SIZE_UNIFORM;
+        workload->size_min = parse_size(value + strlen("uniform:"), &end);
+        if (*end != '-')
+            return -1;
+        workload->size_max = parse_size(end + 1, &end);
+        if (workload->size_max < workload->size_min)
+            return -1;
+    }
+    else if (!strncmp(value, "lognormal:", strlen("lognormal:")))
+    {
+        // lognormal:<median>:<sigma>[:<max>]
+        workload->size_dist = SIZE_LOGNORMAL;
+        unsigned long median = parse_size(value + strlen("lognormal:"), &end);
+        if (median == 0 || *end != ':')
+            return -1;
+        workload->lognormal_mu = log(median);
+        workload->lognormal_sigma = strtod(end + 1, &end);
+        // Without an explicit cap, cut off the tail beyond 4 sigma
+        double max = median*exp(4*workload->lognormal_sigma);
+        workload->size_max = max > MAX_LOGNORMAL_SIZE ? MAX_LOGNORMAL_SIZE : (unsigned long)max;
+        if (*end == ':')
+            workload->size_max = parse_size(end + 1, &end);
+        workload->size_min = 0;
+    }
+    else if (!strncmp(value, "histogram:", strlen("histogram:")))
+    {
+        // histogram:<size>:<weight>,<size>:<weight>,...
+        double total = 0;
+        const char *p = value + strlen("histogram:");
+        workload->size_dist = SIZE_HISTOGRAM;
+        workload->n_bins = 0;
+        workload->size_max = 0;
+        while (*p != '\0' && workload->n_bins < MAX_SIZE_BINS)
+        {
+            unsigned long size = parse_size(p, &end);
+            if (*end != ':')
+                return -1;
+            double weight = strtod(end + 1, &end);
+            total += weight;
+            workload->bin_sizes[workload->n_bins] = size;
+            workload->bin_cumulative[workload->n_bins] = total;
+            if (size > workload->size_max)
+                workload->size_max = size;
+            workload->n_bins++;
+            p = (*end == ',') ? end + 1 : end;
+        }
+        if (workload->n_bins == 0 || total <= 0)
+            return -1;
+        unsigned int i;
+        for (i = 0; i < workload->n_bins; i++)
+            workload->bin_cumulative[i] /= total;
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+/* Precomputes the constants of the Zipfian generator from YCSB (Gray et al., "Quickly generating billion-record synthetic databases") */
+static void init_zipf(struct Workload *workload)
+{
+    double theta = workload->zipf_theta;
+    unsigned long n = workload->key_space;
+    double zetan = 0, zeta2 = 1 + pow(0.5, theta);
+    unsigned long i;
+
+    for (i = 1; i <= n; i++)
+        zetan += 1/pow(i, theta);
+    workload->zipf_zetan = zetan;
+    workload->zipf_alpha = 1/(1 - theta);
+    workload->zipf_eta = (1 - pow(2.0/n, 1 - theta))/(1 - zeta2/zetan);
+}
+
+int workload_load(struct Workload *workload, const char *path)
+{
+    char line[1024];
+    int line_no = 0;
+
+    memset(workload, 0, sizeof(*workload));
+    // PUTs of 4 MiB objects unless the file says otherwise
+    workload->op_cumulative[OP_PUT] = workload->op_cumulative[OP_GET] = workload->op_cumulative[OP_DELETE] = 1;
+    workload->size_dist = SIZE_FIXED;
+    workload->size_min = workload->size_max = 4*KiB*KiB;
+    workload->key_dist = KEYS_UNIFORM;
+    workload->key_space = DEFAULT_KEY_SPACE;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char name[64], value[900];
+        line_no++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, " %63[^= \t] = %899[^\r\n]", name, value) != 2)
+        {
+            fprintf(stderr, "ERROR: %s:%d: expected \"name = value\"\n", path, line_no);
+            fclose(file);
+            return -1;
+        }
+
+        int err = 0;
+        if (!strcmp(name, "ops"))
+            err = parse_ops(workload, value);
+        else if (!strcmp(name, "size"))
+            err = parse_sizes(workload, value);
+        else if (!strcmp(name, "keys"))
+        {
+            if (!strcmp(value, "uniform"))
+                workload->key_dist = KEYS_UNIFORM;
+            else if (!strncmp(value, "zipf:", strlen("zipf:")))
+            {
+                workload->key_dist = KEYS_ZIPF;
+                workload->zipf_theta = atof(value + strlen("zipf:"));
+                // The generator needs theta in (0, 1)
+                err = (workload->zipf_theta <= 0 || workload->zipf_theta >= 1) ? -1 : 0;
+            }
+            else
+                err = -1;
+        }
+        else if (!strcmp(name, "key_space"))
+        {
+            workload->key_space = strtoul(value, NULL, 10);
+            err = workload->key_space == 0 ? -1 : 0;
+        }
+        else if (!strcmp(name, "concurrency"))
+            workload->concurrency = atoi(value);
+        else if (!strcmp(name, "duration"))
+            workload->duration = atof(value);
+        else
+        {
+            fprintf(stderr, "ERROR: %s:%d: unknown setting \"%s\"\n", path, line_no, name);
+            err = -1;
+        }
+        if (err == -1)
+        {
+            fprintf(stderr, "ERROR: %s:%d: invalid value for %s: %s\n", path, line_no, name, value);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+
+    if (workload->key_dist == KEYS_ZIPF)
+        init_zipf(workload);
+
+    return 0;
+}
+
+/* Uniform double in [0, 1) from a xorshift64 state */
+double rng_uniform(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return (x >> 11) * (1.0/9007199254740992.0);
+}
+
+enum OpType workload_op(const struct Workload *workload, uint64_t *rng)
+{
+    double u = rng_uniform(rng);
+    int i;
+
+    for (i = 0; i < N_OPS - 1; i++)
+        if (u < workload->op_cumulative[i])
+            break;
+    return i;
+}
+
+unsigned long workload_size(const struct Workload *workload, uint64_t *rng)
+{
+    double u, size;
+    unsigned int i;
+
+    switch (workload->size_dist)
+    {
+        case SIZE_UNIFORM:
+            return workload->size_min + (unsigned long)(rng_uniform(rng)*(workload->size_max - workload->size_min + 1));
+        case SIZE_LOGNORMAL:
+            // Box-Muller
+            u = rng_uniform(rng);
+            size = exp(workload->lognormal_mu + workload->lognormal_sigma
+                       * sqrt(-2*log(1 - u)) * cos(2*M_PI*rng_uniform(rng)));
+            return size > workload->size_max ? workload->size_max : (unsigned long)size;
+        case SIZE_HISTOGRAM:
+            u = rng_uniform(rng);
+            for (i = 0; i < workload->n_bins - 1; i++)
+                if (u < workload->bin_cumulative[i])
+                    break;
+            return workload->bin_sizes[i];
+        case SIZE_FIXED:
+        default:
+            return workload->size_min;
+    }
+}
+
+unsigned long workload_key(const struct Workload *workload, uint64_t *rng)
+{
+    double u = rng_uniform(rng);
+
+    if (workload->key_dist == KEYS_UNIFORM)
+        return (unsigned long)(u*workload->key_space);
+
+    double uz = u*workload->zipf_zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow(0.5, workload->zipf_theta))
+        return 1;
+    unsigned long key = (unsigned long)(workload->key_space
+                                        * pow(workload->zipf_eta*u - workload->zipf_eta + 1, workload->zipf_alpha));
+    return key < workload->key_space ? key : workload->key_space - 1;
+}
+
+unsigned long workload_max_size(const struct Workload *workload)
+{
+    return workload->size_max;
+}
+
+int size_class(const unsigned long size)
+{
+    if (size < 64*KiB)
+        return 0;
+    if (size < KiB*KiB)
+        return 1;
+    if (size < 16*KiB*KiB)
+        return 2;
+    if (size < 256*KiB*KiB)
+        return 3;
+    return 4;
+}
+
+const char *size_class_name(const int size_class)
+{
+    return size_class_names[size_class];
+}
+
+const char *op_name(const enum OpType op)
+{
+    return op_names[op];
+}
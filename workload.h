@@ -0,0 +1,72 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+#include <stdint.h>
+
+#define MAX_SIZE_BINS 32
+#define N_SIZE_CLASSES 5
+
+enum OpType
+{
+    OP_PUT,
+    OP_GET,
+    OP_DELETE,
+    N_OPS
+};
+
+enum SizeDistribution
+{
+    SIZE_FIXED,
+    SIZE_UNIFORM,       // between size_min and size_max
+    SIZE_LOGNORMAL,     // with the given median and sigma
+    SIZE_HISTOGRAM      // discrete sizes with weights
+};
+
+enum KeyDistribution
+{
+    KEYS_UNIFORM,
+    KEYS_ZIPF
+};
+
+/*
+ * A workload profile, read from a file of "name = value" lines:
+ *
+ *   ops = put:70,get:25,delete:5
+ *   size = fixed:4M | uniform:1K-64K | lognormal:<median>:<sigma> | histogram:4K:50,64K:30,256M:1
+ *   keys = uniform | zipf:<theta>
+ *   key_space = 100000
+ *   concurrency = 64
+ *   duration = 60
+ *
+ * Sizes take K, M and G (binary) suffixes. Lines starting with '#' are comments.
+ */
+struct Workload
+{
+    double op_cumulative[N_OPS];
+    enum SizeDistribution size_dist;
+    unsigned long size_min;
+    unsigned long size_max;
+    double lognormal_mu;
+    double lognormal_sigma;
+    unsigned int n_bins;
+    unsigned long bin_sizes[MAX_SIZE_BINS];
+    double bin_cumulative[MAX_SIZE_BINS];
+    enum KeyDistribution key_dist;
+    unsigned long key_space;
+    double zipf_theta;
+    double zipf_zetan;      // constants of the YCSB Zipfian generator
+    double zipf_alpha;
+    double zipf_eta;
+    int concurrency;        // 0 if not set in the file
+    double duration;        // 0 if not set in the file
+};
+
+int workload_load(struct Workload*, const char*);
+double rng_uniform(uint64_t*);
+enum OpType workload_op(const struct Workload*, uint64_t*);
+unsigned long workload_size(const struct Workload*, uint64_t*);
+unsigned long workload_key(const struct Workload*, uint64_t*);
+unsigned long workload_max_size(const struct Workload*);
+int size_class(const unsigned long);
+const char *size_class_name(const int);
+const char *op_name(const enum OpType);
+#endif